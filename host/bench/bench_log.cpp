@@ -0,0 +1,317 @@
+// Throughput benchmark of the sampling loop (Esp32MAClientLog::update)
+//
+// Drives update() with MAXNUMVARS registered variables on a virtual clock that
+// advances 1 ms per call, while a consumer drains the RAM buffer like the
+// sending task would. Reports:
+//
+// - samples/s and update() calls/s (wall time)
+// - update() latency percentiles (the enqueue latency seen by the loop)
+// - per-call cost of _shouldVarBeUpdated, _fillVarFromIdTs and _pushVarToBuffer
+//
+// With --backlog N the SD buffer starts with N records (as after a network outage)
+// and every SD open costs 100 us, like a real card over SPI.
+//
+// With --outage nothing is drained (network down): the RAM buffer overflows to the SD.
+//
+// With --compress the SD segments are compressed (compare the bytes written).
+//
+// With --sdtask the SD buffer is accessed by the SD task: the update() latency does not
+// include the SD opens. The virtual clock runs much faster than the task, so the loop waits
+// for the task out of the measured time (see waitSDTask).
+//
+// With --psram N the log has a PSRAM ring of N records between the RAM buffer and the SD:
+// an outage shorter than the ring does not write to the SD.
+//
+// With --ring the RAM buffer is the lock-free SPSCBuffer instead of the FreeRTOS queue.
+//
+// With --deadband or --sdt every variable is compressed with a dead band or a swinging door
+// of tolerance 4 (compare the samples sent).
+//
+// With --drainrate N the consumer only drains N records per second (a slow network): the
+// samples that do not fit are lost. --backpressure enables the backpressure, which stretches the sampling
+// periods instead of losing samples.
+//
+// With --overflow newest|oldest|priority|coalesce the records that do not fit in the buffers wait in the
+// overflow stage with that policy (the variables get priorities 0..3). The counters of each outcome are printed.
+//
+// Usage: bench_log [iterations] [--sd] [--backlog N] [--outage] [--compress] [--sdtask] [--psram N] [--ring]
+//                  [--deadband | --sdt] [--drainrate N] [--backpressure]
+//                  [--overflow newest|oldest|priority|coalesce]
+
+#include <Arduino.h>
+#include <HostShims.h>
+
+#include "Esp32MALog.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static inline uint64_t nowNanos() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t percentile(std::vector<uint64_t>& sorted, double pct) {
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)(pct / 100.0 * (double)(sorted.size() - 1));
+    return sorted[idx];
+}
+
+static int values[MAXNUMVARS];
+
+static int drainBuffer(Esp32MAClientLog& log, int maxRecords = MAXBUFFER) {
+    varStamp_t varStamp;
+    int drained = 0;
+    SPSCBuffer* ring = log._getPtrRing();
+    if (ring != NULL) while (drained < maxRecords && ring->pop(&varStamp)) drained++;
+    else while (drained < maxRecords && xQueueReceive(*log._getPtrBuffer(), &varStamp, 0) == pdPASS) drained++;
+    return drained;
+}
+
+static void mutateValues(int numVars) {
+    for (int i = 0; i < numVars; i++) values[i] += (int)random(-2, 3);
+}
+
+
+class Esp32MAClientLogBench {
+
+    public:
+
+        Esp32MAClientLogBench(Esp32MAClientLog& log) : _log(log) {}
+
+        void registerVars(int numVars, varCompression_t compression) {
+            for (int i = 0; i < numVars; i++) {
+                values[i] = 1000 + i;
+                // Mix of periodic (10..330 ms), threshold based and max period variables
+                int minPeriod = 10 + (i % 12) * 30;
+                int threshold = (i % 3 == 0) ? 2 : 0;
+                int maxPeriod = (i % 4 == 0) ? 1000 : -1;
+                if (compression != VAR_THRESHOLD) threshold = 4;
+                _log.registerVar("var" + String(i), &values[i], minPeriod, threshold, maxPeriod, compression);
+            }
+            _numVars = numVars;
+        }
+
+        void fillSDBacklog(int numRecords) {
+            varStamp_t varStamp;
+            for (int i = 0; i < numRecords; i++) {
+                _log._fillVarFromIdTs(&varStamp, i % _numVars, 1500000000UL + i);
+                _log._sdBufferCom.push(&varStamp);
+            }
+            printf("SD backlog: %d records\n", _log._sdBufferCom.bufferSize());
+        }
+
+        void setPriorities() {
+            for (int i = 0; i < _numVars; i++) _log.setVarPriority(i, i % (VARPRIORITYMAX + 1));
+        }
+
+        int sdBacklog() { return _log._sdBacklogSize(); }
+
+        int memTierSize() { return _log._memTier != NULL ? _log._memTier->size() : 0; }
+
+        void runLoop(unsigned long iterations, bool outage, int drainRate) {
+
+            std::vector<uint64_t> latencies;
+            latencies.reserve(iterations);
+
+            unsigned long samples = 0;
+            uint64_t total = 0;
+
+            for (unsigned long it = 0; it < iterations; it++) {
+
+                hostAdvanceMillis(1);
+                if ((it % 50) == 0) mutateValues(_numVars);
+
+                uint64_t t0 = nowNanos();
+                _log.update(1600000000UL + millis() / 1000);
+                uint64_t t1 = nowNanos();
+
+                latencies.push_back(t1 - t0);
+                total += t1 - t0;
+
+                if (!outage && drainRate == 0) samples += drainBuffer(_log);
+                else if (!outage) samples += drainBuffer(_log, (int)((it + 1) * drainRate / 1000 - it * drainRate / 1000));
+
+                if (_log._sdTaskRunning) waitSDTask(outage);
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+
+            if (outage) samples = _log._ramBufferSize() + memTierSize() + sdBacklog(); // Buffered, not drained
+
+            double seconds = (double)total / 1e9;
+            if (outage) printf("update() loop (outage): %lu calls, %d vars, %lu samples, buffer %s, %d lost\n",
+                iterations, _numVars, samples, _log.getBufferInfo().c_str(), _log._varsNotBufferedAndLost);
+            else if (drainRate > 0) printf("update() loop (drain %d/s): %lu calls, %d vars, %lu samples, buffer %s, %d lost\n",
+                drainRate, iterations, _numVars, samples, _log.getBufferInfo().c_str(), _log._varsNotBufferedAndLost);
+            else printf("update() loop: %lu calls, %d vars, %lu samples\n", iterations, _numVars, samples);
+            printf("  samples/s          : %.0f\n", samples / seconds);
+            printf("  update() calls/s   : %.0f\n", iterations / seconds);
+            printf("  update() latency ns: p50=%llu p99=%llu max=%llu\n",
+                (unsigned long long)percentile(latencies, 50),
+                (unsigned long long)percentile(latencies, 99),
+                (unsigned long long)latencies.back());
+
+            // Calls that waited for the SD card (an open costs 100 us in the SD runs)
+            unsigned long stalls = 0;
+            for (uint64_t latency : latencies) if (latency > 50000) stalls++;
+            printf("  update() calls > 50 us: %lu\n", stalls);
+        }
+
+        // The SD task runs on the wall clock: wait until it has written the requests
+        // and, if the SD backlog is being drained, refilled its queue (at most 100 ms)
+
+        void waitSDTask(bool outage) {
+
+            uint64_t t0 = nowNanos();
+
+            while (nowNanos() - t0 < 100000000ULL) {
+                bool requestsPending = uxQueueMessagesWaiting(_log._xSDRequests) > SDREQUESTQUEUESIZE / 2;
+                bool refillPending = !outage && _log._sdBacklog > 0 && uxQueueMessagesWaiting(_log._xSDRefill) == 0;
+                if (!requestsPending && !refillPending) break;
+                std::this_thread::yield();
+            }
+        }
+
+        void runHotPaths(unsigned long iterations) {
+
+            volatile bool sink = false;
+            varStamp_t varStamp;
+
+            _log._nowMillis = millis();
+
+            uint64_t t0 = nowNanos();
+            for (unsigned long it = 0; it < iterations; it++) {
+                sink = _log._shouldVarBeUpdated((int)(it % _numVars));
+            }
+            uint64_t t1 = nowNanos();
+            printf("  _shouldVarBeUpdated: %.1f ns/call\n", (double)(t1 - t0) / iterations);
+
+            t0 = nowNanos();
+            for (unsigned long it = 0; it < iterations; it++) {
+                _log._fillVarFromIdTs(&varStamp, (int)(it % _numVars), it);
+            }
+            t1 = nowNanos();
+            printf("  _fillVarFromIdTs   : %.1f ns/call\n", (double)(t1 - t0) / iterations);
+
+            // Drain between calls so every push finds space in the RAM buffer
+            uint64_t pushNanos = 0;
+            for (unsigned long it = 0; it < iterations; it++) {
+                t0 = nowNanos();
+                sink = _log._pushVarToBuffer((int)(it % _numVars), it);
+                pushNanos += nowNanos() - t0;
+                drainBuffer(_log);
+            }
+            printf("  _pushVarToBuffer   : %.1f ns/call\n", (double)pushNanos / iterations);
+
+            (void)sink;
+        }
+
+    private:
+
+        Esp32MAClientLog& _log;
+        int _numVars = 0;
+};
+
+
+int main(int argc, char** argv) {
+
+    unsigned long iterations = 200000;
+    bool enableSD = false;
+    int backlog = 0;
+    bool outage = false;
+    bool compress = false;
+    bool sdTask = false;
+    int psram = 0;
+    bool ring = false;
+    varCompression_t compression = VAR_THRESHOLD;
+    int drainRate = 0;
+    bool backpressure = false;
+    int overflowPolicy = -1;
+    int sdQuotaSegments = 0;
+    const char* overflowNames[] = {"newest", "oldest", "priority", "coalesce"};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sd") == 0) enableSD = true;
+        else if (strcmp(argv[i], "--outage") == 0) outage = true;
+        else if (strcmp(argv[i], "--compress") == 0) compress = true;
+        else if (strcmp(argv[i], "--sdtask") == 0) sdTask = true;
+        else if (strcmp(argv[i], "--ring") == 0) ring = true;
+        else if (strcmp(argv[i], "--deadband") == 0) compression = VAR_DEADBAND;
+        else if (strcmp(argv[i], "--sdt") == 0) compression = VAR_SWINGINGDOOR;
+        else if (strcmp(argv[i], "--backpressure") == 0) backpressure = true;
+        else if (strcmp(argv[i], "--drainrate") == 0 && i + 1 < argc) drainRate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+            i++;
+            for (int p = 0; p < 4; p++) if (strcmp(argv[i], overflowNames[p]) == 0) overflowPolicy = p;
+        }
+        else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) backlog = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--psram") == 0 && i + 1 < argc) psram = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sdquota") == 0 && i + 1 < argc) sdQuotaSegments = atoi(argv[++i]);
+        else iterations = strtoul(argv[i], NULL, 0);
+    }
+
+    if (backlog > 0 || compress || sdTask || sdQuotaSegments > 0) enableSD = true;
+
+    hostMuteSerial(true);
+    hostUseVirtualClock(true);
+    hostSetMillis(1000);
+
+    Esp32MAClientLog log(enableSD, ring);
+    Esp32MAClientLogBench bench(log);
+
+    log.setSDCompression(compress);
+
+    if (sdQuotaSegments > 0) log.setSDQuota((uint64_t)sdQuotaSegments * SDSEGMENTSIZE);
+
+    if (psram > 0) log.setPSRAMBuffer(psram);
+
+    if (backpressure) log.setBackpressure(true);
+
+    bench.registerVars(MAXNUMVARS, compression);
+
+    if (overflowPolicy >= 0) {
+        log.setOverflowPolicy((overflowPolicy_t)overflowPolicy);
+        log._getPtrBufferLock(); // The bench drains the queue in the same thread: the policy can take it
+        bench.setPriorities();
+    }
+
+    if (backlog > 0) bench.fillSDBacklog(backlog);
+
+    if (backlog > 0 || (outage && enableSD)) {
+        hostSDResetStats();
+        hostSDSetOpenLatencyMicros(100);
+    }
+
+    if (sdTask) log.startSDTask();
+
+    bench.runLoop(iterations, outage, drainRate);
+
+    if (sdTask) log.stopSDTask();
+
+    if (backlog > 0) printf("SD backlog left: %d records\n", bench.sdBacklog());
+
+    if (overflowPolicy >= 0) {
+        overflowStats_t stats = log.getOverflowStats();
+        printf("Overflow (%s): staged=%lu coalesced=%lu droppedOldest=%lu evicted=%lu droppedNewest=%lu sdEvicted=%lu\n",
+            overflowNames[overflowPolicy], stats.staged, stats.coalesced, stats.droppedOldest, stats.evicted, stats.droppedNewest, stats.sdEvicted);
+    }
+
+    if (enableSD) {
+        hostSDStats_t stats = hostSDGetStats();
+        printf("SD (loop): opens=%lu read=%lu B written=%lu B\n", stats.opens, stats.bytesRead, stats.bytesWritten);
+        hostSDSetOpenLatencyMicros(0);
+    }
+
+    printf("Hot paths (%lu calls each):\n", iterations);
+    bench.runHotPaths(iterations);
+
+    if (enableSD) {
+        hostSDStats_t stats = hostSDGetStats();
+        printf("SD: opens=%lu read=%lu B written=%lu B\n", stats.opens, stats.bytesRead, stats.bytesWritten);
+    }
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Throughput benchmark of the RAM buffer between the log task and the send task
+//
+// A producer thread (the log) pushes varStamp_t records and a consumer thread (the sender)
+// pops them, through:
+//
+// - the FreeRTOS queue, one record per call (xQueueSendToBack / xQueueReceive)
+// - the lock-free SPSCBuffer, one record per call (push / pop)
+// - the lock-free SPSCBuffer, in place by batches (reserve/commit, readable/release)
+//
+// Reports records/s and ns/record (wall time), and checks the FIFO order.
+//
+// Usage: bench_ring [records] [batch]
+
+#include <Arduino.h>
+#include <HostShims.h>
+
+#include "SPSCBuffer.hpp"
+
+#include <chrono>
+#include <thread>
+
+static inline uint64_t nowNanos() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void fillRecord(varStamp_t* ptrVarStamp, unsigned long i) {
+    ptrVarStamp->varId = (uint8_t)(i % MAXNUMVARS);
+    ptrVarStamp->value = (int)i;
+    ptrVarStamp->ts = i;
+}
+
+static void report(const char* name, unsigned long records, uint64_t nanos, unsigned long errors) {
+    printf("  %-22s: %10.0f records/s %7.1f ns/record%s\n", name,
+        records / ((double)nanos / 1e9), (double)nanos / records, errors ? "  FIFO ERRORS" : "");
+}
+
+static void benchQueue(unsigned long records) {
+
+    QueueHandle_t queue = xQueueCreate(MAXBUFFER, sizeof(varStamp_t));
+    unsigned long errors = 0;
+
+    uint64_t t0 = nowNanos();
+
+    std::thread producer([&]() {
+        varStamp_t varStamp;
+        for (unsigned long i = 0; i < records; i++) {
+            fillRecord(&varStamp, i);
+            while (xQueueSendToBack(queue, &varStamp, 0) != pdPASS) std::this_thread::yield();
+        }
+    });
+
+    varStamp_t varStamp;
+    for (unsigned long i = 0; i < records; ) {
+        if (xQueueReceive(queue, &varStamp, 0) != pdPASS) { std::this_thread::yield(); continue; }
+        if (varStamp.value != (int)i) errors++;
+        i++;
+    }
+
+    producer.join();
+    report("queue (1 per call)", records, nowNanos() - t0, errors);
+}
+
+static void benchRing(unsigned long records) {
+
+    SPSCBuffer* ring = new SPSCBuffer();
+    unsigned long errors = 0;
+
+    uint64_t t0 = nowNanos();
+
+    std::thread producer([&]() {
+        varStamp_t varStamp;
+        for (unsigned long i = 0; i < records; i++) {
+            fillRecord(&varStamp, i);
+            while (!ring->push(&varStamp)) std::this_thread::yield();
+        }
+    });
+
+    varStamp_t varStamp;
+    for (unsigned long i = 0; i < records; ) {
+        if (!ring->pop(&varStamp)) { std::this_thread::yield(); continue; }
+        if (varStamp.value != (int)i) errors++;
+        i++;
+    }
+
+    producer.join();
+    report("SPSC ring (1 per call)", records, nowNanos() - t0, errors);
+    delete ring;
+}
+
+static void benchRingBatch(unsigned long records, int batch) {
+
+    SPSCBuffer* ring = new SPSCBuffer();
+    unsigned long errors = 0;
+
+    uint64_t t0 = nowNanos();
+
+    std::thread producer([&]() {
+        varStamp_t* ptrSlots;
+        for (unsigned long i = 0; i < records; ) {
+            int num = ring->reserve(&ptrSlots, (int)min((unsigned long)batch, records - i));
+            if (num == 0) { std::this_thread::yield(); continue; }
+            for (int j = 0; j < num; j++) fillRecord(&ptrSlots[j], i + j);
+            ring->commit(num);
+            i += num;
+        }
+    });
+
+    varStamp_t* ptrSlots;
+    for (unsigned long i = 0; i < records; ) {
+        int num = ring->readable(&ptrSlots, batch);
+        if (num == 0) { std::this_thread::yield(); continue; }
+        for (int j = 0; j < num; j++) if (ptrSlots[j].value != (int)(i + j)) errors++;
+        ring->release(num);
+        i += num;
+    }
+
+    producer.join();
+    char name[32];
+    snprintf(name, sizeof(name), "SPSC ring (batch %d)", batch);
+    report(name, records, nowNanos() - t0, errors);
+    delete ring;
+}
+
+int main(int argc, char** argv) {
+
+    unsigned long records = 2000000;
+    int batch = 32;
+
+    if (argc > 1) records = strtoul(argv[1], NULL, 0);
+    if (argc > 2) batch = constrain(atoi(argv[2]), 1, SPSCBUFFERSIZE);
+
+    hostMuteSerial(true);
+
+    printf("RAM buffer of %d records, %lu records from the log thread to the send thread:\n", MAXBUFFER, records);
+
+    benchQueue(records);
+    benchRing(records);
+    benchRingBatch(records, batch);
+
+    return 0;
+}
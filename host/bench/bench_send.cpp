@@ -0,0 +1,228 @@
+// Benchmark of the Machine Advisor message builders (Esp32MAClientSend)
+//
+// Compares, for a message of one sample and a message of 32 samples (one per variable):
+//
+// - template: copies of the _iniMessage/_varMessage templates and String::replace
+//   (_createMQTTMessageVar, the path of sendMQTTMessage(name, value, ts))
+// - writer: PayloadWriter in a fixed buffer, with the asset prefix rendered once
+//
+// Reports ns per message and heap allocations per message (operator new is counted),
+// and checks that both builders write the same message.
+//
+// With --window N --drop M the sender streams 4 variables with a window of N messages in flight,
+// and the hub loses M messages (not delivered, confirmed with a timeout). The samples delivered to
+// the hub are checked: none can be lost (duplicates are expected). Returns 1 if a sample is lost.
+// With --rtt R the confirmations arrive R millis after the send: the window stays full (the average
+// of messages in flight and the messages confirmed per second are printed).
+//
+// Usage: bench_send [iterations] [--window N [--drop M] [--rtt R]]
+
+#include <Arduino.h>
+#include <HostShims.h>
+
+#include "Esp32MAClient.hpp"
+
+#include <chrono>
+#include <new>
+#include <set>
+#include <string>
+
+static unsigned long allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* ptr = malloc(size);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+static inline uint64_t nowNanos() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int values[MAXNUMVARS];
+
+
+class Esp32MAClientSendBench {
+
+    public:
+
+        Esp32MAClientSendBench(Esp32MAClientSend& send, varRegisterList_t* ptrVarList) : _send(send), _ptrVarList(ptrVarList) {}
+
+        // Template path: a message per sample, concatenated for the batch like the old sender did
+        String buildTemplate(int numSamples, unsigned long ts) {
+
+            if (numSamples == 1) return _send._createMQTTMessageVar(_name(0), values[0], ts, 123);
+
+            String message = _send._iniMessage;
+            message.replace("{{assetname}}", _send._assetName);
+            for (int i = 0; i < numSamples; i++) message += _send._createMQTTVarPart(_name(i), values[i], ts, 123);
+            message += _send._endMessage;
+            return message;
+        }
+
+        const char* buildWriter(PayloadWriter& writer, int numSamples, unsigned long ts) {
+
+            writer.reset();
+            for (int i = 0; i < numSamples; i++) writer.addSample(_ptrVarList->var[i].shortName, values[i], ts, 123);
+            return writer.finish();
+        }
+
+        void run(int numSamples, unsigned long iterations) {
+
+            static char buffer[4 * MAXPAYLOADSIZE]; // The 32 samples do not fit in the default payload
+            PayloadWriter writer;
+            writer.setAssetName(_send._assetName.c_str());
+            writer.begin(buffer, sizeof(buffer));
+
+            unsigned long ts = 1600000000UL;
+            volatile size_t sink = 0;
+
+            bool same = (buildTemplate(numSamples, ts) == String(buildWriter(writer, numSamples, ts)));
+
+            unsigned long allocBefore = allocations;
+            uint64_t t0 = nowNanos();
+            for (unsigned long it = 0; it < iterations; it++) sink += buildTemplate(numSamples, ts + it).length();
+            uint64_t t1 = nowNanos();
+            unsigned long templateAllocs = allocations - allocBefore;
+
+            allocBefore = allocations;
+            uint64_t t2 = nowNanos();
+            for (unsigned long it = 0; it < iterations; it++) sink += strlen(buildWriter(writer, numSamples, ts + it));
+            uint64_t t3 = nowNanos();
+            unsigned long writerAllocs = allocations - allocBefore;
+
+            printf("%2d sample(s), %4d bytes, same message: %s\n", numSamples, writer.length(), same ? "yes" : "NO");
+            printf("  template: %8.1f ns/msg  %6.1f allocs/msg\n", (double)(t1 - t0) / iterations, (double)templateAllocs / iterations);
+            printf("  writer  : %8.1f ns/msg  %6.1f allocs/msg\n", (double)(t3 - t2) / iterations, (double)writerAllocs / iterations);
+
+            (void)sink;
+        }
+
+    private:
+
+        Esp32MAClientSend& _send;
+        varRegisterList_t* _ptrVarList;
+
+        String _name(int varId) { return String(_ptrVarList->var[varId].shortName); }
+};
+
+
+// Samples sent and delivered to the hub, by name and value (unique in the stream):
+// ,"<name>": <value>,"<name>_timestamp": <ts>
+
+static std::set<std::string> sent;
+static std::set<std::string> delivered;
+static unsigned long numDelivered = 0;
+
+static void onSend(const char* payload, bool isDelivered) {
+
+    const char* text = "\": ";
+
+    for (const char* ptr = strstr(payload, text); ptr != NULL; ptr = strstr(ptr, text)) {
+
+        const char* name = ptr;
+        while (name > payload && *(name - 1) != '"') name--;
+
+        const char* value = ptr + strlen(text);
+        const char* end = value;
+        while (*end == '-' || (*end >= '0' && *end <= '9')) end++;
+
+        std::string key(name, ptr - name);
+        ptr = end;
+
+        if (end == value || key == "assetName" || (key.size() > 10 && key.compare(key.size() - 10, 10, "_timestamp") == 0)) continue;
+
+        key += "@" + std::string(value, end - value);
+        sent.insert(key);
+
+        if (isDelivered) {
+            delivered.insert(key);
+            numDelivered++;
+        }
+    }
+}
+
+static int runWindow(int window, int drop, unsigned long rttMillis) {
+
+    static int streamed[4];
+
+    hostUseVirtualClock(true);
+    hostSetMillis(1000);
+    hostMqttSetSendCallback(onSend);
+    hostMqttSetConfirmationDelay(rttMillis);
+
+    Esp32MAClientLog log;
+
+    for (int i = 0; i < 4; i++) log.registerVar("variable" + String(i), &streamed[i], 100);
+
+    Esp32MAClientSend send("packaging-line-4", log);
+
+    send.connect();
+    send.setSendRate(20, 1);
+    send.setSendWindow(window, 2000);
+
+    unsigned long sumInFlight = 0;
+    int msgsStreaming = 0;
+
+    // 30 s streaming (the messages are lost after 10 s), and 20 s to drain
+
+    for (unsigned long t = 0; t < 5000; t++) {
+        if (t == 3000) msgsStreaming = send.getMsgSentOK();
+        if (t < 3000) sumInFlight += send.getMsgInFlight();
+        hostAdvanceMillis(10);
+        if (t == 1000) hostMqttDropNextMessages(drop);
+        if (t < 3000) {
+            for (int i = 0; i < 4; i++) streamed[i] = 4 * t + i + 1;
+            log.update(1600000000UL + millis() / 1000);
+        }
+        send.update(true);
+    }
+
+    unsigned long lost = sent.size() - delivered.size();
+
+    printf("window %d, rtt %lu ms, %d message(s) lost by the hub: %zu samples sent, %zu delivered, %lu duplicates, %lu lost, %lu confirmed, backlog %d\n",
+        window, rttMillis, drop, sent.size(), delivered.size(), numDelivered - delivered.size(), lost, send.getSamplesSentOK(), log.getBacklogSize() + send.getMsgInFlight());
+    printf("  streaming: %.1f messages in flight, %.1f messages/s confirmed\n", (double)sumInFlight / 3000, msgsStreaming / 30.0);
+
+    return (lost > 0 ? 1 : 0);
+}
+
+
+int main(int argc, char** argv) {
+
+    unsigned long iterations = 100000;
+    int window = 0;
+    int drop = 0;
+    unsigned long rtt = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) window = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--drop") == 0 && i + 1 < argc) drop = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rtt") == 0 && i + 1 < argc) rtt = strtoul(argv[++i], NULL, 0);
+        else iterations = strtoul(argv[i], NULL, 0);
+    }
+
+    hostMuteSerial(true);
+
+    if (window > 0) return runWindow(window, drop, rtt);
+
+    Esp32MAClientLog log;
+
+    for (int i = 0; i < MAXNUMVARS; i++) {
+        values[i] = (i % 2 ? -1 : 1) * 1000 * (i + 1);
+        log.registerVar("temperature" + String(i), &values[i], 1000);
+    }
+
+    Esp32MAClientSend send("packaging-line-4", log);
+    Esp32MAClientSendBench bench(send, log._getVarListPtr());
+
+    bench.run(1, iterations);
+    bench.run(MAXNUMVARS, iterations / 10);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Host replacement of the ESP32 Arduino core header.
+// Provides the types, time functions, Serial and FreeRTOS API the library uses,
+// so src/ can be compiled and profiled on a Linux machine.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+
+#include "WString.h"
+#include "freertos/FreeRTOS.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define IRAM_ATTR
+#define HIGH 0x1
+#define LOW 0x0
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+using std::min;
+using std::max;
+using std::abs;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+int analogRead(uint8_t pin);
+
+// PSRAM (esp32-hal-psram.h). On the host it is the heap.
+
+bool psramFound();
+void* ps_malloc(size_t size);
+
+// Serial port. Output goes to stdout (it can be muted from HostShims.h).
+
+class HardwareSerial {
+
+    public:
+
+        void begin(unsigned long baud) { (void)baud; }
+
+        size_t print(const String& str);
+        size_t print(const char* str);
+        size_t print(char c);
+        size_t print(int value) { return print(String(value)); }
+        size_t print(unsigned long value) { return print(String(value)); }
+
+        size_t println(const String& str);
+        size_t println(const char* str = "");
+        size_t println(int value) { return println(String(value)); }
+        size_t println(unsigned long value) { return println(String(value)); }
+
+        size_t printf(const char* format, ...);
+};
+
+extern HardwareSerial Serial;
+
+#endif
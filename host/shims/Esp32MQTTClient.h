@@ -0,0 +1,38 @@
+#ifndef HOST_ESP32MQTTCLIENT_H
+#define HOST_ESP32MQTTCLIENT_H
+
+// Host replacement of the Esp32MQTTClient (ESP32 Azure IoT) library.
+// Sent events are counted and confirmed on the next Esp32MQTTClient_Check();
+// link state and confirmation result are controlled from HostShims.h.
+
+#include <Arduino.h>
+
+typedef enum {
+    IOTHUB_CLIENT_CONFIRMATION_OK,
+    IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY,
+    IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT,
+    IOTHUB_CLIENT_CONFIRMATION_ERROR
+} IOTHUB_CLIENT_CONFIRMATION_RESULT;
+
+typedef enum {
+    MESSAGE,
+    STATE
+} EVENT_TYPE;
+
+typedef struct EVENT_INSTANCE_TAG {
+    String payload;
+    EVENT_TYPE type;
+} EVENT_INSTANCE;
+
+typedef void (*SEND_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+
+bool Esp32MQTTClient_Init(const uint8_t* deviceConnString, bool hasDeviceTwin = false, bool traceOn = false);
+bool Esp32MQTTClient_SendEvent(const char* text);
+bool Esp32MQTTClient_SendEventInstance(EVENT_INSTANCE* event);
+EVENT_INSTANCE* Esp32MQTTClient_Event_Generate(const char* eventString, EVENT_TYPE type);
+void Esp32MQTTClient_Check(bool hasDelay = true);
+void Esp32MQTTClient_Close(void);
+void Esp32MQTTClient_SetSendConfirmationCallback(SEND_CONFIRMATION_CALLBACK send_confirmation_callback);
+int Esp32MQTTClient_Reset();
+
+#endif
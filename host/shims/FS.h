@@ -0,0 +1,101 @@
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+// Host replacement of the ESP32 fs::FS / fs::File classes.
+// Files live in memory; open/read/write counters and an optional simulated
+// latency per open let benchmarks account for SPI/FAT costs.
+
+#include <Arduino.h>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+struct HostFileNode;
+class HostFileSystem;
+
+class File {
+
+    public:
+
+        File() {}
+        File(std::shared_ptr<HostFileNode> node, HostFileSystem* owner, bool readable, bool writable, bool append);
+
+        size_t write(uint8_t c);
+        size_t write(const uint8_t* buf, size_t size);
+        size_t print(const char* str);
+        size_t print(const String& str) { return print(str.c_str()); }
+
+        int available();
+        int read();
+        size_t read(uint8_t* buf, size_t size);
+        int peek();
+        String readStringUntil(char terminator);
+
+        void flush() {}
+        bool seek(uint32_t pos, SeekMode mode = SeekSet);
+        size_t position() const { return _pos; }
+        size_t size() const;
+        void close();
+        const char* name() const;
+
+        operator bool() const { return (bool)_node; }
+
+    private:
+
+        std::shared_ptr<HostFileNode> _node;
+        HostFileSystem* _owner = nullptr;
+        size_t _pos = 0;
+        bool _readable = false;
+        bool _writable = false;
+        bool _append = false;
+};
+
+class FS {
+
+    public:
+
+        FS(HostFileSystem* impl) : _impl(impl) {}
+
+        File open(const char* path, const char* mode = FILE_READ);
+        File open(const String& path, const char* mode = FILE_READ) { return open(path.c_str(), mode); }
+
+        bool exists(const char* path);
+        bool exists(const String& path) { return exists(path.c_str()); }
+
+        bool remove(const char* path);
+        bool remove(const String& path) { return remove(path.c_str()); }
+
+        bool rename(const char* pathFrom, const char* pathTo);
+        bool rename(const String& pathFrom, const String& pathTo) { return rename(pathFrom.c_str(), pathTo.c_str()); }
+
+        bool mkdir(const char* path) { (void)path; return true; }
+        bool mkdir(const String& path) { return mkdir(path.c_str()); }
+
+    protected:
+
+        HostFileSystem* _impl;
+};
+
+} // namespace fs
+
+#ifndef FS_NO_GLOBALS
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+#endif
+
+#endif
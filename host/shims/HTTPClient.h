@@ -0,0 +1,22 @@
+#ifndef HOST_HTTPCLIENT_H
+#define HOST_HTTPCLIENT_H
+
+// Host replacement of the ESP32 HTTPClient (every request fails, there is no network).
+
+#include <Arduino.h>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+
+class HTTPClient {
+
+    public:
+
+        bool begin(const String& url) { (void)url; return true; }
+        void addHeader(const String& name, const String& value) { (void)name; (void)value; }
+        int GET() { return HTTPC_ERROR_CONNECTION_REFUSED; }
+        int getSize() { return -1; }
+        String getString() { return String(); }
+        void end() {}
+};
+
+#endif
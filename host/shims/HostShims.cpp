@@ -0,0 +1,586 @@
+// Implementation of the host shims (Arduino core, FreeRTOS, SD, MQTT client).
+
+#include "HostShims.h"
+
+#include <SD.h>
+#include <WiFi.h>
+#include <Esp32MQTTClient.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+///////////////////////////////////////////////////////////////////////////
+// Time
+///////////////////////////////////////////////////////////////////////////
+
+static const std::chrono::steady_clock::time_point _bootTime = std::chrono::steady_clock::now();
+static std::atomic<bool> _virtualClock(false);
+static std::atomic<unsigned long long> _virtualMicros(0);
+
+static unsigned long long _hostMicros() {
+    if (_virtualClock) return _virtualMicros;
+    return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - _bootTime).count();
+}
+
+unsigned long millis() { return (unsigned long)(_hostMicros() / 1000ULL); }
+unsigned long micros() { return (unsigned long)_hostMicros(); }
+
+void delay(uint32_t ms) {
+    if (_virtualClock) hostAdvanceMillis(ms);
+    else std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us) {
+    if (_virtualClock) _virtualMicros += us;
+    else std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void hostUseVirtualClock(bool enable) {
+    if (enable && !_virtualClock) _virtualMicros = _hostMicros();
+    _virtualClock = enable;
+}
+
+void hostAdvanceMillis(unsigned long ms) { _virtualMicros += (unsigned long long)ms * 1000ULL; }
+void hostSetMillis(unsigned long ms) { _virtualMicros = (unsigned long long)ms * 1000ULL; }
+
+static void _busyWaitMicros(unsigned long us) {
+    if (us == 0) return;
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+    while (std::chrono::steady_clock::now() < end) {}
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Misc Arduino API
+///////////////////////////////////////////////////////////////////////////
+
+static std::mt19937 _rng(1234);
+
+long random(long howbig) { return howbig <= 0 ? 0 : (long)(_rng() % (unsigned long)howbig); }
+long random(long howsmall, long howbig) { return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall); }
+void randomSeed(unsigned long seed) { _rng.seed((unsigned int)seed); }
+int analogRead(uint8_t pin) { (void)pin; return 0; }
+
+bool psramFound() { return true; }
+void* ps_malloc(size_t size) { return malloc(size); }
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+
+static std::atomic<bool> _serialMuted(false);
+
+void hostMuteSerial(bool mute) { _serialMuted = mute; }
+
+size_t HardwareSerial::print(const char* str) {
+    if (_serialMuted) return strlen(str);
+    return fwrite(str, 1, strlen(str), stdout);
+}
+
+size_t HardwareSerial::print(const String& str) { return print(str.c_str()); }
+
+size_t HardwareSerial::print(char c) {
+    char str[2] = {c, '\0'};
+    return print(str);
+}
+
+size_t HardwareSerial::println(const String& str) { return println(str.c_str()); }
+
+size_t HardwareSerial::println(const char* str) {
+    return print(str) + print("\r\n");
+}
+
+size_t HardwareSerial::printf(const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    return print(buf);
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// FreeRTOS queues and tasks
+///////////////////////////////////////////////////////////////////////////
+
+struct QueueDefinition {
+    std::mutex mutex;
+    std::condition_variable changed;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    std::vector<uint8_t> storage;
+    UBaseType_t head = 0;
+    UBaseType_t count = 0;
+};
+
+static bool _waitFor(QueueDefinition* q, std::unique_lock<std::mutex>& lock, TickType_t ticks, bool (*ready)(QueueDefinition*)) {
+    if (ready(q)) return true;
+    if (ticks == 0) return false;
+    if (ticks == portMAX_DELAY) {
+        q->changed.wait(lock, [q, ready]() { return ready(q); });
+        return true;
+    }
+    return q->changed.wait_for(lock, std::chrono::milliseconds(ticks), [q, ready]() { return ready(q); });
+}
+
+static bool _hasSpace(QueueDefinition* q) { return q->count < q->length; }
+static bool _hasItem(QueueDefinition* q) { return q->count > 0; }
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize) {
+    QueueDefinition* q = new QueueDefinition();
+    q->length = uxQueueLength;
+    q->itemSize = uxItemSize;
+    q->storage.resize((size_t)uxQueueLength * uxItemSize);
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t xQueue) { delete xQueue; }
+
+BaseType_t xQueueSendToBack(QueueHandle_t q, const void* item, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!_waitFor(q, lock, ticks, _hasSpace)) return errQUEUE_FULL;
+    UBaseType_t tail = (q->head + q->count) % q->length;
+    memcpy(&q->storage[(size_t)tail * q->itemSize], item, q->itemSize);
+    q->count++;
+    q->changed.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t q, const void* item, BaseType_t* woken) {
+    if (woken) *woken = pdFALSE;
+    return xQueueSendToBack(q, item, 0);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void* item, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!_waitFor(q, lock, ticks, _hasSpace)) return errQUEUE_FULL;
+    q->head = (q->head + q->length - 1) % q->length;
+    memcpy(&q->storage[(size_t)q->head * q->itemSize], item, q->itemSize);
+    q->count++;
+    q->changed.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void* buffer, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!_waitFor(q, lock, ticks, _hasItem)) return errQUEUE_EMPTY;
+    memcpy(buffer, &q->storage[(size_t)q->head * q->itemSize], q->itemSize);
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void* buffer, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!_waitFor(q, lock, ticks, _hasItem)) return errQUEUE_EMPTY;
+    memcpy(buffer, &q->storage[(size_t)q->head * q->itemSize], q->itemSize);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    q->changed.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    return q->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    return q->length - q->count;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    q->head = 0;
+    q->count = 0;
+    q->changed.notify_all();
+    return pdPASS;
+}
+
+struct HostTask {
+    std::thread thread;
+    BaseType_t core;
+};
+
+static thread_local HostTask* _currentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack, void* params,
+                                   UBaseType_t priority, TaskHandle_t* created, BaseType_t core) {
+    (void)name; (void)stack; (void)priority;
+    HostTask* task = new HostTask();
+    task->core = (core == tskNO_AFFINITY) ? 0 : core;
+    task->thread = std::thread([task, code, params]() {
+        _currentTask = task;
+        code(params);
+    });
+    task->thread.detach();
+    if (created) *created = task;
+    return pdPASS;
+}
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t code, const char* name, uint32_t stack, void* params,
+                                UBaseType_t priority, TaskHandle_t* created, BaseType_t core) {
+    return xTaskCreatePinnedToCore(code, name, stack, params, priority, created, core);
+}
+
+void vTaskDelete(TaskHandle_t task) { (void)task; }
+
+void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+
+// Threads not created as tasks (ie, the one running loop()) have their own handle
+static thread_local HostTask _threadTask;
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return _currentTask ? _currentTask : &_threadTask; }
+
+TickType_t xTaskGetTickCount() { return (TickType_t)millis(); }
+
+// Arduino loop() runs on core 1; tasks report the core they were pinned to.
+BaseType_t xPortGetCoreID() { return _currentTask ? _currentTask->core : 1; }
+
+
+///////////////////////////////////////////////////////////////////////////
+// In-memory file system (SD card)
+///////////////////////////////////////////////////////////////////////////
+
+namespace fs {
+
+struct HostFileNode {
+    std::string path;
+    std::string data;
+};
+
+class HostFileSystem {
+
+    public:
+
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<HostFileNode>> files;
+        bool present = true;
+        bool mounted = false;
+        uint64_t capacity = 4ULL * 1024 * 1024 * 1024;
+        unsigned long openLatencyMicros = 0;
+        hostSDStats_t stats = {0, 0, 0};
+
+        uint64_t used() {
+            uint64_t total = 0;
+            for (auto& f : files) total += f.second->data.size();
+            return total;
+        }
+};
+
+File::File(std::shared_ptr<HostFileNode> node, HostFileSystem* owner, bool readable, bool writable, bool append)
+    : _node(node), _owner(owner), _readable(readable), _writable(writable), _append(append) {}
+
+size_t File::write(const uint8_t* buf, size_t size) {
+    if (!_node || !_writable) return 0;
+    std::lock_guard<std::mutex> lock(_owner->mutex);
+    if (_owner->used() + size > _owner->capacity) return 0;
+    std::string& data = _node->data;
+    if (_append) _pos = data.size();
+    if (_pos > data.size()) data.resize(_pos, '\0');
+    size_t overlap = std::min(size, data.size() - _pos);
+    data.replace(_pos, overlap, (const char*)buf, size);
+    _pos += size;
+    _owner->stats.bytesWritten += size;
+    return size;
+}
+
+size_t File::write(uint8_t c) { return write(&c, 1); }
+
+size_t File::print(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+
+int File::available() {
+    if (!_node || !_readable) return 0;
+    return _pos < _node->data.size() ? (int)(_node->data.size() - _pos) : 0;
+}
+
+size_t File::read(uint8_t* buf, size_t size) {
+    if (!_node || !_readable) return 0;
+    std::lock_guard<std::mutex> lock(_owner->mutex);
+    size_t n = _pos < _node->data.size() ? std::min(size, _node->data.size() - _pos) : 0;
+    memcpy(buf, _node->data.data() + _pos, n);
+    _pos += n;
+    _owner->stats.bytesRead += n;
+    return n;
+}
+
+int File::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+    if (available() <= 0) return -1;
+    return (uint8_t)_node->data[_pos];
+}
+
+String File::readStringUntil(char terminator) {
+    std::string line;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) line += (char)c;
+    return String(line);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    if (!_node) return false;
+    size_t base = mode == SeekSet ? 0 : (mode == SeekCur ? _pos : _node->data.size());
+    size_t target = base + pos;
+    if (target > _node->data.size()) return false;
+    _pos = target;
+    return true;
+}
+
+size_t File::size() const { return _node ? _node->data.size() : 0; }
+
+void File::close() {
+    _node.reset();
+    _pos = 0;
+}
+
+const char* File::name() const { return _node ? _node->path.c_str() : ""; }
+
+File FS::open(const char* path, const char* mode) {
+
+    // The SPI transfers are done by DMA: a task waiting for the card leaves the CPU to the others.
+    // The loop (not a task) busy waits, so the latency is seen by the caller.
+    if (_currentTask && _impl->openLatencyMicros > 0) std::this_thread::sleep_for(std::chrono::microseconds(_impl->openLatencyMicros));
+    else _busyWaitMicros(_impl->openLatencyMicros);
+
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+
+    if (!_impl->present || !_impl->mounted) return File();
+
+    _impl->stats.opens++;
+
+    std::string key(path);
+    auto it = _impl->files.find(key);
+    bool plus = strchr(mode, '+') != nullptr;
+
+    switch (mode[0]) {
+        case 'r':
+            if (it == _impl->files.end()) return File();
+            return File(it->second, _impl, true, plus, false);
+        case 'w': {
+            std::shared_ptr<HostFileNode> node(new HostFileNode());
+            node->path = key;
+            _impl->files[key] = node;
+            return File(node, _impl, plus, true, false);
+        }
+        case 'a': {
+            if (it == _impl->files.end()) {
+                std::shared_ptr<HostFileNode> node(new HostFileNode());
+                node->path = key;
+                it = _impl->files.insert(std::make_pair(key, node)).first;
+            }
+            return File(it->second, _impl, plus, true, true);
+        }
+        default:
+            return File();
+    }
+}
+
+bool FS::exists(const char* path) {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    return _impl->present && _impl->mounted && _impl->files.count(path) > 0;
+}
+
+bool FS::remove(const char* path) {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    if (!_impl->present || !_impl->mounted) return false;
+    return _impl->files.erase(path) > 0;
+}
+
+bool FS::rename(const char* pathFrom, const char* pathTo) {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto it = _impl->files.find(pathFrom);
+    if (!_impl->present || !_impl->mounted || it == _impl->files.end()) return false;
+    std::shared_ptr<HostFileNode> node = it->second;
+    _impl->files.erase(it);
+    node->path = pathTo;
+    _impl->files[pathTo] = node;
+    return true;
+}
+
+bool SDFS::begin(uint8_t ssPin) {
+    (void)ssPin;
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    _impl->mounted = _impl->present;
+    return _impl->mounted;
+}
+
+void SDFS::end() {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    _impl->mounted = false;
+}
+
+sdcard_type_t SDFS::cardType() { return _impl->present ? CARD_SDHC : CARD_NONE; }
+uint64_t SDFS::cardSize() { return _impl->capacity; }
+uint64_t SDFS::totalBytes() { return _impl->capacity; }
+
+uint64_t SDFS::usedBytes() {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    return _impl->used();
+}
+
+} // namespace fs
+
+static fs::HostFileSystem _sdCard;
+fs::SDFS SD(&_sdCard);
+
+void hostSDSetPresent(bool present) {
+    std::lock_guard<std::mutex> lock(_sdCard.mutex);
+    _sdCard.present = present;
+    if (!present) _sdCard.mounted = false;
+}
+
+void hostSDSetCapacity(uint64_t totalBytes) {
+    std::lock_guard<std::mutex> lock(_sdCard.mutex);
+    _sdCard.capacity = totalBytes;
+}
+
+void hostSDSetOpenLatencyMicros(unsigned long us) { _sdCard.openLatencyMicros = us; }
+
+void hostSDFormat() {
+    std::lock_guard<std::mutex> lock(_sdCard.mutex);
+    _sdCard.files.clear();
+}
+
+hostSDStats_t hostSDGetStats() {
+    std::lock_guard<std::mutex> lock(_sdCard.mutex);
+    return _sdCard.stats;
+}
+
+void hostSDResetStats() {
+    std::lock_guard<std::mutex> lock(_sdCard.mutex);
+    _sdCard.stats = {0, 0, 0};
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// MQTT client
+///////////////////////////////////////////////////////////////////////////
+
+static std::mutex _mqttMutex;
+static bool _mqttLinkUp = true;
+static IOTHUB_CLIENT_CONFIRMATION_RESULT _mqttResult = IOTHUB_CLIENT_CONFIRMATION_OK;
+static SEND_CONFIRMATION_CALLBACK _mqttCallback = nullptr;
+typedef struct hostMqttPending_t {
+    IOTHUB_CLIENT_CONFIRMATION_RESULT result;
+    unsigned long dueMillis;
+} hostMqttPending_t;
+
+static std::deque<hostMqttPending_t> _mqttPending;
+static unsigned long _mqttDelayMillis = 0;
+static hostMqttStats_t _mqttStats = {0, 0, 0, 0};
+static int _mqttDropMessages = 0;
+static void (*_mqttSendCallback)(const char* payload, bool isDelivered) = nullptr;
+
+bool Esp32MQTTClient_Init(const uint8_t* deviceConnString, bool hasDeviceTwin, bool traceOn) {
+    (void)deviceConnString; (void)hasDeviceTwin; (void)traceOn;
+    return true;
+}
+
+EVENT_INSTANCE* Esp32MQTTClient_Event_Generate(const char* eventString, EVENT_TYPE type) {
+    EVENT_INSTANCE* event = new EVENT_INSTANCE();
+    event->payload = eventString;
+    event->type = type;
+    return event;
+}
+
+bool Esp32MQTTClient_SendEventInstance(EVENT_INSTANCE* event) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    bool sent = _mqttLinkUp;
+    if (sent) {
+        _mqttStats.eventsSent++;
+        _mqttStats.bytesSent += event->payload.length();
+        // Like the client, a message lost is confirmed with a timeout (in the order of the sends)
+        bool delivered = (_mqttDropMessages == 0);
+        if (!delivered) _mqttDropMessages--;
+        _mqttPending.push_back({delivered ? _mqttResult : IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT, millis() + _mqttDelayMillis});
+        if (_mqttSendCallback) _mqttSendCallback(event->payload.c_str(), delivered && _mqttResult == IOTHUB_CLIENT_CONFIRMATION_OK);
+    }
+    delete event;
+    return sent;
+}
+
+bool Esp32MQTTClient_SendEvent(const char* text) {
+    return Esp32MQTTClient_SendEventInstance(Esp32MQTTClient_Event_Generate(text, MESSAGE));
+}
+
+void Esp32MQTTClient_Check(bool hasDelay) {
+    (void)hasDelay;
+    std::deque<IOTHUB_CLIENT_CONFIRMATION_RESULT> confirmed;
+    SEND_CONFIRMATION_CALLBACK callback;
+    {
+        std::lock_guard<std::mutex> lock(_mqttMutex);
+        if (!_mqttLinkUp) return;
+        while (!_mqttPending.empty() && (long)(millis() - _mqttPending.front().dueMillis) >= 0) {
+            confirmed.push_back(_mqttPending.front().result);
+            _mqttPending.pop_front();
+        }
+        callback = _mqttCallback;
+    }
+    if (callback) {
+        for (IOTHUB_CLIENT_CONFIRMATION_RESULT result : confirmed) callback(result);
+    }
+}
+
+void Esp32MQTTClient_Close(void) {}
+
+void Esp32MQTTClient_SetSendConfirmationCallback(SEND_CONFIRMATION_CALLBACK callback) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttCallback = callback;
+}
+
+int Esp32MQTTClient_Reset() {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttStats.resets++;
+    _mqttPending.clear();
+    return 0;
+}
+
+void hostMqttSetLinkUp(bool linkUp) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttLinkUp = linkUp;
+}
+
+void hostMqttSetConfirmationResult(IOTHUB_CLIENT_CONFIRMATION_RESULT result) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttResult = result;
+}
+
+void hostMqttDropNextMessages(int numMessages) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttDropMessages = numMessages;
+}
+
+void hostMqttSetConfirmationDelay(unsigned long delayMillis) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttDelayMillis = delayMillis;
+}
+
+void hostMqttSetSendCallback(void (*callback)(const char* payload, bool isDelivered)) {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttSendCallback = callback;
+}
+
+hostMqttStats_t hostMqttGetStats() {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    hostMqttStats_t stats = _mqttStats;
+    stats.confirmationsPending = _mqttPending.size();
+    return stats;
+}
+
+void hostMqttResetStats() {
+    std::lock_guard<std::mutex> lock(_mqttMutex);
+    _mqttStats = {0, 0, 0, 0};
+}
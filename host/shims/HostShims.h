@@ -0,0 +1,53 @@
+#ifndef HOST_SHIMS_H
+#define HOST_SHIMS_H
+
+// Host-only controls for the Arduino / FreeRTOS / SD / MQTT shims.
+// Not part of the library: used by the host benchmarks to drive the shims.
+
+#include <Arduino.h>
+#include <Esp32MQTTClient.h>
+
+// Time. By default millis()/micros() follow the host steady clock.
+// With the virtual clock enabled they only move with hostAdvanceMillis().
+
+void hostUseVirtualClock(bool enable);
+void hostAdvanceMillis(unsigned long ms);
+void hostSetMillis(unsigned long ms);
+
+// Serial output
+
+void hostMuteSerial(bool mute);
+
+// SD card (in-memory)
+
+typedef struct hostSDStats_t {
+    unsigned long opens;
+    unsigned long bytesRead;
+    unsigned long bytesWritten;
+} hostSDStats_t;
+
+void hostSDSetPresent(bool present);
+void hostSDSetCapacity(uint64_t totalBytes);
+void hostSDSetOpenLatencyMicros(unsigned long micros); // Busy wait on every open (SPI + FAT lookup)
+void hostSDFormat(); // Remove every file
+hostSDStats_t hostSDGetStats();
+void hostSDResetStats();
+
+// MQTT client
+
+typedef struct hostMqttStats_t {
+    unsigned long eventsSent;
+    unsigned long bytesSent;
+    unsigned long resets;
+    unsigned long confirmationsPending;
+} hostMqttStats_t;
+
+void hostMqttSetLinkUp(bool linkUp);
+void hostMqttSetConfirmationResult(IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+void hostMqttDropNextMessages(int numMessages); // Sent OK but lost: not delivered, confirmed with MESSAGE_TIMEOUT
+void hostMqttSetConfirmationDelay(unsigned long delayMillis); // Round trip of the confirmations (0: next check)
+void hostMqttSetSendCallback(void (*callback)(const char* payload, bool isDelivered)); // Each message sent OK
+hostMqttStats_t hostMqttGetStats();
+void hostMqttResetStats();
+
+#endif
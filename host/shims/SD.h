@@ -0,0 +1,38 @@
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+// Host replacement of the ESP32 SD library (in-memory card).
+
+#include "FS.h"
+
+typedef enum {
+    CARD_NONE,
+    CARD_MMC,
+    CARD_SD,
+    CARD_SDHC,
+    CARD_UNKNOWN
+} sdcard_type_t;
+
+namespace fs {
+
+class SDFS : public FS {
+
+    public:
+
+        SDFS(HostFileSystem* impl) : FS(impl) {}
+
+        bool begin(uint8_t ssPin = 5);
+        void end();
+        sdcard_type_t cardType();
+        uint64_t cardSize();
+        uint64_t totalBytes();
+        uint64_t usedBytes();
+};
+
+} // namespace fs
+
+extern fs::SDFS SD;
+
+using namespace fs;
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+// Host replacement of the SPI library (the in-memory SD card needs no bus).
+
+#include <Arduino.h>
+
+#endif
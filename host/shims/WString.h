@@ -0,0 +1,131 @@
+#ifndef HOST_WSTRING_H
+#define HOST_WSTRING_H
+
+// Host replacement of the Arduino String class.
+// Only the subset used by the library is provided, with the same semantics
+// (indexOf returns -1, substring clamps its limits, toInt parses a long).
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+class String {
+
+    public:
+
+        String(const char* cstr = "") : _s(cstr ? cstr : "") {}
+        String(const std::string& str) : _s(str) {}
+        String(const String& str) = default;
+        String(String&& str) = default;
+
+        explicit String(char c) : _s(1, c) {}
+        explicit String(unsigned char value, unsigned char base = 10) : _s(_toBase((unsigned long)value, base)) {}
+        explicit String(int value, unsigned char base = 10) : _s(base == 10 ? std::to_string(value) : _toBase((unsigned long)value, base)) {}
+        explicit String(unsigned int value, unsigned char base = 10) : _s(_toBase(value, base)) {}
+        explicit String(long value, unsigned char base = 10) : _s(base == 10 ? std::to_string(value) : _toBase((unsigned long)value, base)) {}
+        explicit String(unsigned long value, unsigned char base = 10) : _s(_toBase(value, base)) {}
+        explicit String(long long value) : _s(std::to_string(value)) {}
+        explicit String(unsigned long long value) : _s(std::to_string(value)) {}
+        explicit String(float value, unsigned int decimalPlaces = 2) : _s(_toFixed(value, decimalPlaces)) {}
+        explicit String(double value, unsigned int decimalPlaces = 2) : _s(_toFixed(value, decimalPlaces)) {}
+
+        String& operator=(const String& rhs) = default;
+        String& operator=(String&& rhs) = default;
+        String& operator=(const char* cstr) { _s = cstr ? cstr : ""; return *this; }
+
+        unsigned int length() const { return (unsigned int)_s.length(); }
+        bool isEmpty() const { return _s.empty(); }
+        const char* c_str() const { return _s.c_str(); }
+        bool reserve(unsigned int size) { _s.reserve(size); return true; }
+
+        char charAt(unsigned int index) const { return index < _s.length() ? _s[index] : 0; }
+        char operator[](unsigned int index) const { return charAt(index); }
+
+        bool concat(const String& str) { _s += str._s; return true; }
+        bool concat(const char* cstr) { if (cstr) _s += cstr; return true; }
+        bool concat(char c) { _s += c; return true; }
+
+        String& operator+=(const String& rhs) { concat(rhs); return *this; }
+        String& operator+=(const char* cstr) { concat(cstr); return *this; }
+        String& operator+=(char c) { concat(c); return *this; }
+
+        bool equals(const String& rhs) const { return _s == rhs._s; }
+        bool operator==(const String& rhs) const { return _s == rhs._s; }
+        bool operator==(const char* cstr) const { return _s == (cstr ? cstr : ""); }
+        bool operator!=(const String& rhs) const { return _s != rhs._s; }
+        bool operator!=(const char* cstr) const { return !(*this == cstr); }
+        bool operator<(const String& rhs) const { return _s < rhs._s; }
+
+        bool startsWith(const String& prefix) const { return _s.compare(0, prefix._s.length(), prefix._s) == 0; }
+        bool endsWith(const String& suffix) const {
+            return _s.length() >= suffix._s.length() && _s.compare(_s.length() - suffix._s.length(), suffix._s.length(), suffix._s) == 0;
+        }
+
+        int indexOf(char c, unsigned int fromIndex = 0) const { return _npos(_s.find(c, fromIndex)); }
+        int indexOf(const String& str, unsigned int fromIndex = 0) const { return _npos(_s.find(str._s, fromIndex)); }
+        int lastIndexOf(char c) const { return _npos(_s.rfind(c)); }
+        int lastIndexOf(const String& str) const { return _npos(_s.rfind(str._s)); }
+
+        String substring(unsigned int beginIndex) const { return substring(beginIndex, length()); }
+        String substring(unsigned int beginIndex, unsigned int endIndex) const {
+            if (beginIndex > endIndex) { unsigned int tmp = beginIndex; beginIndex = endIndex; endIndex = tmp; }
+            if (beginIndex >= _s.length()) return String();
+            if (endIndex > _s.length()) endIndex = (unsigned int)_s.length();
+            return String(_s.substr(beginIndex, endIndex - beginIndex));
+        }
+
+        void replace(const String& find, const String& replace) {
+            if (find._s.empty()) return;
+            size_t pos = 0;
+            while ((pos = _s.find(find._s, pos)) != std::string::npos) {
+                _s.replace(pos, find._s.length(), replace._s);
+                pos += replace._s.length();
+            }
+        }
+
+        void trim() {
+            size_t first = _s.find_first_not_of(" \t\r\n");
+            size_t last = _s.find_last_not_of(" \t\r\n");
+            _s = (first == std::string::npos) ? "" : _s.substr(first, last - first + 1);
+        }
+
+        long toInt() const { return atol(_s.c_str()); }
+        float toFloat() const { return (float)atof(_s.c_str()); }
+
+    private:
+
+        std::string _s;
+
+        static int _npos(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; }
+
+        static std::string _toBase(unsigned long value, unsigned char base) {
+            if (base < 2 || base > 36) base = 10;
+            char buf[8 * sizeof(unsigned long) + 1];
+            char* p = buf + sizeof(buf) - 1;
+            *p = '\0';
+            do {
+                unsigned long digit = value % base;
+                *--p = (char)(digit < 10 ? '0' + digit : 'a' + digit - 10);
+                value /= base;
+            } while (value);
+            return std::string(p);
+        }
+
+        static std::string _toFixed(double value, unsigned int decimalPlaces) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%.*f", (int)decimalPlaces, value);
+            return std::string(buf);
+        }
+};
+
+inline String operator+(const String& lhs, const String& rhs) { String s(lhs); s += rhs; return s; }
+inline String operator+(const String& lhs, const char* rhs) { String s(lhs); s += rhs; return s; }
+inline String operator+(const char* lhs, const String& rhs) { String s(lhs); s += rhs; return s; }
+inline String operator+(const String& lhs, char rhs) { String s(lhs); s += rhs; return s; }
+inline String operator+(const String& lhs, int rhs) { return lhs + String(rhs); }
+inline String operator+(const String& lhs, unsigned int rhs) { return lhs + String(rhs); }
+inline String operator+(const String& lhs, long rhs) { return lhs + String(rhs); }
+inline String operator+(const String& lhs, unsigned long rhs) { return lhs + String(rhs); }
+
+#endif
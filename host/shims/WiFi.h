@@ -0,0 +1,25 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+// Host replacement of the ESP32 WiFi library (the link is always up).
+
+#include <Arduino.h>
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_CONNECTED = 3,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+class WiFiClass {
+
+    public:
+
+        int begin(const char* ssid, const char* passphrase = nullptr) { (void)ssid; (void)passphrase; return WL_CONNECTED; }
+        wl_status_t status() { return WL_CONNECTED; }
+        String localIP() { return String("127.0.0.1"); }
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+// Host replacement of the FreeRTOS queue and task API used by the library.
+// Queues are thread safe (mutex + condition variable) and honour the block time,
+// so multi-task code paths can be exercised with std::thread.
+
+#include <cstdint>
+#include <cstddef>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS (pdTRUE)
+#define pdFAIL (pdFALSE)
+#define errQUEUE_FULL ((BaseType_t)0)
+#define errQUEUE_EMPTY ((BaseType_t)0)
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1)
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(xTimeInMs))
+
+#define tskNO_AFFINITY ((BaseType_t)0x7FFFFFFF)
+
+// Queues
+
+typedef struct QueueDefinition* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize);
+void vQueueDelete(QueueHandle_t xQueue);
+
+BaseType_t xQueueSendToBack(QueueHandle_t xQueue, const void* pvItemToQueue, TickType_t xTicksToWait);
+BaseType_t xQueueSendToFront(QueueHandle_t xQueue, const void* pvItemToQueue, TickType_t xTicksToWait);
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void* pvBuffer, TickType_t xTicksToWait);
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void* pvBuffer, TickType_t xTicksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t xQueue);
+BaseType_t xQueueReset(QueueHandle_t xQueue);
+
+#define xQueueSend(xQueue, pvItemToQueue, xTicksToWait) xQueueSendToBack((xQueue), (pvItemToQueue), (xTicksToWait))
+
+// From an interrupt: never blocks. On the host, "interrupts" are other threads.
+
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t xQueue, const void* pvItemToQueue, BaseType_t* pxHigherPriorityTaskWoken);
+
+#define xQueueSendFromISR(xQueue, pvItemToQueue, pxHigherPriorityTaskWoken) xQueueSendToBackFromISR((xQueue), (pvItemToQueue), (pxHigherPriorityTaskWoken))
+
+// Tasks
+
+typedef struct HostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth,
+                                   void* pvParameters, UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask, BaseType_t xCoreID);
+BaseType_t xTaskCreateUniversal(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth,
+                                void* pvParameters, UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask, BaseType_t xCoreID);
+void vTaskDelete(TaskHandle_t xTaskToDelete);
+void vTaskDelay(TickType_t xTicksToDelay);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+TickType_t xTaskGetTickCount();
+
+BaseType_t xPortGetCoreID();
+
+#endif
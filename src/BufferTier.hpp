@@ -0,0 +1,39 @@
+#ifndef BUFFERTIER_HPP
+#define BUFFERTIER_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Interface of a storage tier of the log buffer.
+// The log keeps the records in FIFO order through the tiers: RAM buffer (oldest records),
+// memory tier (ie, PSRAMBuffer), SD buffer (newest records). A record only goes to a tier
+// when the tiers before it are full, and it comes back to them in bulk.
+// The tier is only accessed by the log (the task that calls update()).
+// The overflow policies remove or replace records anywhere in the tier (only when all the
+// buffers are full, so they can take a scan of the tier).
+
+class BufferTier {
+
+    public:
+
+        virtual ~BufferTier() {};
+
+        virtual String tierName() = 0;
+
+        virtual bool push(varStamp_t* ptrVarStamp) = 0; // False if full
+        virtual int popMany(varStamp_t* ptrVarStamps, int maxNum) = 0; // Returns the records popped
+
+        // Overflow policies. False if there is no such record in the tier.
+
+        virtual bool coalesce(varStamp_t* ptrVarStamp) = 0; // The newest record of the variable takes the new value
+        virtual bool evict(const uint8_t* priorities, int priority, varStamp_t* ptrLost) = 0; // Oldest record of the priority (priorities: by var id)
+
+        virtual int size() = 0; // Records in the tier
+        virtual int capacity() = 0; // Max records
+};
+
+#endif
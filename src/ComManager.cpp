@@ -0,0 +1,167 @@
+#include <Arduino.h>
+#include "ComManager.hpp"
+
+static const char* _stateNames[] = {"Down", "Backoff", "Probing", "Up"};
+
+ComManager::ComManager(unsigned long baseMillis, unsigned long maxMillis) {
+
+    setBackoff(baseMillis, maxMillis);
+}
+
+void ComManager::setBackoff(unsigned long baseMillis, unsigned long maxMillis) {
+
+    _baseMillis = baseMillis;
+    _maxMillis = max(maxMillis, baseMillis);
+}
+
+void ComManager::setFastResume(unsigned long maxOutageMillis) {
+
+    _fastResumeMillis = maxOutageMillis;
+}
+
+// The link reported by the application moves between down and the reconnection.
+// The rest of the transitions come from the messages.
+
+void ComManager::update(bool isLinkUp, unsigned long nowMillis) {
+
+    if (!isLinkUp) {
+
+        if (_state == COM_DOWN) return;
+
+        _wasUp = (_state == COM_UP);
+
+        if (_state == COM_UP) _lost(nowMillis);
+
+        else if (_state == COM_PROBING) {
+            _stats.failedProbes++;
+            _attempt++;
+        }
+
+        _setState(COM_DOWN, nowMillis);
+        return;
+    }
+
+    switch (_state) {
+
+        case COM_DOWN:
+
+            _linkUpMillis = nowMillis;
+
+            if (_wasUp && _fastResumeMillis > 0 && (nowMillis - _stateMillis) <= _fastResumeMillis) {
+                _stats.fastResumes++;
+                _connected(nowMillis);
+            } else {
+                _backoff(nowMillis);
+            }
+            break;
+
+        case COM_BACKOFF:
+
+            if ((nowMillis - _stateMillis) >= _retryMillis) {
+                _isResetPending = true;
+                _stats.resets++;
+                _setState(COM_PROBING, nowMillis);
+            }
+            break;
+
+        case COM_UP:
+
+            if (_attempt > 0 && (nowMillis - _stateMillis) >= COMSTABLEMILLIS) _attempt = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+// The first confirmation after a reset is the end of the reconnection
+
+void ComManager::messageConfirmed(unsigned long nowMillis) {
+
+    _failures = 0;
+
+    if (_state == COM_PROBING) _connected(nowMillis);
+}
+
+void ComManager::messageFailed(unsigned long nowMillis) {
+
+    if (_state == COM_PROBING) {
+        _stats.failedProbes++;
+        _attempt++;
+        _backoff(nowMillis);
+
+    } else if (_state == COM_UP && ++_failures >= COMMAXFAILURES) {
+        _lost(nowMillis);
+        _attempt++;
+        _linkUpMillis = nowMillis;
+        _backoff(nowMillis);
+    }
+}
+
+bool ComManager::takeReset() {
+
+    bool isResetPending = _isResetPending;
+
+    _isResetPending = false;
+
+    return(isResetPending);
+}
+
+const char* ComManager::stateName() {
+
+    return(_stateNames[_state]);
+}
+
+unsigned long ComManager::millisToRetry(unsigned long nowMillis) {
+
+    unsigned long elapsed = nowMillis - _stateMillis;
+
+    if (_state != COM_BACKOFF || elapsed >= _retryMillis) return(0);
+
+    return(_retryMillis - elapsed);
+}
+
+void ComManager::_setState(comState_t state, unsigned long nowMillis) {
+
+    _state = state;
+    _stateMillis = nowMillis;
+}
+
+void ComManager::_lost(unsigned long nowMillis) {
+
+    _stats.outages++;
+    _outageMillis = nowMillis;
+}
+
+// The first connection is not a reconnection
+
+void ComManager::_connected(unsigned long nowMillis) {
+
+    if (_stats.outages > 0) {
+        unsigned long outage = nowMillis - _outageMillis;
+        _stats.reconnects++;
+        _stats.lastOutageMillis = outage;
+        _stats.maxOutageMillis = max(_stats.maxOutageMillis, outage);
+        _stats.totalOutageMillis += outage;
+    }
+
+    _stats.lastReconnectMillis = nowMillis - _linkUpMillis;
+    _failures = 0;
+    _setState(COM_UP, nowMillis);
+}
+
+// Delay doubled for each failed reconnection, with jitter
+
+void ComManager::_backoff(unsigned long nowMillis) {
+
+    unsigned long delay = _baseMillis;
+
+    for (int i=0; i<_attempt && delay < _maxMillis; i++) delay *= 2;
+
+    delay = min(delay, _maxMillis);
+
+    long spread = (long)(delay / 100 * COMJITTERPERCENT);
+
+    _retryMillis = delay + random(-spread, spread + 1);
+    _setState(COM_BACKOFF, nowMillis);
+}
@@ -0,0 +1,93 @@
+#ifndef COMMANAGER_HPP
+#define COMMANAGER_HPP
+
+#include <Arduino.h>
+
+#define COMBACKOFFMAX 60000 // Default max millis between reconnections
+#define COMJITTERPERCENT 25 // Each delay is randomized +-25% (devices of a site do not reconnect at once)
+#define COMMAXFAILURES 3 // Consecutive failed messages (send, hub error or no answer) to reconnect
+#define COMSTABLEMILLIS 30000 // Millis connected to reset the backoff
+#define COMFASTRESUME 5000 // Default max outage to resume without resetting the client
+
+// State of the connection to the IoT Hub
+
+typedef enum comState_t {
+    COM_DOWN, // The application reports no link (Wifi)
+    COM_BACKOFF, // Link up, waiting to reset the client
+    COM_PROBING, // Client reset, waiting for the confirmation of the first message
+    COM_UP
+} comState_t;
+
+// Type: Reconnection counters and times
+
+typedef struct comStats_t {
+    unsigned long outages; // Times the connection was lost (link down or failed messages)
+    unsigned long reconnects; // Times the connection was recovered
+    unsigned long resets; // Client resets
+    unsigned long fastResumes; // Recovered without reset
+    unsigned long failedProbes; // Resets without a confirmed message
+    unsigned long lastReconnectMillis; // From the link up to the connection recovered
+    unsigned long lastOutageMillis; // From the connection lost to recovered
+    unsigned long maxOutageMillis;
+    unsigned long totalOutageMillis;
+} comStats_t;
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class with the state of the connection. It only decides: the sender resets the client when
+// takeReset() is true, and only sends in canSend(). The health of the connection comes from the
+// messages: failed sends, hub errors and timeouts. After a failed reconnection, or too many failed
+// messages, the delay before the next reset is doubled (with jitter), up to the max backoff.
+// A short outage of a healthy connection is resumed without reset (the session of the client survives).
+
+class ComManager {
+
+    public:
+
+        ComManager(unsigned long baseMillis=1000, unsigned long maxMillis=COMBACKOFFMAX);
+
+        void setBackoff(unsigned long baseMillis, unsigned long maxMillis);
+        void setFastResume(unsigned long maxOutageMillis); // 0: always reset after an outage
+
+        void update(bool isLinkUp, unsigned long nowMillis);
+
+        void messageConfirmed(unsigned long nowMillis);
+        void messageFailed(unsigned long nowMillis);
+
+        bool takeReset(); // True once per reset to do
+        bool canSend() {return (_state == COM_UP || _state == COM_PROBING);};
+
+        comState_t state() {return (_state);};
+        const char* stateName();
+        unsigned long millisToRetry(unsigned long nowMillis); // In backoff
+        comStats_t getStats() {return (_stats);};
+
+    private:
+
+        comState_t _state=COM_DOWN;
+        unsigned long _baseMillis;
+        unsigned long _maxMillis;
+        unsigned long _fastResumeMillis=COMFASTRESUME;
+
+        int _attempt=0; // Failed reconnections since the last stable connection
+        int _failures=0; // Consecutive failed messages
+        bool _isResetPending=false;
+        bool _wasUp=false; // Link lost while connected (fast resume)
+
+        unsigned long _stateMillis=0; // Entry in the current state
+        unsigned long _linkUpMillis=0;
+        unsigned long _outageMillis=0; // Connection lost
+        unsigned long _retryMillis=0; // Backoff delay
+
+        comStats_t _stats = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+        void _setState(comState_t state, unsigned long nowMillis);
+        void _lost(unsigned long nowMillis);
+        void _connected(unsigned long nowMillis);
+        void _backoff(unsigned long nowMillis);
+
+};
+
+#endif
@@ -14,7 +14,7 @@ void DebugMgr::setError(String textError, unsigned long ts){
     _lastErrorMillis = ts;
     _numErrors = (_numErrors+1) % LONG_MAX;
 
-    String strTs = ts==-1 ? "" : _getHumanDate(ts);
+    String strTs = ts==(unsigned long)-1 ? "" : _getHumanDate(ts);
 
     String errorMsg = "Err(" + _libName + "): " + textError + " " + strTs + " TotErr=" + String(getNumErrors()); 
     Serial.println(errorMsg);
@@ -39,7 +39,7 @@ int DebugMgr::getNumErrors(){
 
 void DebugMgr::setMsg(String msgText, unsigned long ts) {
 
-    String strTs = ts==-1 ? "" : _getHumanDate(ts);
+    String strTs = ts==(unsigned long)-1 ? "" : _getHumanDate(ts);
 
     String msg = "Msg(" + _libName + "): " + msgText + " " + strTs; 
     Serial.println(msg);
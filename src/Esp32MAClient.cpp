@@ -1,12 +1,27 @@
 #include "Esp32MAClient.hpp"
 
+Esp32MAClientSend* Esp32MAClientSend::_ptrConnected = NULL;
+
 // Constructor (Detailed)
 
-Esp32MAClientSend::Esp32MAClientSend(String assetName, QueueHandle_t* ptrxBufferCom, unsigned long* ptrTs) {
+Esp32MAClientSend::Esp32MAClientSend(String assetName, QueueHandle_t* ptrxBufferCom, unsigned long* ptrTs, varRegisterList_t* ptrVarList) {
 
     _assetName = assetName;
     _ptrxBufferCom = ptrxBufferCom;
     _ptrTs = ptrTs;
+    _ptrVarList = ptrVarList;
+    _initPayload();
+    debug.setLibName("Client");
+}
+
+
+Esp32MAClientSend::Esp32MAClientSend(String assetName, SPSCBuffer* ptrRingBufferCom, unsigned long* ptrTs, varRegisterList_t* ptrVarList) {
+
+    _assetName = assetName;
+    _ptrRingBufferCom = ptrRingBufferCom;
+    _ptrTs = ptrTs;
+    _ptrVarList = ptrVarList;
+    _initPayload();
     debug.setLibName("Client");
 }
 
@@ -19,7 +34,12 @@ Esp32MAClientSend::Esp32MAClientSend(String assetName, Esp32MAClientLog &logClie
     
     _assetName = assetName;
     _ptrxBufferCom = logClient._getPtrBuffer();
+    _ptrRingBufferCom = logClient._getPtrRing();
+    _ptrBufferLock = logClient._getPtrBufferLock();
     _ptrTs = logClient._getTsPtr();
+    _ptrVarList = logClient._getVarListPtr();
+    _ptrLog = &logClient;
+    _initPayload();
     debug.setLibName("Client");
     
 }
@@ -75,7 +95,7 @@ void Esp32MAClientSend::setMASessionCookie(String sessionCookie) {
 }
 
 
-// Callback functions (optional)
+// Callback functions. The confirmations are processed in the next update of the connected sender.
 
 void Esp32MAClientSend::_SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result) {
 
@@ -85,6 +105,8 @@ void Esp32MAClientSend::_SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RES
         Serial.println("Error: IOT Hub answered an error when message sent: " + String(result));
     }
 
+    if (_ptrConnected != NULL) _ptrConnected->_queueConfirmation(result);
+
 }
 
 
@@ -97,6 +119,7 @@ bool Esp32MAClientSend::connect() {
     debug.setMsg("Starting connexion to Machine Advisor");
 
     allOK = Esp32MQTTClient_Init((const uint8_t*)_connexionString.c_str());
+    _ptrConnected = this;
     Esp32MQTTClient_SetSendConfirmationCallback(_SendConfirmationCallback);
 
     if (!allOK) debug.setError("Problem connecting to Machine Advisor. Check connection credentials");
@@ -113,7 +136,8 @@ void Esp32MAClientSend::update(bool isComOK){
     _lastTs = *_ptrTs;
     _nowMillis = millis();
     _isComOK = isComOK;
-    
+
+    _updateCom(isComOK);
     _sendBufferedMessages();
 
 }
@@ -124,76 +148,485 @@ bool Esp32MAClientSend::_sendBufferedMessages(){
 
     // vTaskDelay is not used to be able to use the library in a mono-task system
 
-    bool bufferWithValue;
     bool sendOK=true;
-    
-    varStamp_t varStamp;
 
-    // TODO: Check what is the minimum posible period to update messages to Machine Advisor
+    // Confirmations of the messages in flight (the client calls the callback here)
+
+    if (_ptrConnected == this) Esp32MQTTClient_Check(false);
+
+    _processConfirmations();
+    _checkAckTimeouts();
+
+    // A message is sent when there is something to send and the token bucket allows it:
+    // first the messages not confirmed, then a new one if the window is not full.
+    // While reconnecting nothing is sent, and after a reset the first message is alone in flight.
+    // Do NOT block the task to be able to use the library in a mono-task system
+
+    bool isComReady = _com.canSend() && !(_com.state() == COM_PROBING && _isAnySent());
+    int retry = _nextRetry();
+    bool isNewPending = (_windowSize < _windowLimit) && (_batchSize > 0 || _bufferSize() > 0);
+
+    if (!_com.canSend()) {
+        if (_lastSendOK) _updateCatchUp(false); // The catch-up starts with the reconnection
+
+    } else if (isComReady && (retry >= 0 || isNewPending) && _sendBucket.take(_nowMillis)) {
+
+        sendOK = (retry >= 0) ? _sendInFlight(retry) : _sendBatch();
+
+        // The client may confirm a message it did not send: the order of the confirmations is lost
+
+        if (!sendOK) {
+            _failInFlight();
+            debug.setError("Sending the message to MA. Check connection status. Buffer=" + getBufferInfo(), _lastTs);
+            _messageErrorCount = (_messageErrorCount +1) % INTMAX_MAX;
+        }
+
+        _updateCatchUp(sendOK);
+    }
+
+    // To avoid Watch dog problems, if the task is running in core 0 delay it 1ms
+    if (xPortGetCoreID() == 0) vTaskDelay(1);
+
+    return(sendOK);
+}
+
+
+// New message: the batch (samples of a failed message) and the samples that fit.
+// If it is sent, its samples wait in the window for the confirmation.
+
+bool Esp32MAClientSend::_sendBatch(){
+
+    if (_writePayload(_batch, _batchSize)) _fillBatch();
+
+    if (_batchSize == 0) return(true);
+
+    uint32_t sendSeq = _sendSeq;
+
+    if (!sendMQTTMessage(_payload.finish(), _isComOK)) return(false);
+
+    inFlightMsg_t* ptrMsg = &_window[_windowSize++];
+
+    memcpy(ptrMsg->samples, _batch, _batchSize * sizeof(varStamp_t));
+    ptrMsg->numSamples = _batchSize;
+    ptrMsg->isSent = true;
+    ptrMsg->isConfirmed = false;
+    ptrMsg->sendSeq = sendSeq;
+    ptrMsg->sentMillis = _nowMillis;
+
+    _batchSize = 0;
+
+    if (_bufferSize() !=0) {
+        debug.setMsg("Last message was buffered=" + getBufferInfo(), _lastTs);
+    }
+
+    return(true);
+}
+
+// A message of the window sent again
+
+bool Esp32MAClientSend::_sendInFlight(int index){
+
+    inFlightMsg_t* ptrMsg = &_window[index];
+
+    _writePayload(ptrMsg->samples, ptrMsg->numSamples);
 
-    if ((_nowMillis - _lastBufferMillis) >= MILLISSENDPERIOD) {
+    uint32_t sendSeq = _sendSeq;
 
-        // Peek the value of the buffer (but do not remove it). 
-        // Do NOT block the task to be able to use the library in a mono-task system
+    if (!sendMQTTMessage(_payload.finish(), _isComOK)) return(false);
 
-        bufferWithValue = (xQueuePeek(*_ptrxBufferCom, &varStamp, 0) == pdPASS);            
+    ptrMsg->isSent = true;
+    ptrMsg->isConfirmed = false;
+    ptrMsg->sendSeq = sendSeq;
+    ptrMsg->sentMillis = _nowMillis;
 
-        if (bufferWithValue) {
+    return(true);
+}
+
+// Called by the confirmation callback: only queued, the window is modified in the update
+// (the callback can be called inside the send)
 
-            String mqttMessage = _createMQTTMessageVar(varStamp.varName, varStamp.value, varStamp.ts);
+void Esp32MAClientSend::_queueConfirmation(IOTHUB_CLIENT_CONFIRMATION_RESULT result){
+
+    if (_numConfirmations < MAXCONFIRMATIONS) {
+        _confirmations[_numConfirmations].sendSeq = _confirmSeq;
+        _confirmations[_numConfirmations].result = result;
+        _numConfirmations++;
+    }
 
-            // TODO: Manage to send multiples updates in the same message.
+    // Without space the message is not confirmed, and it is sent again after the timeout
+    _confirmSeq++;
+}
+
+// OK: the message is confirmed (its samples are done when the messages sent before are confirmed).
+// Error: the message is sent again.
+// A confirmation of a message not in the window (sent manually, or already sent again) is ignored.
+
+void Esp32MAClientSend::_processConfirmations(){
+
+    for (int i=0; i<_numConfirmations; i++) {
+
+        // More confirmations than messages sent: the order is lost, all of them are sent again
+
+        if ((int32_t)(_confirmations[i].sendSeq - _sendSeq) >= 0) {
+            debug.setError("Confirmation of a message not sent. Messages in flight to be sent again", _lastTs);
+            _failInFlight();
+            return;
+        }
 
-            sendOK = sendMQTTMessage(mqttMessage, _isComOK);
+        // Health of the connection (also from the messages sent manually)
 
-            if (sendOK) {
+        if (_confirmations[i].result == IOTHUB_CLIENT_CONFIRMATION_OK) _com.messageConfirmed(_nowMillis);
+        else _com.messageFailed(_nowMillis);
 
-                // If send is OK, remove the message from the buffer
-                xQueueReceive(*_ptrxBufferCom, &varStamp, 0);
+        for (int j=0; j<_windowSize; j++) {
 
-                _messageOKCount = (_messageOKCount + 1) % INTMAX_MAX;
+            if (_window[j].sendSeq != _confirmations[i].sendSeq) continue;
 
-                if (bufferWithValue && uxQueueMessagesWaiting(*_ptrxBufferCom) !=0) {
-                    debug.setMsg("Last message was buffered=" + getBufferInfo(), _lastTs);
-                }
+            if (_confirmations[i].result == IOTHUB_CLIENT_CONFIRMATION_OK) {
+                _window[j].isConfirmed = true;
 
-            } else {
-                debug.setError("Sending the message to MA. Check connection status. Buffer=" + getBufferInfo(), _lastTs);
-                _messageErrorCount = (_messageErrorCount +1) % INTMAX_MAX;
+            } else if (_window[j].isSent) {
+                _window[j].isSent = false;
+                debug.setError("Message not confirmed by the IoT Hub (" + String(_confirmations[i].result) + "). To be sent again. Buffer=" + getBufferInfo(), _lastTs);
             }
+
+            break;
         }
+    }
+
+    _numConfirmations = 0;
+
+    _removeConfirmed();
+}
+
+// In the order of the sends: a message is removed when it and all the messages sent before it
+// are confirmed, so the window keeps sending while the confirmations arrive
+
+void Esp32MAClientSend::_removeConfirmed(){
+
+    while (true) {
 
-        _lastBufferMillis = _nowMillis;
+        int oldest = -1;
+
+        for (int i=0; i<_windowSize; i++) {
+            if (_window[i].isSent && (oldest < 0 || (int32_t)(_window[i].sendSeq - _window[oldest].sendSeq) < 0)) oldest = i;
+        }
+
+        if (oldest < 0 || !_window[oldest].isConfirmed) return;
+
+        _samplesOKCount += _window[oldest].numSamples;
+        _messageOKCount = (_messageOKCount + 1) % INTMAX_MAX;
+        _removeInFlight(oldest);
     }
+}
 
-    // To avoid Watch dog problems, if the task is running in core 0 delay it 1ms
-    if (xPortGetCoreID() == 0) vTaskDelay(1);
+// A confirmation not received is lost: the next ones would be matched to the wrong messages,
+// so all the messages in flight are sent again (duplicates instead of lost samples)
 
-    return(sendOK);
+void Esp32MAClientSend::_checkAckTimeouts(){
+
+    for (int i=0; i<_windowSize; i++) {
+
+        if (_window[i].isSent && !_window[i].isConfirmed && (_nowMillis - _window[i].sentMillis) > _ackTimeout) {
+            _com.messageFailed(_nowMillis);
+            debug.setError("No confirmation of a message by the IoT Hub. Messages in flight to be sent again. Buffer=" + getBufferInfo(), _lastTs);
+            _failInFlight();
+            return;
+        }
+    }
+}
+
+// The confirmations of the messages sent are lost (client reset, timeout or failed send)
+
+void Esp32MAClientSend::_failInFlight(){
+
+    for (int i=0; i<_windowSize; i++) {
+        _window[i].isSent = false;
+        _window[i].isConfirmed = false;
+    }
+
+    _numConfirmations = 0;
+    _confirmSeq = _sendSeq;
+}
+
+int Esp32MAClientSend::_nextRetry(){
+
+    int oldest = -1;
+
+    for (int i=0; i<_windowSize; i++) {
+        if (!_window[i].isSent && (oldest < 0 || (int32_t)(_window[i].sendSeq - _window[oldest].sendSeq) < 0)) oldest = i;
+    }
+
+    return(oldest);
+}
+
+// The last message of the window takes its position
+
+void Esp32MAClientSend::_removeInFlight(int index){
+
+    _windowSize--;
+
+    if (index != _windowSize) _window[index] = _window[_windowSize];
+}
+
+bool Esp32MAClientSend::_isAnySent(){
+
+    for (int i=0; i<_windowSize; i++) {
+        if (_window[i].isSent) return(true);
+    }
+
+    return(false);
+}
+
+int Esp32MAClientSend::_samplesInFlight(){
+
+    int numSamples = 0;
+
+    for (int i=0; i<_windowSize; i++) numSamples += _window[i].numSamples;
+
+    return(numSamples);
+}
+
+void Esp32MAClientSend::setSendWindow(int numMessages, unsigned long timeoutMillis){
+
+    _windowLimit = constrain(numMessages, 1, MAXSENDWINDOW);
+    _ackTimeout = timeoutMillis;
+}
+
+
+// Move samples from the buffer to the batch while the message fits in the max payload.
+// A sample of a variable already in the batch waits for the next message (the names are the JSON keys,
+// and the order of the samples of each variable is kept).
+
+void Esp32MAClientSend::_fillBatch(){
+
+    varStamp_t varStamp;
+
+    // The log is applying the overflow policy to the records of the queue: they are taken next time
+
+    if (_ptrBufferLock != NULL && _ptrBufferLock->exchange(true, std::memory_order_acquire)) return;
+
+    while (_batchSize < MAXBATCHSAMPLES && _peekBuffer(&varStamp)) {
+
+        if (_isVarInBatch(varStamp.varId)) break;
+
+        if (!_payload.addSample(_getVarName(varStamp.varId), varStamp.value, varStamp.ts, varStamp.tsMillis)) {
+
+            if (_batchSize > 0) break;
+
+            // Not even alone (not expected with MINPAYLOADSIZE): it could never be sent
+            debug.setError("Sample bigger than the max payload. Discarded: " + String(_getVarName(varStamp.varId)), _lastTs);
+            _removeFromBuffer();
+            continue;
+        }
+
+        _batch[_batchSize++] = varStamp;
+
+        _removeFromBuffer();
+    }
+
+    if (_ptrBufferLock != NULL) _ptrBufferLock->store(false, std::memory_order_release);
+}
+
+bool Esp32MAClientSend::_isVarInBatch(int varId){
+
+    for (int i=0; i<_batchSize; i++) {
+        if (_batch[i].varId == varId) return(true);
+    }
+
+    return(false);
+}
+
+void Esp32MAClientSend::setMaxPayloadSize(int maxBytes){
+
+    _maxPayloadSize = constrain(maxBytes, MINPAYLOADSIZE, MAXPAYLOADSIZE);
+}
+
+// Message with the samples of the batch or of a message sent again.
+// False if they were taken with a bigger max payload: then they are written in the whole buffer.
+
+bool Esp32MAClientSend::_writePayload(varStamp_t* ptrSamples, int numSamples){
+
+    int size = _maxPayloadSize + 1;
+
+    while (true) {
+
+        int i = 0;
+
+        _payload.begin(_payloadBuffer, size);
+
+        while (i < numSamples && _payload.addSample(_getVarName(ptrSamples[i].varId), ptrSamples[i].value, ptrSamples[i].ts, ptrSamples[i].tsMillis)) i++;
+
+        if (i == numSamples) return(size == _maxPayloadSize + 1);
+
+        if (size == (int)sizeof(_payloadBuffer)) return(false); // Not expected: the samples fit when taken
+
+        size = sizeof(_payloadBuffer);
+    }
+}
+
+// The prefix with the asset name is rendered once
+
+void Esp32MAClientSend::_initPayload(){
+
+    _payload.setAssetName(_assetName.c_str());
+    _payload.begin(_payloadBuffer, _maxPayloadSize + 1);
+}
+
+
+// Pacing configuration
+
+void Esp32MAClientSend::setSendRate(float messagesPerSecond, int burst){
+
+    _sendRate = messagesPerSecond;
+    _sendBurst = burst;
+
+    if (!_isCatchingUp) _sendBucket.setRate(_sendRate, _sendBurst);
+}
+
+void Esp32MAClientSend::setCatchUpRate(float messagesPerSecond, int burst){
+
+    _catchUpRate = messagesPerSecond;
+    _catchUpBurst = burst;
+
+    if (_isCatchingUp) _sendBucket.setRate(_catchUpRate, _catchUpBurst);
+}
+
+void Esp32MAClientSend::setComRecoveryDelay(unsigned long delayMillis, unsigned long maxMillis){
+
+    _com.setBackoff(delayMillis, maxMillis);
+}
+
+void Esp32MAClientSend::setComFastResume(unsigned long maxOutageMillis){
+
+    _com.setFastResume(maxOutageMillis);
+}
+
+
+// Connection state. The client is reset when the manager decides it (once per reconnection),
+// then the confirmations of the messages sent are lost.
+
+void Esp32MAClientSend::_updateCom(bool isComOK){
+
+    _com.update(isComOK, millis());
+
+    if (_com.takeReset()) {
+        Esp32MQTTClient_Reset();
+        _failInFlight();
+    }
+
+    if (_com.state() == _lastComState) return;
+
+    if (_com.state() == COM_BACKOFF) {
+        debug.setMsg("Connection: reconnecting in " + String(_com.millisToRetry(millis())) + " ms", _lastTs);
+    } else {
+        debug.setMsg("Connection: " + String(_com.stateName()), _lastTs);
+    }
+
+    _lastComState = _com.state();
+}
+
+
+// Catch-up: the first message sent after a failed one (or the first one) with a backlog starts it.
+// It ends when the backlog is sent, or if a message fails (the retries go back to the steady rate).
+
+void Esp32MAClientSend::_updateCatchUp(bool sendOK){
+
+    int backlog = _backlogSize();
+
+    if (!_isCatchingUp && sendOK && !_lastSendOK && backlog > SENDCATCHUPBACKLOG && _catchUpRate > _sendRate) {
+        _isCatchingUp = true;
+        _sendBucket.setRate(_catchUpRate, _catchUpBurst);
+        debug.setMsg("Connection recovered. Sending the backlog of " + String(backlog) + " records at " + String(_catchUpRate, 1) + " messages/s", _lastTs);
+
+    } else if (_isCatchingUp && (!sendOK || backlog <= SENDCATCHUPBACKLOG)) {
+        _isCatchingUp = false;
+        _sendBucket.setRate(_sendRate, _sendBurst);
+        debug.setMsg(String(sendOK ? "Catch-up finished" : "Catch-up stopped, message not sent") + ". Backlog: " + String(backlog) + " records", _lastTs);
+    }
+
+    _lastSendOK = sendOK;
+}
+
+int Esp32MAClientSend::_backlogSize(){
+
+    if (_ptrLog != NULL) return(_ptrLog->getBacklogSize() + _batchSize + _samplesInFlight());
+
+    return(_bufferSize() + _batchSize + _samplesInFlight());
+}
+
+
+// RAM buffer of the log: FreeRTOS queue, or lock-free ring
+
+bool Esp32MAClientSend::_peekBuffer(varStamp_t* ptrVarStamp){
+
+    if (_ptrRingBufferCom != NULL) return(_ptrRingBufferCom->peek(ptrVarStamp));
+
+    return(xQueuePeek(*_ptrxBufferCom, ptrVarStamp, 0) == pdPASS);
+}
+
+void Esp32MAClientSend::_removeFromBuffer(){
+
+    varStamp_t varStamp;
+
+    if (_ptrRingBufferCom != NULL) _ptrRingBufferCom->release(1);
+    else xQueueReceive(*_ptrxBufferCom, &varStamp, 0);
+}
+
+int Esp32MAClientSend::_bufferSize(){
+
+    if (_ptrRingBufferCom != NULL) return(_ptrRingBufferCom->size());
+
+    return((int)uxQueueMessagesWaiting(*_ptrxBufferCom));
+}
+
+
+// Name of a buffered sample, from the list of registered variables
+
+const char* Esp32MAClientSend::_getVarName(int varId){
+
+    if (_ptrVarList == NULL || varId >= MAXNUMVARS) {
+        snprintf(_varNameBuffer, sizeof(_varNameBuffer), "var%d", varId);
+        return(_varNameBuffer);
+    }
+
+    return(_ptrVarList->var[varId].shortName);
 }
 
 
 // Create the message for a single variable
 
-String Esp32MAClientSend::_createMQTTMessageVar(String name, int value, unsigned long ts){
+String Esp32MAClientSend::_createMQTTMessageVar(String name, int value, unsigned long ts, int tsMillis){
 
     String returnMessage;
-    String varTemp;
     String iniTemp;
 
     iniTemp = _iniMessage;
     iniTemp.replace("{{assetname}}", _assetName);
     returnMessage = iniTemp;
 
+    returnMessage += _createMQTTVarPart(name, value, ts, tsMillis);
+
+    returnMessage +=_endMessage;
+    return(returnMessage);
+}
+
+
+// JSON of a sample, to be added to a message
+
+String Esp32MAClientSend::_createMQTTVarPart(String name, int value, unsigned long ts, int tsMillis){
+
+    String varTemp;
+
     varTemp = _varMessage;
     varTemp.replace("{{varname}}", name);
     varTemp.replace("{{varvalue}}", String(value));
-    varTemp.replace("{{time}}", String(ts)+String("000"));
+    char millisText[4];
+    snprintf(millisText, sizeof(millisText), "%03d", constrain(tsMillis, 0, 999));
 
-    returnMessage += varTemp;
+    varTemp.replace("{{time}}", String(ts)+String(millisText));
 
-    returnMessage +=_endMessage;
-    return(returnMessage);
+    return(varTemp);
 }
 
 
@@ -209,38 +642,33 @@ bool Esp32MAClientSend::sendMQTTMessage(String name, int value, unsigned long ts
 
 bool Esp32MAClientSend::sendMQTTMessage(String mqttMessage, bool isComOK) {
 
-    bool isComFullOK = false;
-    bool isMessageSent = false;
-
-    // If the connection is recovered, do not resend immediatelly
-
-    if (isComOK && !_lastIsWifiOK) _recoveringComMillis = millis();
+    return(sendMQTTMessage(mqttMessage.c_str(), isComOK));
+}
 
-    else if (isComOK && (millis()-_recoveringComMillis)>= COMRECOVERYDELAY) {
-        isComFullOK=true;
-    }
-    else isComFullOK=false;
+bool Esp32MAClientSend::sendMQTTMessage(const char* mqttMessage, bool isComOK) {
 
-    // Reset when some delay happened until re-conection
+    bool isMessageSent = false;
 
-    if (isComFullOK && !_lastIsComFullOK) Esp32MQTTClient_Reset();
+    // Only sent if connected (not while reconnecting)
 
-    // If we can send the message
+    _updateCom(isComOK);
 
-    if (isComFullOK) {
+    if (_com.canSend()) {
 
-        EVENT_INSTANCE* message = Esp32MQTTClient_Event_Generate(mqttMessage.c_str(), MESSAGE);
+        EVENT_INSTANCE* message = Esp32MQTTClient_Event_Generate(mqttMessage, MESSAGE);
 
         isMessageSent = Esp32MQTTClient_SendEventInstance(message);
 
 
-        if (isMessageSent) debug.setMsg("Message sent =" + mqttMessage);
+        if (isMessageSent) {
+            _sendSeq++;
+            debug.setMsg("Message sent =" + String(mqttMessage));
+        } else {
+            _com.messageFailed(millis());
+        }
 
     } 
 
-    _lastIsWifiOK = isComOK;
-    _lastIsComFullOK = isComFullOK;
-
     return(isMessageSent);
 }
 
@@ -373,11 +801,15 @@ unsigned long Esp32MAClientSend::makeTS(int year, byte month, byte day, byte hou
 
 String Esp32MAClientSend::getBufferInfo(){
 
-    UBaseType_t buffMsgWaiting = uxQueueMessagesWaiting(*_ptrxBufferCom);
-    UBaseType_t buffSpaceAvailable = uxQueueSpacesAvailable(*_ptrxBufferCom);
-    int msgTotal = (int)buffMsgWaiting + (int)buffSpaceAvailable;
+    int buffMsgWaiting = _bufferSize();
+    int msgTotal = (_ptrRingBufferCom != NULL) ? _ptrRingBufferCom->capacity() : buffMsgWaiting + (int)uxQueueSpacesAvailable(*_ptrxBufferCom);
     
-    String status = "[" + String((int)buffMsgWaiting) + "/" + String(msgTotal) + "]";
+    String status = "[" + String(buffMsgWaiting) + "/" + String(msgTotal) + "]";
+
+    if (_batchSize > 0) status += " Batch[" + String(_batchSize) + "]";
+    if (_windowSize > 0) status += " InFlight[" + String(_windowSize) + "/" + String(_windowLimit) + "]";
+    if (_isCatchingUp) status += " CatchUp";
+    if (_com.state() != COM_UP) status += " Com:" + String(_com.stateName());
 
     return(status);
 
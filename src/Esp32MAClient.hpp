@@ -1,8 +1,19 @@
 #ifndef ESP32MACLIENT_HPP
 #define ESP32MACLIENT_HPP
 
-#define MILLISSENDPERIOD 1000 // Minimum period between messages to Machine Advisor
-#define COMRECOVERYDELAY 1000 // Timeout after recovering Wifi/communications
+#define MILLISSENDPERIOD 1000 // Default period between messages to Machine Advisor (sustained rate)
+#define SENDBURST 1 // Default messages that can be sent at once after an idle time
+#define SENDCATCHUPRATE 10 // Default messages per second while sending the backlog after a reconnection
+#define SENDCATCHUPBURST 10
+#define SENDCATCHUPBACKLOG MAXBATCHSAMPLES // Records waiting that start the catch-up after a reconnection (and end it)
+#define COMRECOVERYDELAY 1000 // Default timeout after recovering Wifi/communications (first delay of the backoff)
+#define MAXPAYLOADSIZE 2048 // Default and max bytes of a message (the samples of a message are sent together)
+#define MINPAYLOADSIZE 256 // Min bytes of a message (a sample always fits)
+#define MAXBATCHSAMPLES MAXNUMVARS // Samples of a message: one per variable (the variable name is the JSON key)
+#define SENDWINDOW 4 // Default messages sent and not yet confirmed by the IoT Hub
+#define MAXSENDWINDOW 8
+#define SENDACKTIMEOUT 10000 // Default millis to wait for the confirmation of a message before sending it again
+#define MAXCONFIRMATIONS (2 * MAXSENDWINDOW) // Confirmations received, waiting for the next update
 #define ENDPOINTAPI "https://api.machine-advisor.schneider-electric.com/download/{{clientidnum}}/%5B%22{{device}}%3A{{varname}}%22%5D/{{tsini}}/{{tsend}}"
 
 
@@ -15,9 +26,30 @@
 //TODO: convert API responses to JSON
 
 #include "Esp32MALog.hpp" // Log class
+#include "TokenBucket.hpp" // Pacing of the messages
+#include "PayloadWriter.hpp" // Messages written without heap
+#include "ComManager.hpp" // Connection state and reconnection backoff
 
 #include "DebugMgr.hpp"  // Debug class
 
+// Type: Message sent and not yet confirmed by the IoT Hub, with its samples to send it again
+
+typedef struct inFlightMsg_t {
+    varStamp_t samples[MAXBATCHSAMPLES];
+    int numSamples;
+    bool isSent; // Waiting for the confirmation. If not, waiting to be sent again.
+    bool isConfirmed; // Kept until the messages sent before it are confirmed
+    uint32_t sendSeq; // Order of the message in the successful sends (the confirmations come in this order)
+    unsigned long sentMillis;
+} inFlightMsg_t;
+
+// Type: Confirmation received by the callback
+
+typedef struct sendConfirmation_t {
+    uint32_t sendSeq;
+    IOTHUB_CLIENT_CONFIRMATION_RESULT result;
+} sendConfirmation_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,7 +62,8 @@ class Esp32MAClientSend {
         // Constructor
 
         Esp32MAClientSend(String assetName, Esp32MAClientLog &logClient); // Easy constructor. Takes log object as parameter
-        Esp32MAClientSend(String assetName, QueueHandle_t* ptrxBufferCom, unsigned long* ptrTs);
+        Esp32MAClientSend(String assetName, QueueHandle_t* ptrxBufferCom, unsigned long* ptrTs, varRegisterList_t* ptrVarList=NULL); // Without the var list, names are "var<varId>"
+        Esp32MAClientSend(String assetName, SPSCBuffer* ptrRingBufferCom, unsigned long* ptrTs, varRegisterList_t* ptrVarList=NULL); // Lock-free RAM buffer
 
         // Conexion methods
 
@@ -53,6 +86,7 @@ class Esp32MAClientSend {
         // Sending messages manually 
 
         bool sendMQTTMessage(String message, bool isComOK = true);
+        bool sendMQTTMessage(const char* message, bool isComOK = true);
         bool sendMQTTMessage(String name, int value, unsigned long ts, bool isComOK = true);
 
         // API management to download data
@@ -65,6 +99,37 @@ class Esp32MAClientSend {
 
         String getBufferInfo();
 
+        // Max bytes of each message (MINPAYLOADSIZE..MAXPAYLOADSIZE). As many buffered samples as fit
+        // are sent in the same message (at most one per variable). Applied from the next message.
+
+        void setMaxPayloadSize(int maxBytes);
+
+        // Pacing of the messages: token bucket with a sustained rate and bursts of up to burst messages.
+        // After a reconnection with a backlog, the catch-up rate is used until the backlog is sent.
+        // The backlog includes the SD buffer if the sender is built from the log object.
+
+        void setSendRate(float messagesPerSecond, int burst=SENDBURST);
+        void setCatchUpRate(float messagesPerSecond, int burst=SENDCATCHUPBURST); // Not above the sustained rate: no catch-up
+        bool isCatchingUp() {return (_isCatchingUp);};
+
+        // Connection: isComOK of update() is the link. When it is recovered the client is reset after a delay,
+        // doubled (with jitter) after each failed reconnection up to maxMillis, and nothing is sent meanwhile.
+        // COMMAXFAILURES failed messages in a row also reconnect. An outage shorter than maxOutageMillis
+        // of a healthy connection is resumed without reset (0: always reset).
+
+        void setComRecoveryDelay(unsigned long delayMillis, unsigned long maxMillis=COMBACKOFFMAX);
+        void setComFastResume(unsigned long maxOutageMillis);
+        comState_t getComState() {return (_com.state());};
+        comStats_t getComStats() {return (_com.getStats());};
+
+        // Up to numMessages messages are sent without waiting for their confirmation by the IoT Hub.
+        // The samples of a message are kept until it is confirmed, and sent again if the hub answers
+        // an error or there is no answer in timeoutMillis (so a sample can arrive twice, never zero times).
+        // Only one sender can be connected (the confirmation callback of the client is global).
+
+        void setSendWindow(int numMessages, unsigned long timeoutMillis=SENDACKTIMEOUT);
+        int getMsgInFlight() {return (_windowSize);};
+
         // Auxiliar static methods
 
         static unsigned long makeTS(int year, byte month, byte day, byte hour, byte min, byte seg);
@@ -72,10 +137,15 @@ class Esp32MAClientSend {
         // Error management
 
         DebugMgr debug;
-        int getMsgSentOK () {return (_messageOKCount);};
+        int getMsgSentOK () {return (_messageOKCount);}; // Confirmed by the IoT Hub
+        unsigned long getSamplesSentOK () {return (_samplesOKCount);};
 
     private:
 
+        // Host benchmark (host/bench) compares the message builders
+
+        friend class Esp32MAClientSendBench;
+
         String _assetName; // Asset name (constructor)
 
         unsigned long _nowMillis;
@@ -88,6 +158,7 @@ class Esp32MAClientSend {
 
         int _messageOKCount = 0; // Messages sent OK
         int _messageErrorCount = 0; // Message with problems
+        unsigned long _samplesOKCount = 0; // Samples sent OK (several per message)
 
 
         // Body of MA message
@@ -104,9 +175,10 @@ class Esp32MAClientSend {
 
         void _buildConnexionString();
         static void _SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+        static Esp32MAClientSend* _ptrConnected; // Sender of the confirmations
 
-        String _createMQTTMessage();
-        String _createMQTTMessageVar(String name, int value, unsigned long ts);
+        String _createMQTTMessageVar(String name, int value, unsigned long ts, int tsMillis=0);
+        String _createMQTTVarPart(String name, int value, unsigned long ts, int tsMillis=0);
 
 
 
@@ -114,9 +186,24 @@ class Esp32MAClientSend {
 
         bool _isComOK;
 
-        bool _lastIsWifiOK; // To manage the re-sending delay
-        bool _lastIsComFullOK; 
-        unsigned long _recoveringComMillis=0;
+        ComManager _com = ComManager(COMRECOVERYDELAY, COMBACKOFFMAX);
+        comState_t _lastComState=COM_DOWN; // To log the changes
+
+        void _updateCom(bool isComOK);
+
+        // Pacing and catch-up after a reconnection
+
+        TokenBucket _sendBucket = TokenBucket(1000.0f / MILLISSENDPERIOD, SENDBURST);
+        float _sendRate = 1000.0f / MILLISSENDPERIOD;
+        int _sendBurst = SENDBURST;
+        float _catchUpRate = SENDCATCHUPRATE;
+        int _catchUpBurst = SENDCATCHUPBURST;
+        bool _isCatchingUp=false;
+        bool _lastSendOK=false; // A message sent after a failed one is a reconnection
+
+        Esp32MAClientLog* _ptrLog = NULL; // To know the backlog in the SD (easy constructor)
+        int _backlogSize();
+        void _updateCatchUp(bool sendOK);
 
         // API management
 
@@ -125,12 +212,65 @@ class Esp32MAClientSend {
 
         //Freertos buffer managment
         
-        QueueHandle_t* _ptrxBufferCom;
+        QueueHandle_t* _ptrxBufferCom = NULL;
+        SPSCBuffer* _ptrRingBufferCom = NULL; // If not NULL, used instead of the queue
+        std::atomic<bool>* _ptrBufferLock = NULL; // Queue taken by the log (overflow policy) or read by the sender
         bool _sendBufferedMessages();
-        unsigned long _lastBufferMillis=0;
+
+        // Batch of the next message: samples taken from the buffer, kept until the message is sent.
+        // The message is written in a fixed buffer as the samples are added.
+
+        varStamp_t _batch[MAXBATCHSAMPLES];
+        int _batchSize=0;
+        char _payloadBuffer[MAXPAYLOADSIZE + 1];
+        PayloadWriter _payload;
+        int _maxPayloadSize=MAXPAYLOADSIZE;
+
+        void _initPayload();
+        bool _writePayload(varStamp_t* ptrSamples, int numSamples);
+
+        // In-flight window. The confirmations come in the order of the sends, without id:
+        // the n-th confirmation is the one of the n-th message sent. A confirmed message is removed
+        // when the messages sent before it are confirmed. When a confirmation does not arrive
+        // (timeout) or a send fails, the counters are resynchronized and the whole window is sent again.
+
+        inFlightMsg_t _window[MAXSENDWINDOW];
+        int _windowSize=0;
+        int _windowLimit=SENDWINDOW;
+        unsigned long _ackTimeout=SENDACKTIMEOUT;
+        uint32_t _sendSeq=0; // Messages sent OK
+        uint32_t _confirmSeq=0; // Confirmations received
+
+        sendConfirmation_t _confirmations[MAXCONFIRMATIONS];
+        volatile int _numConfirmations=0;
+
+        void _queueConfirmation(IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+        void _processConfirmations();
+        void _removeConfirmed(); // Confirmed messages, in the order of the sends
+        void _checkAckTimeouts();
+        void _failInFlight(); // Confirmations lost: resync and send the window again
+        int _nextRetry(); // Oldest message to send again (-1 if none)
+        bool _sendInFlight(int index);
+        bool _sendBatch();
+        void _removeInFlight(int index);
+        int _samplesInFlight();
+        bool _isAnySent(); // Waiting for a confirmation
+
+        void _fillBatch();
+        bool _isVarInBatch(int varId);
+
+        bool _peekBuffer(varStamp_t* ptrVarStamp);
+        void _removeFromBuffer();
+        int _bufferSize();
 
         unsigned long* _ptrTs;
 
+        // Names of the buffered samples (only the varId is buffered)
+
+        varRegisterList_t* _ptrVarList = NULL;
+        char _varNameBuffer[MAXCHARVARNAME + 1];
+        const char* _getVarName(int varId);
+
 
 };
 
@@ -1,20 +1,36 @@
 
 #include "Esp32MALog.hpp"
+#include <new>
 
 // Constructor
 
-Esp32MAClientLog::Esp32MAClientLog(bool enableSDLog){
+Esp32MAClientLog::Esp32MAClientLog(bool enableSDLog, bool lockFreeBuffer){
 
     _enableSDLog = enableSDLog;
+    _lockFreeBuffer = lockFreeBuffer;
+    _backpressure = false;
 
-    // creation of freertos FIFO queue (Thread safe)
+    // creation of freertos FIFO queue (Thread safe). The lock-free ring is a member.
 
-    _xBufferCom = xQueueCreate( MAXBUFFER, sizeof(varStamp_t));
+    if (!_lockFreeBuffer) _xBufferCom = xQueueCreate( MAXBUFFER, sizeof(varStamp_t));
 
-    if(_xBufferCom == NULL){
+    if(!_lockFreeBuffer && _xBufferCom == NULL){
         debug.setError("Creating memory thread safe buffer. Check memory allocation.");
     }
 
+    _xISRBuffer = xQueueCreate(ISRBUFFERSIZE, sizeof(isrStamp_t));
+
+    if (_xISRBuffer == NULL) {
+        debug.setError("Creating the interrupt capture buffer. Check memory allocation.");
+    }
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+        _producerTask[i] = NULL;
+        _producerRing[i] = NULL;
+    }
+
+    memset(&_tierStats, 0, sizeof(_tierStats));
+
     debug.setLibName("Log");
 
 }
@@ -25,7 +41,7 @@ Esp32MAClientLog::Esp32MAClientLog(bool enableSDLog){
 // thershold (optinal) = if filled, the variable will be sent if the change>threshold and minPeriod has ocurred
 // maxPeriod (optional) = if filled, maximum period without sending the variable
 
-int Esp32MAClientLog::registerVar(String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod){
+int Esp32MAClientLog::registerVar(String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod, varCompression_t compression){
 
     int varId=-1;
     bool allOk=false;
@@ -33,30 +49,18 @@ int Esp32MAClientLog::registerVar(String name, int *ptrValue, int minPeriod, int
     // TODO: Done here to make it compatible with M5Stack SD management
     // Should the init be done in a separate method?
 
-    if (!_logInitialized) {
-
-        if (_enableSDLog ) {
-            if (!_sdBufferCom.init()) {
-                debug.setError("Problem mounting the SD. Check SD Card.", _lastTs);
-            } else debug.setMsg("SD Initalized", _lastTs);
-            
-            if (!_sdBufferCom.setFileName(FILENAMESD)) {
-                debug.setError("Problem intializing SD file for buffer. Check SD card.", _lastTs);
-            } else debug.setMsg("Buffer file created", _lastTs);
-        }
-
-        _logInitialized = true;
-    }
+    if (!_logInitialized) _initLog();
 
     // Starting register variable 
 
     if (_varList.num < MAXNUMVARS) {
 
-        allOk = _registerVarAtPosition(_varList.num, name, ptrValue, minPeriod, threshold, maxPeriod);
+        allOk = _registerVarAtPosition(_varList.num, name, ptrValue, minPeriod, threshold, maxPeriod, compression);
 
         if (allOk) {
             varId = _varList.num;
             _varList.num ++;
+            _numRecordVars.store(_varList.num, std::memory_order_release);
             debug.setMsg("Variable registered: " + name, _lastTs);
         }
 
@@ -70,9 +74,116 @@ int Esp32MAClientLog::registerVar(String name, int *ptrValue, int minPeriod, int
 }
 
 
+// Backpressure configuration, and priority of each variable
+
+void Esp32MAClientLog::setBackpressure(bool enable, int startPercent, int maxStretch){
+
+    _backpressure = enable;
+    _backpressureStartPercent = constrain(startPercent, 0, 99);
+    _backpressureMaxStretch = max(maxStretch, 1);
+}
+
+bool Esp32MAClientLog::setVarPriority(int varId, int priority){
+
+    if (varId < 0 || varId >= _varList.num) {
+        debug.setError("Only can be set the priority of a variable already registered. VarId: " + String(varId), _lastTs);
+        return(false);
+    }
+
+    _varList.var[varId].priority = constrain(priority, 0, VARPRIORITYMAX);
+
+    return(true);
+}
+
+
+// Attach a filter to a polled variable
+
+bool Esp32MAClientLog::setVarFilter(int varId, varFilterType_t type, int param){
+
+    if (varId < 0 || varId >= _varList.num || _varList.var[varId].ptrValue == NULL || !_filters.set(varId, type, param)) {
+        debug.setError("Filter not valid, variable not polled, or no more space for filters. VarId: " + String(varId), _lastTs);
+        return(false);
+    }
+
+    return(true);
+}
+
+
+// Register an aggregated variable: a recorded variable for each statistic, fed at the end of each window
+
+int Esp32MAClientLog::registerAggregatedVar(String name, int *ptrValue, unsigned long windowMillis, uint8_t stats){
+
+    const char* suffixes[AGGNUMSTATS] = {"_min", "_max", "_avg", "_count", "_last"};
+    int varIds[AGGNUMSTATS];
+    int firstVarId = -1;
+    int numStats = 0;
+
+    for (int i=0; i<AGGNUMSTATS; i++) {
+        if ((stats & (1 << i)) != 0) numStats++;
+    }
+
+    if (ptrValue == NULL || numStats == 0 || _aggregator.numAggregates() >= MAXAGGREGATES) {
+        debug.setError("Aggregated variable not valid, or no more space for aggregated variables: " + name, _lastTs);
+        return(-1);
+    }
+
+    // All the statistics are registered, or none
+
+    if (_varList.num + numStats > MAXNUMVARS) {
+        debug.setError("No more space for the statistics of the aggregated variable: " + name, _lastTs);
+        return(-1);
+    }
+
+    for (int i=0; i<AGGNUMSTATS; i++) {
+
+        varIds[i] = -1;
+
+        if ((stats & (1 << i)) == 0) continue;
+
+        // The suffix is kept if the name is truncated
+        String statName = name.substring(0, MAXCHARVARNAME - strlen(suffixes[i])) + suffixes[i];
+
+        varIds[i] = registerRecordedVar(statName);
+
+        if (varIds[i] < 0) return(-1);
+        if (firstVarId < 0) firstVarId = varIds[i];
+    }
+
+    _aggregator.add(ptrValue, windowMillis, varIds, millis());
+
+    return(firstVarId);
+}
+
+
+// Register a variable without pointer. Its samples come from record().
+
+int Esp32MAClientLog::registerRecordedVar(String name){
+
+    return(registerVar(name, NULL, 0));
+}
+
+
+// Mount the SD and open the SD buffer (first registered variable, or start of the SD task)
+
+void Esp32MAClientLog::_initLog(){
+
+    if (_enableSDLog ) {
+        if (!_sdBufferCom.init()) {
+            debug.setError("Problem mounting the SD. Check SD Card.", _lastTs);
+        } else debug.setMsg("SD Initalized", _lastTs);
+        
+        if (!_sdBufferCom.setFileName(FILENAMESD)) {
+            debug.setError("Problem intializing SD file for buffer. Check SD card.", _lastTs);
+        } else debug.setMsg("Buffer file ready. Records to send=" + String(_sdBufferCom.bufferSize()), _lastTs);
+    }
+
+    _logInitialized = true;
+}
+
+
 // Registering a variable with a varID code
 
-bool Esp32MAClientLog::_registerVarAtPosition(int varID, String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod){
+bool Esp32MAClientLog::_registerVarAtPosition(int varID, String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod, varCompression_t compression){
 
     // TODO: Verify that values are correct
 
@@ -84,8 +195,32 @@ bool Esp32MAClientLog::_registerVarAtPosition(int varID, String name, int *ptrVa
         _varList.var[varID].threshold = threshold;
         _varList.var[varID].maxPeriod = maxPeriod;
 
+        memset(_varList.var[varID].shortName, 0, sizeof(_varList.var[varID].shortName));
+        memcpy(_varList.var[varID].shortName, name.c_str(), min((int)name.length(), MAXCHARVARNAME));
+
+        _varList.var[varID].compression = compression;
+
+        if (varID == _varList.num) _varList.var[varID].priority = VARPRIORITYDEFAULT;
+
         _varList.var[varID]._lastUpdateTime = 0;
         _varList.var[varID]._lastValue = 0;
+        _varList.var[varID]._isHeldValid = false;
+
+        // The filter starts again with the new variable (recorded variables are not filtered)
+
+        if (ptrValue != NULL) _filters.reset(varID);
+        else _filters.set(varID, FILTER_NONE, 0);
+
+        // The SD buffer only stores the varId. Names are in the file dictionary.
+
+        if (_enableSDLog) _setSDVarName(varID, name);
+
+        // Due immediately, to be checked in the next update. Recorded variables are not polled.
+
+        _scheduler.unwatch(varID);
+
+        if (ptrValue != NULL) _scheduler.schedule(varID, millis());
+        else _scheduler.remove(varID);
 
         return(true);
 
@@ -98,11 +233,11 @@ bool Esp32MAClientLog::_registerVarAtPosition(int varID, String name, int *ptrVa
 
 // Modify an already registered variable
 
-bool Esp32MAClientLog::modifyRegisteredVar(String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod){
+bool Esp32MAClientLog::modifyRegisteredVar(String name, int *ptrValue, int minPeriod, int threshold, int maxPeriod, varCompression_t compression){
 
     int varID = _findVarIndex(ptrValue);
 
-    if (varID>=0) return(_registerVarAtPosition(varID, name, ptrValue, minPeriod, threshold, maxPeriod));
+    if (varID>=0) return(_registerVarAtPosition(varID, name, ptrValue, minPeriod, threshold, maxPeriod, compression));
     else {
         return(false);  
     }
@@ -123,183 +258,1491 @@ int Esp32MAClientLog::_findVarIndex (int *ptrValue){
 }
 
 
-// Check if a variable should be updated. If so, push it to the communicaitons buffer
+// Check the variables that are due. If they should be updated, push them to the communicaitons buffer
 // Alse save the last two variables, and update the SD buffer.
 // To be called as fast as posible
 
 void Esp32MAClientLog::update(unsigned long ts){
 
-    _lastTs = ts;
     _nowMillis = millis();
-    
-    for (int varId=0; varId<_varList.num; varId++){
 
-        // Try to move data from SD to memory buffer
-        _updateSDBuffer();
+    if (ts != _lastTs) _tsChangeMillis = _nowMillis;
+    _lastTs = ts;
+    _recordTs.store(ts, std::memory_order_relaxed);
+
+    // Try to move data from SD to memory buffer (limited by the drain budget)
+
+    _updateSDBuffer();
+
+    // Top up the RAM buffer from the memory tier (copies in RAM)
+
+    _updateMemTier();
+
+    // Records waiting for space in the buffers go before the new ones
+
+    _drainOverflow();
+
+    // Stretch of the sampling periods, from the occupancy of the buffers
+
+    _updateBackpressure();
+
+    // Samples captured in interrupts, and recorded by other tasks
+
+    _foldISRCaptures();
+    _mergeRecords();
+
+    // Filters see every sample, also the ones of variables not due
+
+    _updateFilters();
+
+    // Variables already due, waiting for a change bigger than the threshold
+
+    int i = 0;
+
+    _lastWatchMillis = _nowMillis;
+
+    while (i < _scheduler.numWatched()) {
+
+        int varId = _scheduler.watchedAt(i);
+
+        _updateVar(varId);
+
+        // If sampled, the variable leaves the list and the last one takes its position
+        if (_scheduler.isWatched(varId) && _scheduler.watchedAt(i) == varId) i++;
+    }
+
+    // Variables whose period is over
+
+    int varId;
+
+    while (_scheduler.popDue(_nowMillis, &varId)) {
+
+        _updateVar(varId);
+
+        if (!_scheduler.isScheduled(varId)) _scheduler.watch(varId);
+    }
+
+    // Aggregated variables
 
-        if(_shouldVarBeUpdated(varId)) _pushVarToBuffer(varId, ts);
+    _updateAggregates();
 
+    // Values staged for the SD are written if they have waited too long (by the SD task, if running)
+
+    if (_enableSDLog && !_sdTaskRunning) _sdBufferCom.flushIfDue();
+
+    int sdTaskLost = _sdTaskLost;
+
+    if (sdTaskLost != _sdTaskLostReported) {
+        _varsNotBufferedAndLost += sdTaskLost - _sdTaskLostReported;
+        _sdTaskLostReported = sdTaskLost;
+        debug.setError("Problem pushing values to the SD buffer in the SD task. Check SD. Messages Lost: " + String(_varsNotBufferedAndLost), _lastTs);
+    }
+
+    int recordsLost = _recordsLost;
+
+    if (recordsLost != _recordsLostReported) {
+        _varsNotBufferedAndLost += recordsLost - _recordsLostReported;
+        _recordsLostReported = recordsLost;
+        debug.setError("Problem recording values from other tasks or interrupts (buffer full, too many tasks or var not registered). Messages Lost: " + String(_varsNotBufferedAndLost), _lastTs);
     }
 
     if (_coldStart) _coldStart = false;
 }
 
 
-// Update SD Buffer: Move data to normal buffer if it is posible
+// Record a sample from any task. Only the ring of the task is written (single producer).
 
-void Esp32MAClientLog::_updateSDBuffer(){
-    
-    if (!_sdBufferCom.empty() && _enableSDLog) {
+bool Esp32MAClientLog::record(int varId, int value, unsigned long ts){
 
-        int spacesAvailableBuffer = uxQueueSpacesAvailable(_xBufferCom);
-        int sizeSDBuffer = _sdBufferCom.bufferSize();
+    varStamp_t* ptrSlot;
 
-        int maxMovements = min(spacesAvailableBuffer, sizeSDBuffer);
+    if (varId < 0 || varId >= _numRecordVars.load(std::memory_order_acquire)) {
+        _recordsLost++;
+        return(false);
+    }
 
-        for (int i=0; i<maxMovements; i++){
-            varStamp_t varStamp;
-            if(_sdBufferCom.pop(&varStamp)) {
-                xQueueSendToBack(_xBufferCom, &varStamp, 0);
-            } else {
-                debug.setError("Problem moving data from SD buffer to memory buffer. Check SD.", _lastTs);
-            }
-        }
+    SPSCBuffer* ring = _getProducerRing();
+
+    if (ring == NULL || ring->reserve(&ptrSlot, 1) == 0) {
+        _recordsLost++;
+        return(false);
     }
 
+    ptrSlot->varId = varId;
+    ptrSlot->tsMillis = 0;
+    ptrSlot->value = value;
+    ptrSlot->ts = (ts != 0) ? ts : _recordTs.load(std::memory_order_relaxed);
+
+    ring->commit(1);
+
+    return(true);
 }
 
+// Capture from an interrupt: only the value and the micros. The conversion is done by update().
 
-// Calculate if the variable should be updated or not
+bool IRAM_ATTR Esp32MAClientLog::recordFromISR(int varId, int value){
 
-bool Esp32MAClientLog::_shouldVarBeUpdated(int varId){
+    isrStamp_t isrStamp;
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
 
-    bool updatedDueToThreshold;
-    bool updatedDueToMinPeriod;
-    bool updatedDueToMaxPeriod;
-    
-    unsigned long elapsedTimeVar = _nowMillis - _varList.var[varId]._lastUpdateTime;
+    isrStamp.micros = micros();
+    isrStamp.varId = varId;
+    isrStamp.value = value;
 
-    updatedDueToThreshold = (abs(*(_varList.var[varId].ptrValue) - _varList.var[varId]._lastValue) > _varList.var[varId].threshold);
-    updatedDueToMinPeriod = (elapsedTimeVar >= _varList.var[varId].minPeriod);
-    updatedDueToMaxPeriod = (elapsedTimeVar > _varList.var[varId].maxPeriod && _varList.var[varId].maxPeriod != -1);
+    _isrCaptured = true;
 
-    bool varToBeUpdated =  ( updatedDueToMinPeriod && updatedDueToThreshold) || updatedDueToMaxPeriod || _coldStart;
+    if (varId < 0 || varId >= MAXNUMVARS || xQueueSendFromISR(_xISRBuffer, &isrStamp, &higherPriorityTaskWoken) != pdPASS) {
+        _recordsLost++;
+        return(false);
+    }
 
-        
-    return(varToBeUpdated);
+    return(true);
 }
 
+// Time stamp of the interrupt: the one of this update, minus the time since the interrupt.
+// The millis of the current second are counted from the update where the time stamp changed.
 
-// Push variable to the communication buffer
-
-bool Esp32MAClientLog::_pushVarToBuffer(int varId, unsigned long ts) {
+void Esp32MAClientLog::_foldISRCaptures(){
 
+    isrStamp_t isrStamp;
     varStamp_t varStamp;
 
-    bool isValueBuffered=false;
+    if (!_isrCaptured) return;
 
-    _fillVarFromIdTs(&varStamp, varId, ts);
+    unsigned long long nowMillisTs = (unsigned long long)_lastTs * 1000 + min(_nowMillis - _tsChangeMillis, 999UL);
 
-    // Send structure to buffer
+    for (int i=0; i<ISRBUFFERSIZE && xQueueReceive(_xISRBuffer, &isrStamp, 0) == pdPASS; i++) {
 
-    isValueBuffered = _pushVarToBufferHardware(&varStamp);
+        long ageMicros = (long)(micros() - isrStamp.micros);
+        unsigned long long ageMillis = (ageMicros > 0) ? (unsigned long long)ageMicros / 1000 : 0;
+        unsigned long long eventMillisTs = nowMillisTs - min(ageMillis, nowMillisTs);
 
-    // Either if can be queued or not, move to the next schedule
+        if (isrStamp.varId >= _varList.num) {
+            _recordsLost++;
+            continue;
+        }
 
-    _varList.var[varId]._lastUpdateTime = _nowMillis;
-    _varList.var[varId]._lastValue = varStamp.value;
-    
-    if (!isValueBuffered) {
+        varStamp.varId = isrStamp.varId;
+        varStamp.value = isrStamp.value;
+        varStamp.ts = (unsigned long)(eventMillisTs / 1000);
+        varStamp.tsMillis = (uint16_t)(eventMillisTs % 1000);
 
-        _varsNotBufferedAndLost++;
-        String errorMsg;
-        errorMsg = "Problem pushing a var to the buffer. Buffer=" + getBufferInfo() + String("\n");
-        errorMsg += "Value Lost: " + String(varStamp.varName) + " " + String(varStamp.value) + " " + String(varStamp.ts) + String("\n");
-        errorMsg += "Messages Lost: " + String(_varsNotBufferedAndLost) + String("");
-        debug.setError(errorMsg, _lastTs);
+        _pushRecordedVar(&varStamp);
+    }
+}
 
-    } 
+// The slot is claimed with a compare and swap, so two new tasks can not take the same one.
+// The ring is allocated before: a slot is never owned without its ring.
 
-    return(isValueBuffered);
+SPSCBuffer* Esp32MAClientLog::_getProducerRing(){
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    bool isSlotFree = false;
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+
+        TaskHandle_t slotTask = _producerTask[i].load(std::memory_order_acquire);
+
+        if (slotTask == task) return(_producerRing[i].load(std::memory_order_acquire));
+
+        isSlotFree = isSlotFree || slotTask == NULL;
+    }
+
+    if (!isSlotFree) return(NULL);
+
+    SPSCBuffer* ring = new (std::nothrow) SPSCBuffer();
+
+    if (ring == NULL) return(NULL);
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+
+        TaskHandle_t freeSlot = NULL;
+
+        // The task is claimed first and its ring stored after. The slot is only seen without ring
+        // in between: the merge skips a NULL ring, the owner task gets the ring from this call, and
+        // the slot is freed only after its task releases it (the ring is NULL before the task).
+
+        if (_producerRing[i].load(std::memory_order_acquire) == NULL && _producerTask[i].compare_exchange_strong(freeSlot, task)) {
+            _producerRing[i].store(ring, std::memory_order_release);
+            return(ring);
+        }
+    }
+
+    delete ring;
+
+    return(NULL);
 }
 
+// The task gives up its slot. The ring keeps its records until they are merged.
 
+void Esp32MAClientLog::releaseRecorder(){
 
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
 
-bool Esp32MAClientLog::_pushVarToBufferHardware(varStamp_t* ptrVarStamp) {
+    for (int i=0; i<MAXPRODUCERS; i++) {
 
-    bool allOKLogSD=false;
-    bool allOKBuffer=false;
-    bool allOKNewFileSD=false;
-    bool logToSD;
+        TaskHandle_t slotTask = task;
 
-    logToSD = !_sdBufferCom.empty() && _enableSDLog;
+        if (_producerTask[i].compare_exchange_strong(slotTask, PRODUCERRELEASED)) return;
+    }
+}
 
-    // If logging to SD, continue logging to SD until SD Buffer is empty
-    if (logToSD) {
+// Slots released with their ring merged are free again (the ring is freed first, so a task
+// that claims the slot finds it without ring)
 
-        allOKLogSD = _sdBufferCom.push(ptrVarStamp);
-        if (!allOKLogSD) debug.setError("Problem pushing a value to a SD Buffer. Check SD.", _lastTs);
+void Esp32MAClientLog::_freeReleasedProducers(){
 
-    } 
+    for (int i=0; i<MAXPRODUCERS; i++) {
 
-    // In case of NOT logging to SD, or error logging to SD (ie, SD extracted), try to log to Buffer
-    if (!logToSD || !allOKLogSD) {
-        
-        allOKBuffer = (xQueueSendToBack(_xBufferCom, ptrVarStamp, 0) == pdPASS);
-        if (uxQueueMessagesWaiting(_xBufferCom)>=2) {
-            debug.setMsg("RAM buffer is getting bigger " + getBufferInfo(), _lastTs);
+        if (_producerTask[i].load(std::memory_order_acquire) != PRODUCERRELEASED) continue;
+
+        SPSCBuffer* ring = _producerRing[i].load(std::memory_order_acquire);
+
+        if (ring != NULL && ring->size() > 0) continue;
+
+        _producerRing[i].store(NULL, std::memory_order_release);
+        delete ring;
+        _producerTask[i].store(NULL, std::memory_order_release);
+    }
+}
+
+bool Esp32MAClientLog::_hasProducers(){
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+        if (_producerTask[i].load(std::memory_order_relaxed) != NULL) return(true);
+    }
+
+    return(false);
+}
+
+bool Esp32MAClientLog::_isMergePending(){
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+        SPSCBuffer* ring = _producerRing[i].load(std::memory_order_acquire);
+        if (ring != NULL && ring->size() > 0) return(true);
+    }
+
+    return(false);
+}
+
+// The records of each ring are in order. The oldest head of the rings is taken each time.
+// Records are read in place and released at the end.
+
+void Esp32MAClientLog::_mergeRecords(){
+
+    SPSCBuffer* rings[MAXPRODUCERS];
+    varStamp_t* ptrHeads[MAXPRODUCERS];
+    int numReadable[MAXPRODUCERS];
+    int numMerged[MAXPRODUCERS];
+
+    if (!_hasProducers()) return;
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+        rings[i] = _producerRing[i].load(std::memory_order_acquire);
+        numReadable[i] = (rings[i] != NULL) ? rings[i]->readable(&ptrHeads[i], RECORDMERGEMAXRECORDS) : 0;
+        numMerged[i] = 0;
+    }
+
+    for (int n=0; n<RECORDMERGEMAXRECORDS; n++) {
+
+        int first = -1;
+
+        for (int i=0; i<MAXPRODUCERS; i++) {
+            if (numMerged[i] < numReadable[i] && (first < 0 || (long)(ptrHeads[i][numMerged[i]].ts - ptrHeads[first][numMerged[first]].ts) < 0)) first = i;
         }
 
-        // In case of buffer error (overload) and SD enabled, create a new file and log to SD.
+        if (first < 0) break;
+
+        _pushRecordedVar(&ptrHeads[first][numMerged[first]]);
+        numMerged[first]++;
+    }
+
+    for (int i=0; i<MAXPRODUCERS; i++) {
+        if (numMerged[i] > 0) rings[i]->release(numMerged[i]);
+    }
+
+    _freeReleasedProducers();
+}
+
+void Esp32MAClientLog::_pushRecordedVar(varStamp_t* ptrVarStamp){
+
+    _pushSampleToBuffer(ptrVarStamp, _nowMillis);
+}
+
 
-        if (!allOKBuffer && _enableSDLog) {
+// Check a due variable: push it to the buffer and schedule the next check
 
-            _sdBufferCom.createFile(FILENAMESD);
-            allOKNewFileSD = _sdBufferCom.push(ptrVarStamp);
-            if (!allOKNewFileSD) debug.setError ("Problem pushing value to a new SD file. Check SD.", _lastTs);
+void Esp32MAClientLog::_updateVar(int varId){
+
+    if (_varList.var[varId].compression != VAR_THRESHOLD) {
+        _updateCompressedVar(varId);
+        return;
+    }
+
+    if(_shouldVarBeUpdated(varId)) {
+        _pushVarToBuffer(varId, _lastTs);
+        _scheduleVar(varId);
+    }
+}
+
+
+// Dead band: when the value leaves the band, the last sample inside it is sent before the new one
+// (if it was not sent), so the step is not rebuilt as a ramp from the last value sent.
+// Swinging door: two doors pivot on the last value sent +-threshold. Each sample not sent narrows
+// them. When the line from the last value sent to a new sample goes out of the doors, it misses
+// the tolerance of a sample in between: the previous sample is sent (its line was within the doors),
+// and the doors pivot on it. So the signal is rebuilt within +-threshold at every sample checked.
+// In both modes maxPeriod sends the sample, and the first sample is always sent.
+
+void Esp32MAClientLog::_updateCompressedVar(int varId){
+
+    varRegister_t* ptrVar = &_varList.var[varId];
+    varStamp_t varStamp;
+
+    int value = _readVarValue(varId);
+
+    bool sendHeld = false;
+    bool sendSample = _coldStart || !ptrVar->_isHeldValid;
+
+    sendSample = sendSample || (ptrVar->maxPeriod != -1 && (_nowMillis - ptrVar->_lastUpdateTime) > (unsigned long)ptrVar->maxPeriod);
+
+    if (!sendSample && ptrVar->compression == VAR_DEADBAND) {
+
+        if (abs(value - ptrVar->_lastValue) > ptrVar->threshold) {
+            sendHeld = ptrVar->_isHeldValid && !ptrVar->_isHeldSent;
+            sendSample = true;
         }
 
+    } else if (!sendSample && ptrVar->compression == VAR_SWINGINGDOOR) {
+
+        sendHeld = _isSwingingDoorOpen(ptrVar, value);
     }
 
-    // If something worked, return true.
-    return (allOKLogSD || allOKBuffer || allOKNewFileSD);
+    if (ptrVar->compression == VAR_SWINGINGDOOR && (sendHeld || sendSample)) {
+        ptrVar->_slopeUpper = -INFINITY;
+        ptrVar->_slopeLower = INFINITY;
+    }
+
+    if (sendHeld) {
+
+        varStamp.varId = varId;
+        varStamp.tsMillis = 0;
+        varStamp.value = ptrVar->_heldValue;
+        varStamp.ts = ptrVar->_heldTs;
+
+        _pushSampleToBuffer(&varStamp, ptrVar->_heldTime);
+    }
+
+    if (sendSample) _pushVarToBuffer(varId, _lastTs);
+    else if (ptrVar->compression == VAR_SWINGINGDOOR) _narrowSwingingDoor(ptrVar, value);
+
+    ptrVar->_isHeldValid = true;
+    ptrVar->_isHeldSent = sendSample;
+    ptrVar->_heldValue = value;
+    ptrVar->_heldTime = _nowMillis;
+    ptrVar->_heldTs = _lastTs;
+
+    _scheduleCompressedVar(varId);
 }
 
+bool Esp32MAClientLog::_isSwingingDoorOpen(varRegister_t* ptrVar, int value){
 
+    unsigned long elapsedTime = _nowMillis - ptrVar->_lastUpdateTime;
 
-void Esp32MAClientLog::_fillVarFromIdTs(varStamp_t *ptrVar, int varId, unsigned long ts) {
+    if (elapsedTime == 0 || !ptrVar->_isHeldValid || ptrVar->_isHeldSent) return(false);
 
-    strcpy(ptrVar->varName, _varList.var[varId].name.substring(0,MAXCHARVARNAME).c_str());
-    ptrVar->varId = varId;
-    ptrVar->value = *(_varList.var[varId].ptrValue);
-    ptrVar->ts = ts;
+    float slope = (float)(value - ptrVar->_lastValue) / elapsedTime;
 
+    return(slope < ptrVar->_slopeUpper || slope > ptrVar->_slopeLower);
 }
 
+void Esp32MAClientLog::_narrowSwingingDoor(varRegister_t* ptrVar, int value){
 
+    unsigned long elapsedTime = _nowMillis - ptrVar->_lastUpdateTime;
 
-// Return buffer pointer.
+    if (elapsedTime == 0) return;
 
-QueueHandle_t* Esp32MAClientLog::_getPtrBuffer(){
-    return(&_xBufferCom);
+    ptrVar->_slopeUpper = max(ptrVar->_slopeUpper, (float)(value - ptrVar->threshold - ptrVar->_lastValue) / elapsedTime);
+    ptrVar->_slopeLower = min(ptrVar->_slopeLower, (float)(value + ptrVar->threshold - ptrVar->_lastValue) / elapsedTime);
 }
 
+// Compressed variables are checked every minPeriod (the sampling period), or on every update
 
-// Return buffer log information
+void Esp32MAClientLog::_scheduleCompressedVar(int varId){
 
-String Esp32MAClientLog::getBufferInfo(){
+    varRegister_t* ptrVar = &_varList.var[varId];
 
-    UBaseType_t buffMsgWaiting = uxQueueMessagesWaiting(_xBufferCom);
-    UBaseType_t buffSpaceAvailable = uxQueueSpacesAvailable(_xBufferCom);
-    int msgTotal = buffMsgWaiting + buffSpaceAvailable;
-    
-    String status = "[" + String(buffMsgWaiting) + "/" + String(msgTotal) + "]";
+    if (_effectiveMinPeriod(ptrVar) <= 0) {
+        _scheduler.remove(varId);
+        _scheduler.watch(varId);
+        return;
+    }
 
-    return(status);
+    _scheduler.unwatch(varId);
+    _scheduler.schedule(varId, _nowMillis + _effectiveMinPeriod(ptrVar));
 }
 
 
+// The stretch grows linearly from 1 at the start occupancy to maxStretch with the buffers full
+
+void Esp32MAClientLog::_updateBackpressure(){
+
+    int stretch = BACKPRESSURESCALE;
+
+    if (_backpressure) {
+
+        int size = _ramBufferSize();
+        int capacity = MAXBUFFER;
+
+        if (_memTier != NULL) {
+            size += _memTier->size();
+            capacity += _memTier->capacity();
+        }
+
+        int occupancyPercent = (int)((int64_t)size * 100 / capacity);
+
+        if (occupancyPercent > _backpressureStartPercent) {
+            stretch += (int)((int64_t)(_backpressureMaxStretch - 1) * BACKPRESSURESCALE * (occupancyPercent - _backpressureStartPercent) / (100 - _backpressureStartPercent));
+        }
+    }
+
+    bool wasStretched = _stretch > BACKPRESSURESCALE;
+
+    _stretch = stretch;
+
+    if (!wasStretched && stretch > BACKPRESSURESCALE) debug.setMsg("Buffer filling up, sampling periods stretched " + getBufferInfo(), _lastTs);
+    if (wasStretched && stretch == BACKPRESSURESCALE) debug.setMsg("Buffer drained, sampling periods restored " + getBufferInfo(), _lastTs);
+}
+
+// Variables checked on every update are sampled every BACKPRESSUREMINMILLIS stretched
+
+int Esp32MAClientLog::_effectiveMinPeriod(varRegister_t* ptrVar){
+
+    if (_stretch == BACKPRESSURESCALE || ptrVar->priority >= VARPRIORITYMAX) return(ptrVar->minPeriod);
+
+    int64_t stretch = BACKPRESSURESCALE + (int64_t)(_stretch - BACKPRESSURESCALE) * (VARPRIORITYMAX - ptrVar->priority) / VARPRIORITYMAX;
+
+    return((int)(max(ptrVar->minPeriod, BACKPRESSUREMINMILLIS) * stretch / BACKPRESSURESCALE));
+}
+
+
+// Add the raw sample of each filtered variable to its filter
+
+void Esp32MAClientLog::_updateFilters(){
+
+    for (int i=0; i<_filters.numFilters(); i++) {
+
+        varFilter_t* ptrFilter = _filters.at(i);
+
+        _filters.addSample(ptrFilter, *(_varList.var[ptrFilter->varId].ptrValue));
+    }
+}
+
+int Esp32MAClientLog::_readVarValue(int varId){
+
+    varFilter_t* ptrFilter = _filters.of(varId);
+
+    if (ptrFilter != NULL && ptrFilter->count > 0) return(ptrFilter->output);
+
+    return(*(_varList.var[varId].ptrValue));
+}
+
+
+// Add a sample to each aggregated variable. At the end of the window, send its statistics.
+
+void Esp32MAClientLog::_updateAggregates(){
+
+    varStamp_t varStamp;
+
+    for (int i=0; i<_aggregator.numAggregates(); i++) {
+
+        aggregate_t* ptrAggregate = _aggregator.at(i);
+
+        _aggregator.addSample(ptrAggregate, *(ptrAggregate->ptrValue));
+
+        if (!_aggregator.isWindowOver(ptrAggregate, _nowMillis)) continue;
+
+        for (int stat=0; stat<AGGNUMSTATS; stat++) {
+
+            if (ptrAggregate->varIds[stat] < 0 || !_aggregator.getStat(ptrAggregate, stat, &varStamp.value)) continue;
+
+            varStamp.varId = ptrAggregate->varIds[stat];
+            varStamp.tsMillis = 0;
+            varStamp.ts = _lastTs;
+
+            _pushSampleToBuffer(&varStamp, _nowMillis);
+        }
+
+        _aggregator.startWindow(ptrAggregate, _nowMillis);
+    }
+}
+
+
+// Next time a variable has to be checked: after minPeriod, or after maxPeriod if it is shorter.
+// Variables without minPeriod are checked on every update.
+
+void Esp32MAClientLog::_scheduleVar(int varId){
+
+    varRegister_t* ptrVar = &_varList.var[varId];
+
+    int minPeriod = _effectiveMinPeriod(ptrVar);
+
+    if (minPeriod <= 0) {
+        _scheduler.remove(varId);
+        _scheduler.watch(varId);
+        return;
+    }
+
+    unsigned long dueMillis = ptrVar->_lastUpdateTime + minPeriod;
+
+    if (ptrVar->maxPeriod != -1 && ptrVar->maxPeriod < minPeriod) {
+        dueMillis = ptrVar->_lastUpdateTime + ptrVar->maxPeriod + 1;
+    }
+
+    _scheduler.unwatch(varId);
+    _scheduler.schedule(varId, dueMillis);
+}
+
+
+// Millis until the next variable is due. ULONG_MAX if there is nothing registered.
+// At most RECORDMERGEMILLIS if other tasks or interrupts record samples, and at most until the end of an aggregation window.
+
+unsigned long Esp32MAClientLog::millisToNextUpdate(){
+
+    if (_coldStart) return(0);
+    if (_isSDDrainPending() || _isMemTierDrainPending() || _isMergePending()) return(0);
+    if (_isrCaptured && uxQueueMessagesWaiting(_xISRBuffer) > 0) return(0);
+
+    // Other tasks and interrupts can record samples at any time
+
+    unsigned long maxMillis = (_hasProducers() || _isrCaptured) ? RECORDMERGEMILLIS : ULONG_MAX;
+
+    if (!_overflow.empty()) maxMillis = min(maxMillis, (unsigned long)OVERFLOWRETRYMILLIS);
+
+    maxMillis = min(maxMillis, _aggregator.millisToNextWindow(millis()));
+    maxMillis = min(maxMillis, _millisToWatchCheck(millis()));
+
+    if (_scheduler.empty()) return(maxMillis);
+
+    long millisToDue = (long)(_scheduler.nextDueMillis() - millis());
+
+    return(millisToDue > 0 ? min((unsigned long)millisToDue, maxMillis) : 0);
+}
+
+
+// Watched variables are checked again after their period (a change is seen with the latency of
+// a sample), and at their maxPeriod, when the sample is sent even without change.
+// ULONG_MAX if there are no watched variables.
+
+unsigned long Esp32MAClientLog::_millisToWatchCheck(unsigned long nowMillis){
+
+    unsigned long minMillis = ULONG_MAX;
+
+    for (int i=0; i<_scheduler.numWatched(); i++) {
+
+        varRegister_t* ptrVar = &_varList.var[_scheduler.watchedAt(i)];
+
+        long millisToCheck = (long)(_lastWatchMillis + max(_effectiveMinPeriod(ptrVar), WATCHMINMILLIS) - nowMillis);
+
+        if (ptrVar->maxPeriod != -1) {
+            millisToCheck = min(millisToCheck, (long)(ptrVar->_lastUpdateTime + ptrVar->maxPeriod + 1 - nowMillis));
+        }
+
+        if (millisToCheck <= 0) return(0);
+
+        minMillis = min(minMillis, (unsigned long)millisToCheck);
+    }
+
+    return(minMillis);
+}
+
+
+// Update SD Buffer: Move data to normal buffer (or to the memory tier) if it is posible
+// Refilling starts when the target is at the low watermark and goes on, in the following
+// updates, until the high watermark. Each update moves at most the records and micros of the budget,
+// so the sampling latency is bounded while a big SD backlog is drained.
+// The memory tier is refilled by full batches (one file access each).
+
+void Esp32MAClientLog::_updateSDBuffer(){
+
+    if (!_isSDDrainPending()) return;
+
+    int lowWatermark, highWatermark;
+    _getSDDrainWatermarks(&lowWatermark, &highWatermark);
+
+    int targetSize = _sdDrainTargetSize();
+
+    if (targetSize <= lowWatermark) _sdDraining = true;
+
+    int maxRecords = (_memTier != NULL) ? max(_sdDrainMaxRecords, SDBATCHSIZE) : _sdDrainMaxRecords;
+
+    int maxMovements = min(highWatermark - targetSize, maxRecords);
+    maxMovements = min(maxMovements, _sdBacklogSize());
+
+    // Records already read by the SD task (or left in the refill queue when it was stopped)
+
+    varStamp_t varStamp;
+
+    while (maxMovements > 0 && _xSDRefill != NULL && xQueueReceive(_xSDRefill, &varStamp, 0) == pdPASS) {
+        _pushToSDDrainTarget(&varStamp);
+        if (_sdTaskRunning) _sdBacklog--;
+        maxMovements--;
+    }
+
+    maxMovements = _sdTaskRunning ? 0 : min(maxMovements, _sdBufferCom.bufferSize());
+
+    unsigned long iniMicros = micros();
+
+    // Records are read by batches, with a single file access per batch
+
+    varStamp_t varStamps[SDBATCHSIZE];
+
+    while (maxMovements > 0) {
+
+        int numPopped = _sdBufferCom.popMany(varStamps, min(maxMovements, SDBATCHSIZE));
+
+        if (numPopped == 0) {
+            if (!_sdBufferCom.isDrainHeld()) debug.setError("Problem moving data from SD buffer to memory buffer. Check SD.", _lastTs);
+            break;
+        }
+
+        for (int i=0; i<numPopped; i++) _pushToSDDrainTarget(&varStamps[i]);
+
+        maxMovements -= numPopped;
+
+        if ((micros() - iniMicros) >= _sdDrainMaxMicros) break;
+    }
+
+    if (_sdDrainTargetSize() >= highWatermark || _sdBacklogSize() == 0) {
+        _sdDraining = false;
+    }
+}
+
+
+// There is data in the SD buffer and the target is (or was) below the low watermark.
+// With the SD task, only the records it has already read can be moved.
+
+bool Esp32MAClientLog::_isSDDrainPending(){
+
+    if (!_enableSDLog) return(false);
+
+    if (_sdTaskRunning && uxQueueMessagesWaiting(_xSDRefill) == 0) return(false);
+    if (!_sdTaskRunning && (_sdBacklogSize() == 0 || _sdBufferCom.isDrainHeld())) return(false);
+
+    int lowWatermark, highWatermark;
+    _getSDDrainWatermarks(&lowWatermark, &highWatermark);
+
+    return(_sdDraining || _sdDrainTargetSize() <= lowWatermark);
+}
+
+int Esp32MAClientLog::_sdDrainTargetSize(){
+
+    if (_memTier != NULL) return(_memTier->size());
+
+    return(_ramBufferSize());
+}
+
+void Esp32MAClientLog::_getSDDrainWatermarks(int* ptrLowWatermark, int* ptrHighWatermark){
+
+    if (_memTier != NULL) {
+        *ptrLowWatermark = _memTierRefillWatermark;
+        *ptrHighWatermark = _memTierSpillWatermark;
+    } else {
+        *ptrLowWatermark = _sdDrainLowWatermark;
+        *ptrHighWatermark = _sdDrainHighWatermark;
+    }
+}
+
+bool Esp32MAClientLog::_pushToSDDrainTarget(varStamp_t* ptrVarStamp){
+
+    if (_memTier != NULL) return(_memTier->push(ptrVarStamp));
+
+    return(_pushToRAM(ptrVarStamp));
+}
+
+
+// Memory tier to RAM buffer. Records are copied in RAM, so the RAM buffer is topped up
+// to its high watermark in every update.
+
+void Esp32MAClientLog::_updateMemTier(){
+
+    if (!_isMemTierDrainPending()) return;
+
+    int maxMovements = _sdDrainHighWatermark - _ramBufferSize();
+
+    varStamp_t varStamps[SDBATCHSIZE];
+
+    while (maxMovements > 0) {
+
+        int numPopped = _memTier->popMany(varStamps, min(maxMovements, SDBATCHSIZE));
+
+        if (numPopped == 0) break;
+
+        if (_lockFreeBuffer) _ringBufferCom.pushMany(varStamps, numPopped);
+        else for (int i=0; i<numPopped; i++) xQueueSendToBack(_xBufferCom, &varStamps[i], 0);
+
+        maxMovements -= numPopped;
+    }
+}
+
+bool Esp32MAClientLog::_isMemTierDrainPending(){
+
+    if (_memTier == NULL || _memTier->size() == 0) return(false);
+
+    return(_ramBufferSize() < _sdDrainHighWatermark);
+}
+
+
+// Memory tier between the RAM buffer and the SD buffer
+
+bool Esp32MAClientLog::setPSRAMBuffer(int numRecords){
+
+    if (!setMemoryTier(NULL)) return(false);
+
+    if (numRecords <= 0) {
+        _psramBuffer.end();
+        return(true);
+    }
+
+    if (!_psramBuffer.begin(numRecords)) {
+        debug.setError("Allocating the PSRAM buffer. Check memory allocation.", _lastTs);
+        return(false);
+    }
+
+    debug.setMsg("PSRAM buffer ready. Records=" + String(numRecords), _lastTs);
+
+    return(setMemoryTier(&_psramBuffer));
+}
+
+bool Esp32MAClientLog::setMemoryTier(BufferTier* ptrTier){
+
+    if (_memTier != NULL && _memTier->size() > 0) {
+        debug.setError("The memory tier can not be replaced while it has records", _lastTs);
+        return(false);
+    }
+
+    _memTier = ptrTier;
+    _sdDraining = false;
+
+    if (_memTier != NULL) {
+        int capacity = _memTier->capacity();
+        setMemoryTierWatermarks(capacity * MEMTIERREFILLPERCENT / 100, capacity * MEMTIERSPILLPERCENT / 100);
+    }
+
+    return(true);
+}
+
+void Esp32MAClientLog::setMemoryTierWatermarks(int refillWatermark, int spillWatermark){
+
+    if (_memTier == NULL) return;
+
+    _memTierSpillWatermark = constrain(spillWatermark, 1, _memTier->capacity());
+    _memTierRefillWatermark = constrain(refillWatermark, 0, _memTierSpillWatermark - 1);
+}
+
+
+// Write to the SD the values staged in RAM (ie, before shutdown)
+
+bool Esp32MAClientLog::flush(){
+
+    _drainOverflow();
+
+    if (!_enableSDLog) return(true);
+
+    if (!_sdTaskRunning) return(_sdBufferCom.flush());
+
+    // The requests are processed in order: this flush is done when the task has processed as many
+
+    if (!_sendSDRequest(SD_REQ_FLUSH, NULL, pdMS_TO_TICKS(SDTASKSTOPMILLIS))) {
+        debug.setError("The SD task does not answer", _lastTs);
+        return(false);
+    }
+
+    uint32_t flushSeq = ++_sdFlushesRequested;
+
+    for (int i=0; i<SDTASKSTOPMILLIS && (int32_t)(_sdFlushesDone - flushSeq) < 0 && _sdTaskRunning; i++) vTaskDelay(pdMS_TO_TICKS(1));
+
+    if ((int32_t)(_sdFlushesDone - flushSeq) < 0) {
+        debug.setError("The SD task did not write the staged records in time", _lastTs);
+        return(false);
+    }
+
+    return(_sdFlushOK);
+}
+
+
+// Overflow policy. The SD quota drops the oldest segments or rejects the new records: the policies
+// that keep the oldest records let the memory tiers apply them to the rejected ones.
+
+void Esp32MAClientLog::setOverflowPolicy(overflowPolicy_t policy){
+
+    _overflow.setPolicy(policy);
+
+    if (!_enableSDLog) return;
+
+    sdEvictionPolicy_t sdPolicy = (policy == OVERFLOW_DROP_OLDEST) ? SD_EVICT_OLDEST : SD_REJECT_NEWEST;
+
+    if (_sdTaskRunning) debug.setError("The SD buffer can not be configured while the SD task is running", _lastTs);
+    else {
+        _sdBufferCom.setEvictionPolicy(sdPolicy);
+        debug.setMsg(String("SD quota policy: ") + (sdPolicy == SD_EVICT_OLDEST ? "SD_EVICT_OLDEST" : "SD_REJECT_NEWEST"), _lastTs);
+    }
+}
+
+// The records lost by the SD are counted as dropped: the oldest (segments evicted), or the
+// newest (rejected by the SD task; without the task the rejected records follow the policy).
+
+overflowStats_t Esp32MAClientLog::getOverflowStats(){
+
+    overflowStats_t stats = _overflow.getStats();
+
+    stats.coalesced += _tierStats.coalesced;
+    stats.droppedOldest += _tierStats.droppedOldest;
+    stats.evicted += _tierStats.evicted;
+
+    if (_lockFreeBuffer) stats.droppedOldest += _ringBufferCom.numDropped();
+
+    if (_enableSDLog) {
+        stats.sdEvicted = _sdBufferCom.getNumEvicted();
+        stats.droppedOldest += stats.sdEvicted;
+        stats.droppedNewest += _sdTaskLost;
+    }
+
+    return(stats);
+}
+
+
+// Limit the disk space used by the SD buffer
+
+void Esp32MAClientLog::setSDQuota(uint64_t maxBytes, sdEvictionPolicy_t policy){
+
+    if (_sdTaskRunning) debug.setError("The SD buffer can not be configured while the SD task is running", _lastTs);
+    else _sdBufferCom.setQuota(maxBytes, policy);
+}
+
+void Esp32MAClientLog::setSDCompression(bool enable){
+
+    if (_sdTaskRunning) debug.setError("The SD buffer can not be configured while the SD task is running", _lastTs);
+    else _sdBufferCom.setCompression(enable);
+}
+
+
+// SD task
+
+bool Esp32MAClientLog::startSDTask(BaseType_t core, UBaseType_t priority){
+
+    if (!_enableSDLog || _sdTaskRunning) return(false);
+
+    if (!_logInitialized) _initLog();
+
+    if (_xSDRequests == NULL) _xSDRequests = xQueueCreate(SDREQUESTQUEUESIZE, sizeof(sdRequest_t));
+    if (_xSDRefill == NULL) _xSDRefill = xQueueCreate(SDREFILLQUEUESIZE, sizeof(varStamp_t));
+
+    if (_xSDRequests == NULL || _xSDRefill == NULL) {
+        debug.setError("Creating the SD task queues. Check memory allocation.", _lastTs);
+        return(false);
+    }
+
+    _sdBacklog = _sdBacklogSize();
+    _sdTaskExpectedSize = _sdBufferCom.bufferSize();
+    _sdTaskRunning = true;
+
+    if (xTaskCreatePinnedToCore(_sdTask, "TaskSD", SDTASKSTACK, this, priority, &_sdTaskHandle, core) != pdPASS) {
+        _sdTaskRunning = false;
+        debug.setError("Creating the SD task. Check memory allocation.", _lastTs);
+        return(false);
+    }
+
+    debug.setMsg("SD task running on core " + String(core), _lastTs);
+
+    return(true);
+}
+
+// The pending requests are processed before the stop request. The records in the refill
+// queue are moved to the RAM buffer by the next updates.
+
+bool Esp32MAClientLog::stopSDTask(){
+
+    if (!_sdTaskRunning) return(false);
+
+    if (!_sendSDRequest(SD_REQ_STOP, NULL, pdMS_TO_TICKS(SDTASKSTOPMILLIS))) {
+        debug.setError("The SD task does not answer", _lastTs);
+        return(false);
+    }
+
+    for (int i=0; i<SDTASKSTOPMILLIS && _sdTaskRunning; i++) vTaskDelay(pdMS_TO_TICKS(1));
+
+    return(!_sdTaskRunning);
+}
+
+bool Esp32MAClientLog::_sendSDRequest(sdRequestType_t type, varStamp_t* ptrVarStamp, TickType_t ticksToWait){
+
+    sdRequest_t request;
+
+    request.type = type;
+    if (ptrVarStamp != NULL) request.varStamp = *ptrVarStamp;
+
+    return(xQueueSendToBack(_xSDRequests, &request, ticksToWait) == pdPASS);
+}
+
+void Esp32MAClientLog::_sdTask(void* ptrParams){
+
+    ((Esp32MAClientLog*)ptrParams)->_sdTaskLoop();
+
+    vTaskDelete(NULL);
+}
+
+// Requests are processed as they come. The wait is limited, to refill the queue
+// (as the log moves the records to RAM) and to write the staged records in time.
+
+void Esp32MAClientLog::_sdTaskLoop(){
+
+    sdRequest_t request;
+    bool stop=false;
+
+    while (!stop) {
+
+        int numRequests=0;
+        BaseType_t received = xQueueReceive(_xSDRequests, &request, pdMS_TO_TICKS(SDTASKPERIODMILLIS));
+
+        while (received == pdPASS && !stop) {
+
+            stop = _processSDRequest(&request);
+
+            if (++numRequests >= SDREQUESTQUEUESIZE) break;
+
+            received = xQueueReceive(_xSDRequests, &request, 0);
+        }
+
+        if (!stop) _refillFromSD();
+
+        _sdBufferCom.flushIfDue();
+
+        // Records removed by the SD buffer (quota eviction or corrupted) leave the backlog
+
+        int numRemoved = _sdTaskExpectedSize - _sdBufferCom.bufferSize();
+
+        if (numRemoved != 0) {
+            _sdBacklog -= numRemoved;
+            _sdTaskExpectedSize -= numRemoved;
+        }
+    }
+
+    _sdBufferCom.flush();
+
+    _sdTaskRunning = false;
+}
+
+bool Esp32MAClientLog::_processSDRequest(sdRequest_t* ptrRequest){
+
+    switch (ptrRequest->type) {
+
+        case SD_REQ_PUSH:
+            if (_sdBufferCom.push(&ptrRequest->varStamp)) _sdTaskExpectedSize++;
+            else {
+                _sdBacklog--;
+                _sdTaskLost++;
+            }
+            break;
+
+        case SD_REQ_NAME:
+            _sdBufferCom.setVarName(ptrRequest->varStamp.varId, String(_varList.var[ptrRequest->varStamp.varId].shortName));
+            break;
+
+        case SD_REQ_FLUSH:
+            _sdFlushOK = _sdBufferCom.flush();
+            _sdFlushesDone++;
+            break;
+
+        case SD_REQ_STOP:
+            return(true);
+    }
+
+    return(false);
+}
+
+// Keep the refill queue full, so the log finds the records ready when the RAM buffer is low
+
+void Esp32MAClientLog::_refillFromSD(){
+
+    int numFree = min((int)uxQueueSpacesAvailable(_xSDRefill), SDBATCHSIZE);
+
+    if (numFree == 0 || _sdBufferCom.empty()) return;
+
+    varStamp_t varStamps[SDBATCHSIZE];
+
+    int numPopped = _sdBufferCom.popMany(varStamps, numFree);
+
+    _sdTaskExpectedSize -= numPopped;
+
+    for (int i=0; i<numPopped; i++) xQueueSendToBack(_xSDRefill, &varStamps[i], 0);
+}
+
+
+// Access to the SD buffer: direct, or through the SD task
+
+bool Esp32MAClientLog::_pushVarToSD(varStamp_t* ptrVarStamp){
+
+    if (!_sdTaskRunning) return(_sdBufferCom.push(ptrVarStamp));
+
+    // Counted before the task can write it, so the backlog is never seen empty while it is on the way
+
+    _sdBacklog++;
+
+    if (_sendSDRequest(SD_REQ_PUSH, ptrVarStamp, 0)) return(true);
+
+    _sdBacklog--;
+    return(false);
+}
+
+void Esp32MAClientLog::_setSDVarName(int varId, String name){
+
+    if (!_sdTaskRunning) {
+        _sdBufferCom.setVarName(varId, name);
+        return;
+    }
+
+    varStamp_t varStamp;
+
+    memset(&varStamp, 0, sizeof(varStamp_t));
+    varStamp.varId = varId;
+
+    if (!_sendSDRequest(SD_REQ_NAME, &varStamp, pdMS_TO_TICKS(SDTASKSTOPMILLIS))) {
+        debug.setError("Problem updating the var names of the SD buffer. Check SD.", _lastTs);
+    }
+}
+
+int Esp32MAClientLog::_sdBacklogSize(){
+
+    if (_sdTaskRunning) return(_sdBacklog);
+
+    return(_sdBufferCom.bufferSize() + (_xSDRefill != NULL ? (int)uxQueueMessagesWaiting(_xSDRefill) : 0));
+}
+
+
+// Configure the SD drain stage
+
+void Esp32MAClientLog::setSDDrainBudget(int maxRecords, unsigned long maxMicros){
+
+    _sdDrainMaxRecords = max(maxRecords, 1);
+    _sdDrainMaxMicros = maxMicros;
+}
+
+void Esp32MAClientLog::setSDDrainWatermarks(int lowWatermark, int highWatermark){
+
+    _sdDrainHighWatermark = constrain(highWatermark, 1, MAXBUFFER);
+    _sdDrainLowWatermark = constrain(lowWatermark, 0, _sdDrainHighWatermark - 1);
+}
+
+
+// Calculate if the variable should be updated or not
+
+bool Esp32MAClientLog::_shouldVarBeUpdated(int varId){
+
+    bool updatedDueToThreshold;
+    bool updatedDueToMinPeriod;
+    bool updatedDueToMaxPeriod;
+    
+    unsigned long elapsedTimeVar = _nowMillis - _varList.var[varId]._lastUpdateTime;
+
+    updatedDueToThreshold = (abs(_readVarValue(varId) - _varList.var[varId]._lastValue) > _varList.var[varId].threshold);
+    updatedDueToMinPeriod = (elapsedTimeVar >= (unsigned long)_effectiveMinPeriod(&_varList.var[varId]));
+    updatedDueToMaxPeriod = (_varList.var[varId].maxPeriod != -1 && elapsedTimeVar > (unsigned long)_varList.var[varId].maxPeriod);
+
+    bool varToBeUpdated =  ( updatedDueToMinPeriod && updatedDueToThreshold) || updatedDueToMaxPeriod || _coldStart;
+
+        
+    return(varToBeUpdated);
+}
+
+
+// Push variable to the communication buffer
+
+bool Esp32MAClientLog::_pushVarToBuffer(int varId, unsigned long ts) {
+
+    varStamp_t varStamp;
+
+    _fillVarFromIdTs(&varStamp, varId, ts);
+
+    return(_pushSampleToBuffer(&varStamp, _nowMillis));
+}
+
+bool Esp32MAClientLog::_pushSampleToBuffer(varStamp_t* ptrVarStamp, unsigned long sampleTime) {
+
+    bool isValueBuffered=false;
+    bool isValueLost=false;
+    varStamp_t lostVarStamp;
+
+    // Send structure to buffer. If they are full (or records are waiting), the overflow policy.
+
+    _drainOverflow();
+
+    if (_overflow.empty()) isValueBuffered = _pushVarToBufferHardware(ptrVarStamp);
+
+    if (!isValueBuffered) {
+
+        overflowOutcome_t outcome = _applyOverflowPolicy(ptrVarStamp, &lostVarStamp);
+
+        isValueBuffered = (outcome != OVERFLOW_DROPPED_NEWEST);
+        isValueLost = (outcome == OVERFLOW_DROPPED_NEWEST || outcome == OVERFLOW_DROPPED_OLDEST || outcome == OVERFLOW_EVICTED);
+    }
+
+    // Either if can be queued or not, move to the next schedule
+
+    _varList.var[ptrVarStamp->varId]._lastUpdateTime = sampleTime;
+    _varList.var[ptrVarStamp->varId]._lastValue = ptrVarStamp->value;
+    
+    if (isValueLost) {
+
+        _varsNotBufferedAndLost++;
+        String errorMsg;
+        errorMsg = "Problem pushing a var to the buffer. Buffer=" + getBufferInfo() + String("\n");
+        errorMsg += "Value Lost: " + _varList.var[lostVarStamp.varId].name + " " + String(lostVarStamp.value) + " " + String(lostVarStamp.ts) + String("\n");
+        errorMsg += "Messages Lost: " + String(_varsNotBufferedAndLost) + String("");
+        debug.setError(errorMsg, _lastTs);
+
+    } 
+
+    return(isValueBuffered);
+}
+
+
+
+
+// Move the records of the overflow stage to the buffers, while they have space
+
+void Esp32MAClientLog::_drainOverflow(){
+
+    varStamp_t varStamp;
+
+    while (_overflow.peek(&varStamp) && _pushVarToBufferHardware(&varStamp)) _overflow.pop();
+}
+
+
+// Overflow policy, applied to the records of all the tiers from the oldest ones: RAM buffer
+// (the FreeRTOS queue if the sender is not reading it, or the ring dropping its head), memory
+// tier and stage. The SD records follow the SD quota policy. When a record is removed, the new
+// one goes behind the ones waiting. The ring drops are done by the consumer: the new record
+// waits in the stage meanwhile.
+
+overflowOutcome_t Esp32MAClientLog::_applyOverflowPolicy(varStamp_t* ptrVarStamp, varStamp_t* ptrLost) {
+
+    int priority = _varList.var[ptrVarStamp->varId].priority;
+
+    switch (_overflow.policy()) {
+
+        case OVERFLOW_DROP_OLDEST:
+            if (_dropOldestInTiers(ptrLost)) {
+                _pushBehindStage(ptrVarStamp);
+                return(OVERFLOW_DROPPED_OLDEST);
+            }
+            break;
+
+        case OVERFLOW_COALESCE:
+            if (_coalesceInTiers(ptrVarStamp)) return(OVERFLOW_COALESCED);
+            break;
+
+        case OVERFLOW_EVICT_PRIORITY:
+            if (_evictInTiers(priority, ptrLost)) {
+                _pushBehindStage(ptrVarStamp);
+                return(OVERFLOW_EVICTED);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return(_overflow.push(ptrVarStamp, priority, ptrLost));
+}
+
+// A record was removed: the oldest record waiting takes its place, and there is room in the stage
+
+void Esp32MAClientLog::_pushBehindStage(varStamp_t* ptrVarStamp) {
+
+    varStamp_t lostVarStamp;
+
+    _drainOverflow();
+
+    if (_overflow.empty() && _pushVarToBufferHardware(ptrVarStamp)) return;
+
+    _overflow.push(ptrVarStamp, _varList.var[ptrVarStamp->varId].priority, &lostVarStamp);
+}
+
+bool Esp32MAClientLog::_dropOldestInTiers(varStamp_t* ptrLost) {
+
+    if (_lockFreeBuffer) {
+        if (!_overflow.full() && _ringBufferCom.dropOldest(ptrLost)) return(true);
+    }
+    else if (_lockRAMQueue()) {
+
+        bool isDropped = (xQueueReceive(_xBufferCom, ptrLost, 0) == pdPASS);
+
+        _unlockRAMQueue();
+
+        if (isDropped) {
+            _tierStats.droppedOldest++;
+            return(true);
+        }
+    }
+
+    if (_memTier != NULL && _memTier->popMany(ptrLost, 1) == 1) {
+        _tierStats.droppedOldest++;
+        return(true);
+    }
+
+    return(false);
+}
+
+// The newest record of the variable: in the stage, in the memory tier or in the RAM queue
+
+bool Esp32MAClientLog::_coalesceInTiers(varStamp_t* ptrVarStamp) {
+
+    if (_overflow.coalesce(ptrVarStamp)) return(true);
+
+    bool isCoalesced = (_memTier != NULL && _memTier->coalesce(ptrVarStamp));
+
+    if (!isCoalesced && _lockRAMQueue()) {
+
+        int numRecords = _takeRAMQueue();
+
+        for (int i=numRecords-1; i>=0 && !isCoalesced; i--) {
+            if (_ramRecords[i].varId == ptrVarStamp->varId) {
+                _ramRecords[i] = *ptrVarStamp;
+                isCoalesced = true;
+            }
+        }
+
+        _putBackRAMQueue(numRecords);
+        _unlockRAMQueue();
+    }
+
+    if (isCoalesced) _tierStats.coalesced++;
+
+    return(isCoalesced);
+}
+
+// The oldest record of the lowest priority, if lower than the new one
+
+bool Esp32MAClientLog::_evictInTiers(int priority, varStamp_t* ptrLost) {
+
+    if (priority == 0) return(false);
+
+    uint8_t priorities[MAXNUMVARS];
+
+    for (int i=0; i<MAXNUMVARS; i++) priorities[i] = (i < _varList.num) ? _varList.var[i].priority : 0;
+
+    bool isRAMLocked = _lockRAMQueue();
+    int numRecords = isRAMLocked ? _takeRAMQueue() : 0;
+    bool isEvicted = false;
+
+    for (int lowest=0; lowest<priority && !isEvicted; lowest++) {
+
+        for (int i=0; i<numRecords && !isEvicted; i++) {
+            if (priorities[_ramRecords[i].varId] == lowest) {
+                *ptrLost = _ramRecords[i];
+                memmove(&_ramRecords[i], &_ramRecords[i + 1], (numRecords - i - 1) * sizeof(varStamp_t));
+                numRecords--;
+                isEvicted = true;
+            }
+        }
+
+        if (!isEvicted && _memTier != NULL) isEvicted = _memTier->evict(priorities, lowest, ptrLost);
+
+        if (isEvicted) _tierStats.evicted++;
+        else isEvicted = _overflow.evict(lowest, ptrLost);
+    }
+
+    if (isRAMLocked) {
+        _putBackRAMQueue(numRecords);
+        _unlockRAMQueue();
+    }
+
+    return(isEvicted);
+}
+
+// The sender does not read the queue while it is locked, and the log is its only producer:
+// once taken it is empty, and the records are put back in the same order.
+
+bool Esp32MAClientLog::_lockRAMQueue() {
+
+    if (_lockFreeBuffer || !_isBufferLockShared) return(false);
+
+    return(!_bufferLock.exchange(true, std::memory_order_acquire));
+}
+
+void Esp32MAClientLog::_unlockRAMQueue() {
+
+    _bufferLock.store(false, std::memory_order_release);
+}
+
+int Esp32MAClientLog::_takeRAMQueue() {
+
+    int numRecords = 0;
+
+    while (numRecords < MAXBUFFER && xQueueReceive(_xBufferCom, &_ramRecords[numRecords], 0) == pdPASS) numRecords++;
+
+    return(numRecords);
+}
+
+void Esp32MAClientLog::_putBackRAMQueue(int num) {
+
+    for (int i=0; i<num; i++) xQueueSendToBack(_xBufferCom, &_ramRecords[i], 0);
+}
+
+
+// Tiers in FIFO order: RAM buffer, memory tier, SD buffer. The record goes behind the newest
+// records: to the SD if it has records, to the memory tier if it has records (up to its spill
+// watermark), or to the RAM buffer. If the tier is full, to the next one. If the SD fails
+// (ie, SD extracted), to the headroom of the memory tier, or to the RAM buffer.
+
+bool Esp32MAClientLog::_pushVarToBufferHardware(varStamp_t* ptrVarStamp) {
+
+    bool logToSD;
+    bool logToMemTier;
+
+    logToSD = _enableSDLog && _sdBacklogSize() > 0;
+    logToMemTier = !logToSD && _memTier != NULL && _memTier->size() > 0;
+
+    // RAM buffer
+
+    if (!logToSD && !logToMemTier) {
+
+        if (_pushToRAM(ptrVarStamp)) {
+            if (_ramBufferSize()>=2) {
+                debug.setMsg("RAM buffer is getting bigger " + getBufferInfo(), _lastTs);
+            }
+            return(true);
+        }
+    }
+
+    // Memory tier, up to the spill watermark
+
+    if (!logToSD && _memTier != NULL && _memTier->size() < _memTierSpillWatermark) {
+        if (_memTier->push(ptrVarStamp)) return(true);
+    }
+
+    // If logging to SD, continue logging to SD until SD Buffer is empty
+    // The SD buffer stages the values in RAM and writes them by sectors.
+    // The SD buffer reclaims its consumed segments, so the file is not recreated.
+
+    if (_enableSDLog) {
+        if (_pushVarToSD(ptrVarStamp)) return(true);
+        debug.setError("Problem pushing a value to a SD Buffer. Check SD.", _lastTs);
+    }
+
+    // Headroom: memory tier up to its capacity, and RAM buffer
+
+    if (_memTier != NULL && _memTier->push(ptrVarStamp)) return(true);
+
+    return(_pushToRAM(ptrVarStamp));
+}
+
+
+// RAM buffer access: FreeRTOS queue, or lock-free ring
+
+bool Esp32MAClientLog::_pushToRAM(varStamp_t* ptrVarStamp) {
+
+    if (_lockFreeBuffer) return(_ringBufferCom.push(ptrVarStamp));
+
+    return(xQueueSendToBack(_xBufferCom, ptrVarStamp, 0) == pdPASS);
+}
+
+int Esp32MAClientLog::_ramBufferSize() {
+
+    if (_lockFreeBuffer) return(_ringBufferCom.size());
+
+    return((int)uxQueueMessagesWaiting(_xBufferCom));
+}
+
+int Esp32MAClientLog::_ramBufferSpaces() {
+
+    if (_lockFreeBuffer) return(_ringBufferCom.spaces());
+
+    return((int)uxQueueSpacesAvailable(_xBufferCom));
+}
+
+
+void Esp32MAClientLog::_fillVarFromIdTs(varStamp_t *ptrVar, int varId, unsigned long ts) {
+
+    ptrVar->varId = varId;
+    ptrVar->tsMillis = 0;
+    ptrVar->value = _readVarValue(varId);
+    ptrVar->ts = ts;
+
+}
+
+
+
+// Return buffer pointer.
+
+QueueHandle_t* Esp32MAClientLog::_getPtrBuffer(){
+    return(&_xBufferCom);
+}
+
+SPSCBuffer* Esp32MAClientLog::_getPtrRing(){
+    return(_lockFreeBuffer ? &_ringBufferCom : NULL);
+}
+
+std::atomic<bool>* Esp32MAClientLog::_getPtrBufferLock(){
+
+    if (_lockFreeBuffer) return(NULL);
+
+    _isBufferLockShared = true;
+
+    return(&_bufferLock);
+}
+
+
+// Return buffer log information
+
+String Esp32MAClientLog::getBufferInfo(){
+
+    int buffMsgWaiting = _ramBufferSize();
+    int buffSpaceAvailable = _ramBufferSpaces();
+    int msgTotal = buffMsgWaiting + buffSpaceAvailable;
+    
+    String status = "[" + String(buffMsgWaiting) + "/" + String(msgTotal) + "]";
+
+    if (_stretch > BACKPRESSURESCALE) {
+        status += " Stretch x" + String((float)_stretch / BACKPRESSURESCALE, 1);
+    }
+
+    if (_memTier != NULL) {
+        status += " " + _memTier->tierName() + "[" + String(_memTier->size()) + "/" + String(_memTier->capacity()) + "]";
+    }
+
+    if (_enableSDLog) {
+        status += " SD[" + String(_sdBacklogSize()) + ", " + String(_sdBufferCom.numSegments()) + "/" + String(_sdBufferCom.maxSegments()) + " segments]";
+    }
+
+    if (!_overflow.empty()) {
+        status += " OverflowStage[" + String(_overflow.size()) + "/" + String(OVERFLOWSTAGESIZE) + "]";
+    }
+
+    return(status);
+}
+
+
+
+int Esp32MAClientLog::getBacklogSize(){
+
+    int backlog = _ramBufferSize() + _overflow.size();
+
+    if (_memTier != NULL) backlog += _memTier->size();
+    if (_enableSDLog) backlog += _sdBacklogSize();
+
+    return(backlog);
+}
+
+
+
+// Return the list of registered variables pointer.
+
+varRegisterList_t* Esp32MAClientLog::_getVarListPtr(){
+    return(&_varList);
+}
+
 
 // Get the current time stamp pointer
 
@@ -2,11 +2,87 @@
 #define ESP32MALOG_HPP
 
 #include <Arduino.h>
+#include <atomic>
 #include "dataStructure.h" // Structure to share information between log and client
 
 #include "SDBuffer.hpp" // Fash memory buffer class (optional use)
+#include "BufferTier.hpp" // Interface of the memory tier (optional use)
+#include "PSRAMBuffer.hpp" // PSRAM ring buffer (optional use)
+#include "SPSCBuffer.hpp" // Lock-free RAM buffer (optional use)
+#include "VarScheduler.hpp" // Deadline ordered sampling of the variables
+#include "VarAggregator.hpp" // Statistics by windows of the aggregated variables
+#include "VarFilter.hpp" // Fixed point filters of the samples
+#include "OverflowStage.hpp" // Records that do not fit in the buffers
 #include "DebugMgr.hpp" // Debug class
 
+// Default budget and watermarks of the SD to RAM buffer refill
+
+#define SDDRAINMAXRECORDS 16 // Max records moved from SD to RAM in each update
+#define SDDRAINMAXMICROS 2000 // Max time spent moving records from SD to RAM in each update
+#define SDDRAINLOWWATERMARK (MAXBUFFER/4) // Start refilling when the RAM buffer is at or below it
+#define SDDRAINHIGHWATERMARK (MAXBUFFER*3/4) // Stop refilling when the RAM buffer reaches it
+
+// Default watermarks of the memory tier (percentage of its capacity)
+
+#define MEMTIERREFILLPERCENT 50 // Refill it from the SD when it is at or below it
+#define MEMTIERSPILLPERCENT 75 // Spill the new records to the SD when it reaches it. The rest is headroom if the SD fails.
+
+// Optional SD task
+
+#define SDTASKCORE 0 // Core of the SD task (the loop task runs on core 1)
+#define SDTASKPRIORITY 1
+#define SDTASKSTACK 8192
+#define SDTASKPERIODMILLIS 10 // Max time the SD task waits for requests before checking the refill and the flush
+#define SDTASKSTOPMILLIS 1000 // Max time to wait for the SD task to write the pending records and end (or flush)
+#define SDREQUESTQUEUESIZE MAXBUFFER // Requests (records to write) waiting for the SD task
+#define SDREFILLQUEUESIZE SDBATCHSIZE // Records read by the SD task, waiting to be moved to the RAM buffer
+
+// Backpressure: the minPeriod of the variables is stretched as the buffers fill
+
+#define BACKPRESSURESTARTPERCENT 50 // Occupancy of the buffers where the stretch starts
+#define BACKPRESSUREMAXSTRETCH 8 // Stretch of the minPeriod of priority 0 when the buffers are full
+#define BACKPRESSUREMINMILLIS 10 // minPeriod stretched for the variables checked on every update
+#define BACKPRESSURESCALE 256 // Fixed point of the stretch
+
+// Variables due, waiting for a change (threshold)
+
+#define WATCHMINMILLIS 10 // Min millis between the checks of a watched variable without minPeriod
+
+// Samples recorded by other tasks
+
+#define MAXPRODUCERS 4 // Tasks that can call record() at the same time (a slot is reused after releaseRecorder())
+#define PRODUCERRELEASED ((TaskHandle_t)-1) // Slot released by its task, freed by update() when its ring is merged
+#define RECORDMERGEMAXRECORDS MAXBUFFER // Max recorded samples merged in each update
+#define RECORDMERGEMILLIS 10 // Max time millisToNextUpdate() lets the recorded samples wait
+
+// Records waiting in the overflow stage
+
+#define OVERFLOWRETRYMILLIS 10 // Max time millisToNextUpdate() lets them wait for space in the buffers
+
+// Samples captured in interrupts
+
+#define ISRBUFFERSIZE 64 // Captures waiting for the next update
+
+typedef struct isrStamp_t {
+    uint8_t varId;
+    int value;
+    unsigned long micros; // micros() at the interrupt
+} isrStamp_t;
+
+// Type: Request to the SD task
+
+typedef enum sdRequestType_t {
+    SD_REQ_PUSH, // Write varStamp
+    SD_REQ_NAME, // Name of varStamp.varId in the file dictionary (taken from the registered variables)
+    SD_REQ_FLUSH,
+    SD_REQ_STOP
+} sdRequestType_t;
+
+typedef struct sdRequest_t {
+    uint8_t type;
+    varStamp_t varStamp;
+} sdRequest_t;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -19,25 +95,128 @@ class Esp32MAClientLog {
 
         // Constructor
 
-        Esp32MAClientLog (bool enableSDLog=false);
+        // With lockFreeBuffer the RAM buffer is a lock-free ring (SPSCBuffer) instead of a FreeRTOS queue.
+        // Only one task can call update(), and only one task can send the buffer.
+
+        Esp32MAClientLog (bool enableSDLog=false, bool lockFreeBuffer=false);
 
         // Register variables
 
-        int registerVar(String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1); //-1 means no maximum
-        bool modifyRegisteredVar(String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1);
+        int registerVar(String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1, varCompression_t compression=VAR_THRESHOLD); //-1 means no maximum
+        bool modifyRegisteredVar(String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1, varCompression_t compression=VAR_THRESHOLD);
+
+        // Filter of a registered variable (after registerVar): every update adds a raw sample, and the
+        // threshold and the compression are checked with the output, so the noise does not trigger sends.
+        // param: window (FILTER_MOVINGAVG, FILTER_MEDIAN, up to 16 samples) or shift (FILTER_IIR, 1..15).
+        // FILTER_NONE removes the filter. Up to 8 filtered variables.
+
+        bool setVarFilter(int varId, varFilterType_t type, int param);
+
+        // Backpressure: when the buffers (RAM and memory tier) fill past startPercent, the minPeriod of the
+        // variables is stretched, up to maxStretch times when full, and restored as they drain. So under
+        // overload the resolution degrades, instead of losing samples. The stretch of each variable is
+        // weighted by its priority. Disabled by default (the sampling periods are kept as configured).
+
+        void setBackpressure(bool enable, int startPercent=BACKPRESSURESTARTPERCENT, int maxStretch=BACKPRESSUREMAXSTRETCH);
+        bool setVarPriority(int varId, int priority); // 0 (stretched the most) .. VARPRIORITYMAX (never stretched)
+
+        // Aggregated variable: sampled on every update, and sent as statistics of windows of windowMillis,
+        // one registered variable per statistic (ie, "temperature_min", "temperature_max", "temperature_avg").
+        // Returns the varId of the first statistic. millisToNextUpdate() only wakes the loop at the end of the window:
+        // the loop has to limit its sleep to the sampling period wanted.
+
+        int registerAggregatedVar(String name, int *ptrValue, unsigned long windowMillis, uint8_t stats=AGGDEFAULTSTATS);
+
+        // Variable fed by other tasks with record(), instead of being polled
+
+        int registerRecordedVar(String name);
+
+        // Record a sample from any task (on any core), without locks: each task has its own
+        // lock-free buffer, and update() merges them in time stamp order. Not from an ISR.
+        // ts: time stamp of the sample (0: the one of the last update)
+
+        bool record(int varId, int value, unsigned long ts=0);
+
+        // To be called by a task that records samples before it is deleted (no record() after it).
+        // Its slot is freed by update() when its samples are merged.
+
+        void releaseRecorder();
+
+        // Record a sample from an interrupt (ie, an edge of an encoder or a presence sensor).
+        // The time of the interrupt (micros) is kept, and converted to the time stamp, with millis,
+        // when update() moves the sample to the buffers. Returns false if the capture buffer is full.
+
+        bool recordFromISR(int varId, int value);
 
         // Update Method
 
         void update(unsigned long ts);
 
-        // Information about RAM buffer
+        // Millis until update() has something to do. The loop task can sleep this time.
+        // 0 if a variable or the SD buffer has to be checked in the next call. A variable waiting
+        // for a change is checked again after its minPeriod (at least WATCHMINMILLIS), or at its maxPeriod.
+
+        unsigned long millisToNextUpdate();
+
+        // SD to RAM buffer refill: budget per update and watermarks of the RAM buffer
+
+        void setSDDrainBudget(int maxRecords, unsigned long maxMicros);
+        void setSDDrainWatermarks(int lowWatermark, int highWatermark);
+
+        // Max disk space of the SD buffer (0: 90% of the free space), and what to do when it is full
+        // (setOverflowPolicy() sets the policy that matches it)
+
+        void setSDQuota(uint64_t maxBytes, sdEvictionPolicy_t policy=SD_EVICT_OLDEST);
+
+        // Compress the SD buffer records (delta encoding). To be called before registering the variables.
+
+        void setSDCompression(bool enable);
+
+        // Optional memory tier between the RAM buffer and the SD buffer (ie, a PSRAM ring).
+        // When the RAM buffer is full the records go to the memory tier, and to the SD only past
+        // its spill watermark. The SD refills it in bulk from its refill watermark.
+
+        bool setPSRAMBuffer(int numRecords=PSRAMBUFFERRECORDS); // 0: no memory tier
+        bool setMemoryTier(BufferTier* ptrTier); // Any tier (NULL: no memory tier). It has to be empty to be replaced.
+        void setMemoryTierWatermarks(int refillWatermark, int spillWatermark); // In records
+
+        // Optional SD task: the SD buffer is only accessed by a task pinned to a core, that receives
+        // the records to write and sends back the records read through queues. update() never
+        // waits for the card. The SD configuration has to be done before starting it.
+
+        bool startSDTask(BaseType_t core=SDTASKCORE, UBaseType_t priority=SDTASKPRIORITY);
+        bool stopSDTask(); // Write the pending records and end the task
+
+        // Write to the SD card the values staged in RAM (ie, before shutdown).
+        // With the SD task running, it waits for the task to write them (up to SDTASKSTOPMILLIS).
+
+        bool flush();
+
+        // Overflow: what is lost when all the buffers are full. The policy applies to the records of the
+        // RAM buffer, the memory tier and a stage of 32 records where the new ones wait for space. The SD
+        // quota policy is set to match it (SD_EVICT_OLDEST for OVERFLOW_DROP_OLDEST, SD_REJECT_NEWEST for
+        // the others, so the rejected records go to the memory tiers). To be called before startSDTask().
+        // The counters include the records lost by the SD quota.
+
+        void setOverflowPolicy(overflowPolicy_t policy);
+        overflowStats_t getOverflowStats();
+
+        // Information about RAM buffer, and the occupancy of the memory tier and the SD buffer
 
         String getBufferInfo();
 
+        // Records waiting to be sent in all the buffers (RAM, memory tier, SD, overflow stage).
+        // Approximate if it is read from another task (ie, the sender).
+
+        int getBacklogSize();
+
         // Internal methods that can be accessed from other classes
 
-        QueueHandle_t* _getPtrBuffer();
+        QueueHandle_t* _getPtrBuffer(); // NULL queue if the RAM buffer is lock-free
+        SPSCBuffer* _getPtrRing(); // NULL if the RAM buffer is a queue
+        std::atomic<bool>* _getPtrBufferLock(); // NULL if the RAM buffer is lock-free. Without it the overflow policy does not touch the queue.
         unsigned long* _getTsPtr();
+        varRegisterList_t* _getVarListPtr(); // To resolve the varId of the buffered samples
 
         // Error management
 
@@ -45,6 +224,10 @@ class Esp32MAClientLog {
 
     private:
 
+        // Host benchmark (host/bench) measures the private hot paths
+
+        friend class Esp32MAClientLogBench;
+
         // Constructor
 
         bool _enableSDLog;
@@ -53,6 +236,7 @@ class Esp32MAClientLog {
         bool _coldStart=true;
 
         bool _logInitialized=false; // If log class has been initialized
+        void _initLog();
 
         // Structure to register variables
 
@@ -60,31 +244,176 @@ class Esp32MAClientLog {
 
         // Registering vars private methods
 
-        bool _registerVarAtPosition(int pos, String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1);
+        bool _registerVarAtPosition(int pos, String name, int *ptrValue, int minPeriod, int threshold=0, int maxPeriod=-1, varCompression_t compression=VAR_THRESHOLD);
         int _findVarIndex(int *ptrVar);
         bool _shouldVarBeUpdated(int varId);
 
+        // Scheduling of the variables (only due variables are checked)
+
+        VarScheduler _scheduler;
+        void _scheduleVar(int varId);
+        void _updateVar(int varId);
+        unsigned long _lastWatchMillis=0; // Last check of the watched variables
+        unsigned long _millisToWatchCheck(unsigned long nowMillis);
+
+        // Dead band and swinging door: every minPeriod a sample is checked, and the samples
+        // needed to rebuild the signal are sent (maybe the previous one)
+
+        void _updateCompressedVar(int varId);
+        bool _isSwingingDoorOpen(varRegister_t* ptrVar, int value); // The held sample has to be sent
+        void _narrowSwingingDoor(varRegister_t* ptrVar, int value);
+        void _scheduleCompressedVar(int varId);
+
         unsigned long _lastMinPeriodsMillis=0;
 
+        // Aggregated variables
+
+        VarAggregator _aggregator;
+        void _updateAggregates();
+
+        // Backpressure
+
+        bool _backpressure;
+        int _backpressureStartPercent=BACKPRESSURESTARTPERCENT;
+        int _backpressureMaxStretch=BACKPRESSUREMAXSTRETCH;
+        int _stretch=BACKPRESSURESCALE; // Current stretch of the minPeriods (fixed point)
+
+        void _updateBackpressure();
+        int _effectiveMinPeriod(varRegister_t* ptrVar);
+
+        // Overflow stage, and overflow policy applied to the tiers
 
+        OverflowStage _overflow;
+        void _drainOverflow();
 
-        unsigned long _lastTs;
+        overflowStats_t _tierStats; // Records of the RAM buffer and the memory tier (the ring drops are counted by the ring)
+        varStamp_t _ramRecords[MAXBUFFER]; // The RAM queue, taken while a policy is applied to its records
+
+        overflowOutcome_t _applyOverflowPolicy(varStamp_t* ptrVarStamp, varStamp_t* ptrLost);
+        void _pushBehindStage(varStamp_t* ptrVarStamp);
+        bool _dropOldestInTiers(varStamp_t* ptrLost);
+        bool _coalesceInTiers(varStamp_t* ptrVarStamp);
+        bool _evictInTiers(int priority, varStamp_t* ptrLost);
+        int _takeRAMQueue(); // Returns the records taken
+        void _putBackRAMQueue(int num);
+
+        // Try-lock of the RAM queue, shared with the sender: taken by the log to apply the policy to
+        // its records and by the sender to read them. None of them waits (the log uses the stage meanwhile).
+
+        std::atomic<bool> _bufferLock{false};
+        bool _isBufferLockShared=false;
+        bool _lockRAMQueue();
+        void _unlockRAMQueue();
+
+        // Filtered variables
+
+        VarFilter _filters;
+        void _updateFilters();
+        int _readVarValue(int varId); // Output of the filter, or the raw value
+
+
+
+        unsigned long _lastTs=0;
+        unsigned long _tsChangeMillis=0; // millis() of the first update with _lastTs (start of the second)
 
         // RAM Buffer management (thread safe)
 
-        QueueHandle_t _xBufferCom; // Intertask communication buffer
+        QueueHandle_t _xBufferCom = NULL; // Intertask communication buffer
+
+        bool _lockFreeBuffer;
+        SPSCBuffer _ringBufferCom; // Intertask communication buffer (lock-free)
+
+        bool _pushToRAM(varStamp_t* ptrVarStamp);
+        int _ramBufferSize();
+        int _ramBufferSpaces();
 
         bool _pushVarToBuffer(int varId, unsigned long ts);
+        bool _pushSampleToBuffer(varStamp_t* ptrVarStamp, unsigned long sampleTime); // sampleTime: millis
         bool _pushVarToBufferHardware(varStamp_t* ptrVarStamp);
         void _fillVarFromIdTs(varStamp_t *ptrVar, int varId, unsigned long ts);
 
         int _varsNotBufferedAndLost = 0;
         unsigned long _lastBufferErrorMillis=0;
 
+        // Memory tier management
+
+        PSRAMBuffer _psramBuffer;
+        BufferTier* _memTier = NULL;
+        int _memTierRefillWatermark = 0;
+        int _memTierSpillWatermark = 0;
+
+        void _updateMemTier(); // Move records from the memory tier to the RAM buffer
+        bool _isMemTierDrainPending();
+
+        // Samples recorded by other tasks. Each producer task claims a slot and its ring the first time.
+
+        std::atomic<TaskHandle_t> _producerTask[MAXPRODUCERS];
+        std::atomic<SPSCBuffer*> _producerRing[MAXPRODUCERS];
+        std::atomic<int> _recordsLost{0}; // Ring full, no free slot, or var not registered (also from interrupts)
+
+        // Read by record() from other tasks: the number of variables is published after the variable is
+        // written (release/acquire), and the time stamp of the last update() only needs to be atomic.
+
+        std::atomic<int> _numRecordVars{0};
+        std::atomic<unsigned long> _recordTs{0};
+        int _recordsLostReported = 0;
+
+        SPSCBuffer* _getProducerRing(); // Ring of the current task
+        bool _hasProducers();
+        void _freeReleasedProducers();
+        bool _isMergePending();
+        void _mergeRecords(); // Into the buffers, by time stamp
+        void _pushRecordedVar(varStamp_t* ptrVarStamp);
+
+        // Samples captured in interrupts
+
+        QueueHandle_t _xISRBuffer = NULL;
+        std::atomic<bool> _isrCaptured{false}; // An interrupt has recorded a sample
+
+        void _foldISRCaptures(); // Into the buffers, with the time stamp of the interrupt
+
         // SD Buffer management
 
         SDBuffer _sdBufferCom;
         void _updateSDBuffer();
+        bool _isSDDrainPending();
+
+        // The SD buffer refills the memory tier if there is one, or the RAM buffer
+
+        int _sdDrainTargetSize();
+        void _getSDDrainWatermarks(int* ptrLowWatermark, int* ptrHighWatermark);
+        bool _pushToSDDrainTarget(varStamp_t* ptrVarStamp);
+
+        int _sdDrainMaxRecords = SDDRAINMAXRECORDS;
+        unsigned long _sdDrainMaxMicros = SDDRAINMAXMICROS;
+        int _sdDrainLowWatermark = SDDRAINLOWWATERMARK;
+        int _sdDrainHighWatermark = SDDRAINHIGHWATERMARK;
+        bool _sdDraining = false; // Refilling, until the high watermark is reached
+
+        bool _pushVarToSD(varStamp_t* ptrVarStamp);
+        void _setSDVarName(int varId, String name);
+        int _sdBacklogSize(); // Records in the SD buffer (and in the SD task queues)
+
+        // SD task. The log is the only producer of the RAM buffer: the records read by the task
+        // are moved to the RAM buffer by update().
+
+        TaskHandle_t _sdTaskHandle = NULL;
+        QueueHandle_t _xSDRequests = NULL; // Log -> SD task
+        QueueHandle_t _xSDRefill = NULL; // SD task -> log
+        std::atomic<bool> _sdTaskRunning{false};
+        std::atomic<int> _sdBacklog{0}; // Records in the requests queue, the SD buffer and the refill queue
+        std::atomic<int> _sdTaskLost{0}; // Records the SD task could not write
+        int _sdTaskLostReported = 0;
+        int _sdTaskExpectedSize = 0; // SD buffer size if no record is removed by the quota or corrupted
+        uint32_t _sdFlushesRequested = 0;
+        std::atomic<uint32_t> _sdFlushesDone{0}; // Flush requests processed by the SD task (in order)
+        std::atomic<bool> _sdFlushOK{true}; // Result of the last one
+
+        static void _sdTask(void* ptrParams);
+        void _sdTaskLoop();
+        bool _processSDRequest(sdRequest_t* ptrRequest); // True if the task has to end
+        void _refillFromSD();
+        bool _sendSDRequest(sdRequestType_t type, varStamp_t* ptrVarStamp, TickType_t ticksToWait);
  
 };
 
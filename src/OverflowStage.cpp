@@ -0,0 +1,124 @@
+#include <Arduino.h>
+#include "OverflowStage.hpp"
+
+OverflowStage::OverflowStage() {
+
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void OverflowStage::setPolicy(overflowPolicy_t policy) {
+
+    _policy = policy;
+}
+
+overflowOutcome_t OverflowStage::push(varStamp_t* ptrVarStamp, int priority, varStamp_t* ptrLost) {
+
+    if (_policy == OVERFLOW_COALESCE && coalesce(ptrVarStamp)) return(OVERFLOW_COALESCED);
+
+    if (_num < OVERFLOWSTAGESIZE) {
+        _append(ptrVarStamp, priority);
+        _stats.staged++;
+        return(OVERFLOW_STAGED);
+    }
+
+    // Full
+
+    if (_policy == OVERFLOW_DROP_OLDEST) {
+
+        *ptrLost = _records[_pos(0)];
+        _removeAt(0);
+        _append(ptrVarStamp, priority);
+        _stats.droppedOldest++;
+        return(OVERFLOW_DROPPED_OLDEST);
+    }
+
+    if (_policy == OVERFLOW_EVICT_PRIORITY) {
+
+        for (int lowest=0; lowest<priority; lowest++) {
+
+            if (evict(lowest, ptrLost)) {
+                _append(ptrVarStamp, priority);
+                return(OVERFLOW_EVICTED);
+            }
+        }
+    }
+
+    *ptrLost = *ptrVarStamp;
+    _stats.droppedNewest++;
+
+    return(OVERFLOW_DROPPED_NEWEST);
+}
+
+// Last value wins: the record keeps its position, with the new value and time stamp
+
+bool OverflowStage::coalesce(varStamp_t* ptrVarStamp) {
+
+    for (int i=_num-1; i>=0; i--) {
+
+        varStamp_t* ptrRecord = &_records[_pos(i)];
+
+        if (ptrRecord->varId == ptrVarStamp->varId) {
+            *ptrRecord = *ptrVarStamp;
+            _stats.coalesced++;
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+bool OverflowStage::evict(int priority, varStamp_t* ptrLost) {
+
+    for (int i=0; i<_num; i++) {
+
+        if (_priorities[_pos(i)] == priority) {
+            *ptrLost = _records[_pos(i)];
+            _removeAt(i);
+            _stats.evicted++;
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+bool OverflowStage::peek(varStamp_t* ptrVarStamp) {
+
+    if (_num == 0) return(false);
+
+    *ptrVarStamp = _records[_first];
+
+    return(true);
+}
+
+void OverflowStage::pop() {
+
+    if (_num > 0) _removeAt(0);
+}
+
+void OverflowStage::_append(varStamp_t* ptrVarStamp, int priority) {
+
+    int pos = _pos(_num);
+
+    _records[pos] = *ptrVarStamp;
+    _priorities[pos] = priority;
+    _num++;
+}
+
+// The newer records move one position back (up to OVERFLOWSTAGESIZE records)
+
+void OverflowStage::_removeAt(int index) {
+
+    if (index == 0) {
+        _first = _pos(1);
+        _num--;
+        return;
+    }
+
+    for (int i=index; i<_num-1; i++) {
+        _records[_pos(i)] = _records[_pos(i + 1)];
+        _priorities[_pos(i)] = _priorities[_pos(i + 1)];
+    }
+
+    _num--;
+}
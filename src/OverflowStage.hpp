@@ -0,0 +1,88 @@
+#ifndef OVERFLOWSTAGE_HPP
+#define OVERFLOWSTAGE_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+#define OVERFLOWSTAGESIZE MAXNUMVARS // Records waiting behind the buffers when all of them are full
+
+// What to do with a record when all the buffers are full. Applied by the log to the records
+// of the RAM buffer, the memory tier and the stage, and mapped to the SD quota policy.
+
+typedef enum overflowPolicy_t {
+    OVERFLOW_DROP_NEWEST, // The new record is lost (once the stage is full)
+    OVERFLOW_DROP_OLDEST, // The oldest record buffered is lost
+    OVERFLOW_EVICT_PRIORITY, // The oldest record of the lowest priority is lost, if lower than the new one
+    OVERFLOW_COALESCE // The newest record of the same variable takes the new value (last value wins)
+} overflowPolicy_t;
+
+// Result of pushing a record when the buffers are full
+
+typedef enum overflowOutcome_t {
+    OVERFLOW_STAGED,
+    OVERFLOW_COALESCED,
+    OVERFLOW_DROPPED_OLDEST,
+    OVERFLOW_EVICTED,
+    OVERFLOW_DROPPED_NEWEST
+} overflowOutcome_t;
+
+// Type: Counters of each outcome
+
+typedef struct overflowStats_t {
+    unsigned long staged; // Records that waited in the stage
+    unsigned long coalesced; // Values replaced by a newer one of the same variable
+    unsigned long droppedOldest; // Including sdEvicted
+    unsigned long evicted; // Records of lower priority lost
+    unsigned long droppedNewest; // Including the records rejected by the SD quota in the SD task
+    unsigned long sdEvicted; // Records lost with the oldest SD segments (SD_EVICT_OLDEST)
+} overflowStats_t;
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to keep the records that do not fit in any buffer (RAM, memory tier, SD), applying
+// the overflow policy to its records when it is full. Owned by the task that calls update():
+// the log moves the records to the buffers, in FIFO order, as soon as there is space.
+
+class OverflowStage {
+
+    public:
+
+        OverflowStage();
+
+        void setPolicy(overflowPolicy_t policy);
+        overflowPolicy_t policy() {return (_policy);};
+
+        // ptrLost: record lost (dropped or evicted), if any
+        overflowOutcome_t push(varStamp_t* ptrVarStamp, int priority, varStamp_t* ptrLost);
+
+        bool coalesce(varStamp_t* ptrVarStamp); // A record of the variable takes the new value
+        bool evict(int priority, varStamp_t* ptrLost); // Oldest record of the priority
+
+        bool peek(varStamp_t* ptrVarStamp);
+        void pop();
+
+        bool empty() {return (_num == 0);};
+        bool full() {return (_num >= OVERFLOWSTAGESIZE);};
+        int size() {return (_num);};
+
+        overflowStats_t getStats() {return (_stats);};
+
+    private:
+
+        varStamp_t _records[OVERFLOWSTAGESIZE];
+        uint8_t _priorities[OVERFLOWSTAGESIZE];
+        int _first=0;
+        int _num=0;
+
+        overflowPolicy_t _policy=OVERFLOW_DROP_OLDEST;
+        overflowStats_t _stats;
+
+        int _pos(int index) {return ((_first + index) % OVERFLOWSTAGESIZE);};
+        void _append(varStamp_t* ptrVarStamp, int priority);
+        void _removeAt(int index); // index from the oldest record
+
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include <Arduino.h>
+#include "PSRAMBuffer.hpp"
+
+PSRAMBuffer::PSRAMBuffer() {
+    _debug.setLibName("PSRAMBuffer");
+}
+
+PSRAMBuffer::~PSRAMBuffer() {
+    end();
+}
+
+bool PSRAMBuffer::begin(int numRecords) {
+
+    end();
+
+    if (numRecords <= 0) return(false);
+
+    size_t bytes = (size_t)numRecords * sizeof(varStamp_t);
+
+    _records = (varStamp_t*)(psramFound() ? ps_malloc(bytes) : malloc(bytes));
+
+    if (_records == NULL) {
+        _debug.setError("Allocating the PSRAM buffer. Check memory allocation (" + String((int)bytes) + " bytes).");
+        return(false);
+    }
+
+    _capacity = numRecords;
+
+    return(true);
+}
+
+void PSRAMBuffer::end() {
+
+    if (_records != NULL) free(_records);
+
+    _records = NULL;
+    _capacity = 0;
+    _first = 0;
+    _numRecords = 0;
+}
+
+bool PSRAMBuffer::push(varStamp_t* ptrVarStamp) {
+
+    if (_numRecords >= _capacity) return(false);
+
+    int last = _first + _numRecords;
+    if (last >= _capacity) last -= _capacity;
+
+    _records[last] = *ptrVarStamp;
+    _numRecords++;
+
+    return(true);
+}
+
+// Copied in two blocks at most (before and after the end of the ring)
+
+int PSRAMBuffer::popMany(varStamp_t* ptrVarStamps, int maxNum) {
+
+    int numPopped = min(maxNum, _numRecords);
+    int numFirstBlock = min(numPopped, _capacity - _first);
+
+    if (numPopped <= 0) return(0);
+
+    memcpy(ptrVarStamps, &_records[_first], numFirstBlock * sizeof(varStamp_t));
+    memcpy(&ptrVarStamps[numFirstBlock], _records, (numPopped - numFirstBlock) * sizeof(varStamp_t));
+
+    _first += numPopped;
+    if (_first >= _capacity) _first -= _capacity;
+    _numRecords -= numPopped;
+
+    return(numPopped);
+}
+
+
+// Overflow policies: a scan of the ring (only when all the buffers are full)
+
+bool PSRAMBuffer::coalesce(varStamp_t* ptrVarStamp) {
+
+    for (int i=_numRecords-1; i>=0; i--) {
+
+        varStamp_t* ptrRecord = &_records[_pos(i)];
+
+        if (ptrRecord->varId == ptrVarStamp->varId) {
+            *ptrRecord = *ptrVarStamp;
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+bool PSRAMBuffer::evict(const uint8_t* priorities, int priority, varStamp_t* ptrLost) {
+
+    for (int i=0; i<_numRecords; i++) {
+
+        if (priorities[_records[_pos(i)].varId] == priority) {
+            *ptrLost = _records[_pos(i)];
+            _removeAt(i);
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+// The records on the shorter side of the index move one position
+
+void PSRAMBuffer::_removeAt(int index) {
+
+    if (index < _numRecords / 2) {
+        for (int i=index; i>0; i--) _records[_pos(i)] = _records[_pos(i - 1)];
+        _first = _pos(1);
+    }
+    else {
+        for (int i=index; i<_numRecords-1; i++) _records[_pos(i)] = _records[_pos(i + 1)];
+    }
+
+    _numRecords--;
+}
@@ -0,0 +1,57 @@
+#ifndef PSRAMBUFFER_HPP
+#define PSRAMBUFFER_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+#include "BufferTier.hpp"
+#include "DebugMgr.hpp"
+
+#define PSRAMBUFFERRECORDS 16384 // Default records of the PSRAM ring (about 80 s of samples at 200 samples/s)
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to buffer records in a ring allocated in the PSRAM (or in the heap if there is no PSRAM).
+// Records are copied, without formatting. Push and pop never wait: it absorbs outages
+// shorter than its capacity without touching the SD card.
+
+class PSRAMBuffer : public BufferTier {
+
+    public:
+
+        PSRAMBuffer();
+        ~PSRAMBuffer();
+
+        bool begin(int numRecords=PSRAMBUFFERRECORDS); // Allocate the ring (the records in it are lost)
+        void end(); // Free the ring
+
+        String tierName() {return("PSRAM");};
+
+        bool push(varStamp_t* ptrVarStamp);
+        int popMany(varStamp_t* ptrVarStamps, int maxNum);
+
+        bool coalesce(varStamp_t* ptrVarStamp);
+        bool evict(const uint8_t* priorities, int priority, varStamp_t* ptrLost);
+
+        int size() {return(_numRecords);};
+        int capacity() {return(_capacity);};
+
+    private:
+
+        varStamp_t* _records=NULL;
+        int _capacity=0;
+
+        int _first=0; // Oldest record
+        int _numRecords=0;
+
+        int _pos(int index) {return ((_first + index) % _capacity);}; // index from the oldest record
+        void _removeAt(int index);
+
+        // Error mgm
+
+        DebugMgr _debug;
+
+};
+
+#endif
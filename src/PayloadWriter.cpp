@@ -0,0 +1,127 @@
+#include <Arduino.h>
+#include "PayloadWriter.hpp"
+
+static const char _endText[] = "}}";
+static const char _valueText[] = "\": ";
+static const char _timestampText[] = "_timestamp\": ";
+
+#define ENDLEN ((int)sizeof(_endText) - 1)
+
+PayloadWriter::PayloadWriter() {
+
+    setAssetName("");
+}
+
+void PayloadWriter::begin(char* buffer, int size) {
+
+    _buffer = buffer;
+    _size = size;
+
+    reset();
+}
+
+void PayloadWriter::setAssetName(const char* assetName) {
+
+    _prefixLen = snprintf(_prefix, sizeof(_prefix), "{\"metrics\": {\"assetName\": \"%.*s\"", PAYLOADMAXASSETNAME, assetName);
+
+    reset();
+}
+
+void PayloadWriter::reset() {
+
+    _len = 0;
+    _numSamples = 0;
+
+    if (_buffer != NULL && _prefixLen + ENDLEN < _size) _write(_prefix, _prefixLen);
+}
+
+// ,"<name>": <value>,"<name>_timestamp": <ts><millis>
+
+int PayloadWriter::sampleSize(const char* name, int value, unsigned long ts) {
+
+    int nameLen = strlen(name);
+    int valueLen = (value < 0) ? _numDigits(0UL - (unsigned long)value) + 1 : _numDigits(value);
+
+    return(2 + nameLen + (sizeof(_valueText) - 1) + valueLen + 2 + nameLen + (sizeof(_timestampText) - 1) + _numDigits(ts) + 3);
+}
+
+bool PayloadWriter::addSample(const char* name, int value, unsigned long ts, int tsMillis) {
+
+    if (_buffer == NULL || _len == 0) return(false);
+
+    // Size check first: the message is not modified if it does not fit
+
+    if (_len + sampleSize(name, value, ts) + ENDLEN >= _size) return(false);
+
+    int nameLen = strlen(name);
+
+    _write(",\"", 2);
+    _write(name, nameLen);
+    _write(_valueText, sizeof(_valueText) - 1);
+
+    if (value < 0) {
+        _write("-", 1);
+        _writeUInt(0UL - (unsigned long)value);
+    } else {
+        _writeUInt(value);
+    }
+
+    _write(",\"", 2);
+    _write(name, nameLen);
+    _write(_timestampText, sizeof(_timestampText) - 1);
+    _writeUInt(ts);
+    _writeUInt(constrain(tsMillis, 0, 999), 3);
+
+    _numSamples++;
+
+    return(true);
+}
+
+// The end is written after the samples, but not counted: the next sample overwrites it
+
+const char* PayloadWriter::finish() {
+
+    if (_buffer == NULL) return("");
+
+    memcpy(&_buffer[_len], _endText, ENDLEN + 1);
+
+    return(_buffer);
+}
+
+int PayloadWriter::length() {
+
+    return(_len + ENDLEN);
+}
+
+void PayloadWriter::_write(const char* text, int len) {
+
+    memcpy(&_buffer[_len], text, len);
+    _len += len;
+}
+
+// Digits written backwards in a small buffer, then copied
+
+void PayloadWriter::_writeUInt(unsigned long value, int minDigits) {
+
+    char digits[20];
+    int num = 0;
+
+    do {
+        digits[num++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0 || num < minDigits);
+
+    while (num > 0) _buffer[_len++] = digits[--num];
+}
+
+int PayloadWriter::_numDigits(unsigned long value) {
+
+    int num = 1;
+
+    while (value >= 10) {
+        value /= 10;
+        num++;
+    }
+
+    return(num);
+}
@@ -0,0 +1,50 @@
+#ifndef PAYLOADWRITER_HPP
+#define PAYLOADWRITER_HPP
+
+#include <Arduino.h>
+
+#define PAYLOADMAXASSETNAME 64 // Max chars of the asset name in the pre-rendered prefix
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to write Machine Advisor metrics messages in a char buffer of the caller, without heap:
+//   {"metrics": {"assetName": "<asset>","<name>": <value>,"<name>_timestamp": <ts><millis>, ...}}
+// The prefix with the asset name is rendered once. Each sample is only written if the message,
+// with its end, fits in the buffer; if not, the message is not modified.
+
+class PayloadWriter {
+
+    public:
+
+        PayloadWriter();
+
+        void begin(char* buffer, int size); // Buffer of the messages (size includes the '\0')
+        void setAssetName(const char* assetName);
+
+        void reset(); // New message, with only the prefix
+        bool addSample(const char* name, int value, unsigned long ts, int tsMillis=0); // False if it does not fit
+        int sampleSize(const char* name, int value, unsigned long ts); // Bytes that addSample would write
+
+        const char* finish(); // Message ended and '\0' terminated. More samples can be added after it.
+        int length(); // Bytes of the finished message
+        int numSamples() {return (_numSamples);};
+
+    private:
+
+        char* _buffer=NULL;
+        int _size=0;
+        int _len=0; // Without the end
+        int _numSamples=0;
+
+        char _prefix[PAYLOADMAXASSETNAME + 32];
+        int _prefixLen=0;
+
+        void _write(const char* text, int len);
+        void _writeUInt(unsigned long value, int minDigits=1);
+        static int _numDigits(unsigned long value);
+
+};
+
+#endif
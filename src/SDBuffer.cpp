@@ -2,7 +2,11 @@
 #include <Arduino.h>
 #include "SDBuffer.hpp"
 
-SDBuffer::SDBuffer() {}
+SDBuffer::SDBuffer() {
+    memset(&_header, 0, sizeof(sdFileHeader_t));
+    memset(&_checkpoint, 0, sizeof(sdCheckpoint_t));
+    memset(_varNames, 0, sizeof(_varNames));
+}
 
 bool SDBuffer::init(){
 
@@ -31,112 +35,1052 @@ bool SDBuffer::init(){
 }
 
 
+// Open the buffer. If there are valid segments (ie, before a reboot), their records are resumed.
+// If not, a new buffer is created.
+
 bool SDBuffer::setFileName(String fileName) {
 
     _fileName = fileName;
+    _checkpointFileName = fileName + ".chk";
+
+    bool allOK = (fileExist() && _resumeFile()) || createFile(_fileName);
+
+    _updateMaxSegments();
 
-    return(createFile(_fileName));
+    return(allOK);
       
 }
 
 
 bool SDBuffer::fileExist() {
 
-    return(SD.exists(_fileName));
+    return(SD.exists(_checkpointFileName));
 
 }
 
+// Start a new empty buffer: delete the current segments and create the first one
+
 bool SDBuffer::createFile(String fileName) {
 
     bool allOK=false;
 
-    String dataMessage = "VarName,Value,TimeStamp\n";
-    _debug.setMsg("Save data: " + dataMessage);
+    if (_isFileCreated) {
+        for (uint32_t segment=_head.segment; segment<=_tailSegment; segment++) SD.remove(_segmentName(segment));
+        _tailSegment++;
+    }
+
+    _fileName = fileName;
+    _checkpointFileName = fileName + ".chk";
+
+    _header.magic = SDMAGIC;
+    _header.version = SDVERSION;
+    _header.recordSize = SDRECORDSIZE;
+    _header.numVars = MAXNUMVARS;
+    _header.nameSize = SDNAMESIZE;
+    _header.flags = _compression ? SDFLAGCOMPRESSED : 0;
+    _header.reserved = 0;
+    _header.numRecords = 0;
 
-    allOK = _writeAppendFile(SD, fileName.c_str(), dataMessage.c_str(), FILE_WRITE);
+    _debug.setMsg("Create buffer file: " + fileName);
+
+    allOK = _createSegment(_tailSegment);
 
     if (allOK) {
         _bufferSize = 0;
-        _currentPointer = dataMessage.length();
+        _isFileCreated = true;
+        _numRecordsInTail = 0;
+        _tailPointer = SDHEADERSIZE;
+        _tailCompressed = _compression;
+        _tailDamaged = false;
+        _encoder.reset();
+        _openCursor(&_head, _tailSegment);
+        _numStaged = 0;
+        _stagedFirst = 0;
+
+        allOK = _saveCheckpoint(true);
     }
 
     return (allOK); 
 }
 
 
+// Update the name of a varId in the dictionary (RAM and header of the segment being pushed).
+// If the varId had another name and the segment has records, they keep it: the staged records
+// are written and the next ones go to a new segment.
+
+bool SDBuffer::setVarName(int varId, String name) {
+
+    bool allOK=true;
+
+    if (varId < 0 || varId >= MAXNUMVARS) return(false);
+
+    String shortName = name.substring(0, SDNAMESIZE - 1);
+
+    if (shortName != String(_varNames[varId])) {
+        memset(_varNames[varId], 0, SDNAMESIZE);
+        memcpy(_varNames[varId], shortName.c_str(), shortName.length());
+        _namesVersion++;
+        _namesMillis = millis();
+    }
+
+    if (_header.names[varId][0] != '\0' && shortName != String(_header.names[varId])) {
+
+        _debug.setMsg("Var " + String(varId) + " renamed in the buffer file: " + String(_header.names[varId]) + " -> " + shortName);
+
+        if (_isFileCreated && (_numRecordsInTail > 0 || _numStaged > 0)) {
+            if (!_commitStaging()) _debug.setError("Failed to write the records staged before renaming a var");
+            _tailDamaged = true;
+        }
+    }
+
+    memset(_header.names[varId], 0, SDNAMESIZE);
+    memcpy(_header.names[varId], shortName.c_str(), shortName.length());
+
+    // A segment closed for new records keeps its names (the next one is created with the new ones)
+
+    if (_isFileCreated && !_tailDamaged) {
+
+        File file = SD.open(_segmentName(_tailSegment), FILE_READWRITE);
+
+        if (!file) allOK = false;
+        else {
+            file.seek(0);
+            allOK = (file.write((const uint8_t*)&_header, sizeof(sdFileHeader_t)) == sizeof(sdFileHeader_t));
+            file.close();
+        }
+
+        if (!allOK) _debug.setError("Failed to update the names in the file header");
+    }
+
+    return(allOK);
+}
+
+
 int SDBuffer::bufferSize() {
     return (_bufferSize);
 }
 
+unsigned long SDBuffer::getNumNotRegistered() {
+    return (_numNotRegistered);
+}
+
+// After a reboot the variables can be registered after the first pops: the records of a name
+// not registered wait up to SDREGISTERMILLIS from the last registration, then they are dropped.
+
+bool SDBuffer::isDrainHeld() {
+    return (_isHeadHeld && (millis() - _namesMillis) < SDREGISTERMILLIS);
+}
+
+bool SDBuffer::_holdHead(File &file) {
+
+    if (_head.mapVersion != _namesVersion) _loadVarIdMap(file, &_head);
+
+    _isHeadHeld = _head.hasNotRegistered;
+
+    return (isDrainHeld());
+}
+
 
 uint64_t SDBuffer::_size() {
     return (SD.usedBytes());
 }
 
+// Single record versions of popMany() and peekAt()
+
 bool SDBuffer::pop(varStamp_t* ptrVarStamp, bool onlyPeek){
 
+    if (onlyPeek) return(peekAt(0, ptrVarStamp));
+
+    return(popMany(ptrVarStamp, 1) == 1);
+}
+
+bool SDBuffer::peek(varStamp_t* ptrVarStamp) {
+    return(pop(ptrVarStamp, true));
+}
+
+// Access to a record without popping. The segments before it are skipped by their number of records.
+// Inside a segment, a raw record is located by its offset, a compressed one is decoded from the start.
+
+bool SDBuffer::peekAt(int index, varStamp_t* ptrVarStamp) {
+
     bool allOK=false;
+    int numInFile = _bufferSize - _numStaged;
 
-    if (_bufferSize > 0) {
+    if (index < 0 || index >= _bufferSize) return(false);
 
-        File file = SD.open(_fileName, FILE_READ);
+    if (index >= numInFile) return(_varFromRecord(ptrVarStamp, &_staging[_stagedFirst + index - numInFile]));
+
+    sdCursor_t cursor = _head;
+
+    while (index >= _numLeft(&cursor)) {
+        if (cursor.segment >= _tailSegment) return(false);
+        index -= _numLeft(&cursor);
+        _openCursor(&cursor, cursor.segment + 1);
+    }
+
+    File file = SD.open(_segmentName(cursor.segment), FILE_READ);
+
+    if (file) {
+
+        sdRecord_t record;
+
+        allOK = _skipRecords(file, &cursor, index) && _readCursor(file, &cursor, &record, 1) == 1;
+        allOK = allOK && _varFromRecord(ptrVarStamp, &record);
+        file.close();
+    }
+
+    return(allOK);
+}
+
+// Push to the staging block. The block is written to the file when the file reaches
+// the end of a sector, or by flushIfDue()/flush().
+// Only fails if the block is full and can not be written.
+
+bool SDBuffer::push(varStamp_t* ptrVarStamp){
+
+    if (_stagedFirst + _numStaged >= (int)SDSTAGINGRECORDS) {
+
+        if (_stagedFirst > 0) {
+            memmove(&_staging[0], &_staging[_stagedFirst], _numStaged * SDRECORDSIZE);
+            _stagedFirst = 0;
+        } else if (!_commitStaging()) {
+            return(false);
+        }
+    }
+
+    if (_numStaged == 0) _stagedMillis = millis();
+
+    _recordFromVar(&_staging[_stagedFirst + _numStaged], ptrVarStamp);
+    _numStaged++;
+    _bufferSize++;
+
+    // Full sectors are written as soon as they are complete. If it fails, it is retried later.
+
+    // Compressed records are not aligned to sectors: the block is written when it is full.
+
+    int numSectorUsed = _tailCompressed ? 0 : _numRecordsInTail % (int)SDSTAGINGRECORDS; // Records already in the partial last sector
+
+    if (_numStaged >= (int)SDSTAGINGRECORDS - numSectorUsed) _commitStaging();
+
+    return(true);
+}
+
+// Batch pop: one open and one seek for all the records of each segment
+
+int SDBuffer::popMany(varStamp_t* ptrVarStamps, int maxNum){
+
+    int numPopped=0;
+    int numToRead = min(maxNum, _bufferSize - _numStaged);
+
+    sdRecord_t records[SDBATCHSIZE];
+
+    while (numToRead > 0) {
+
+        _advanceHeadSegment();
+
+        int numToReadSegment = min(numToRead, _numRecordsInHead());
+
+        File file = SD.open(_segmentName(_head.segment), FILE_READ);
 
         if(!file) {
+            _debug.setError("Failed to open file for reading");
+            return(numPopped);
+        }
 
-            _debug.setError("Failed to open file for writing");
-            allOK = false;
+        if (_holdHead(file)) {
+            file.close();
+            return(numPopped);
+        }
 
-        } else {
+        int numRead=0;
 
-            file.seek(_currentPointer);
+        while (numRead < numToReadSegment) {
 
-            String lineStr = file.readStringUntil('\n');
+            int numChunk = min(numToReadSegment - numRead, SDBATCHSIZE);
+            int numChunkRead = _readCursor(file, &_head, records, numChunk);
 
-            _debug.setMsg("Pop from SD: " + lineStr);
+            for (int i=0; i<numChunkRead; i++) {
+
+                // A corrupted record is skipped, to not block the buffer
 
-            if (!onlyPeek)  {
-                _currentPointer = file.position();
                 _bufferSize--;
+
+                if (_varFromRecord(&ptrVarStamps[numPopped], &records[i])) numPopped++;
+                else if (records[i].varId == SDVARNOTREGISTERED) _numNotRegistered++;
+                else _debug.setError("Corrupted record in the SD buffer");
             }
 
-            int coma1 = lineStr.indexOf(",");
-            int coma2 = lineStr.indexOf(",", coma1+1);
-            int size = lineStr.length();
+            numRead += numChunkRead;
 
-            strcpy(ptrVarStamp->varName, lineStr.substring(0,coma1).substring(0,MAXCHARVARNAME).c_str());
-            ptrVarStamp->value = lineStr.substring(coma1+1,coma2).toInt();
-            ptrVarStamp->ts = strtoul(lineStr.substring(coma2+1,size).c_str(), NULL, 0);
+            if (numChunkRead < numChunk && _head.compressed) {
 
-            file.close();
+                // The rest of a compressed segment can not be decoded: it is skipped
+
+                int numLost = _numRecordsInHead();
 
-            allOK = true;
+                _debug.setError("Corrupted compressed segment in the SD buffer. Records lost=" + String(numLost));
+                _skipSegment(&_head);
+                _bufferSize -= numLost;
+                numRead += numLost;
+                break;
+
+            } else if (numChunkRead < numChunk) {
+                _debug.setError("Failed to read a record from the file");
+                file.close();
+                return(numPopped);
+            }
         }
-    } 
 
-    return (allOK);
+        file.close();
+
+        numToRead -= numRead;
+    }
+
+    // Then, the records still in the staging block
+
+    while (numPopped < maxNum && _bufferSize > 0 && _bufferSize == _numStaged) {
+        if (_varFromRecord(&ptrVarStamps[numPopped], &_staging[_stagedFirst])) numPopped++;
+        _dropStaged(1);
+    }
 
+    return(numPopped);
 }
 
-bool SDBuffer::peek(varStamp_t* ptrVarStamp) {
-    return(pop(ptrVarStamp, true));
+
+// Write-behind staging block
+
+void SDBuffer::setFlushInterval(unsigned long flushMillis) {
+    _flushMillis = flushMillis;
 }
 
-bool SDBuffer::push(varStamp_t* ptrVarStamp){
+bool SDBuffer::flushIfDue() {
+
+    bool allOK=true;
+
+    if (_numStaged > 0 && (millis() - _stagedMillis) >= _flushMillis) allOK = _commitStaging();
+
+    _saveCheckpointIfDue();
+
+    return(allOK);
+}
+
+bool SDBuffer::flush() {
+    return(_commitStaging() && _saveCheckpoint());
+}
+
+int SDBuffer::numStaged() {
+    return(_numStaged);
+}
+
+// Write all the staged records with a single file access per segment.
+// In a compressed segment, the records are encoded just before writing them.
+
+bool SDBuffer::_commitStaging() {
+
+    uint8_t encoded[SDSTAGINGRECORDS * SDMAXENCODEDSIZE];
+
+    while (_numStaged > 0) {
+
+        if (_isTailFull() && !_rollSegment()) return(false);
+
+        int numToWrite=0;
+        size_t size=0;
+        const uint8_t* data;
+        SDCodec encoder = _encoder;
+
+        if (_tailCompressed) {
+
+            while (numToWrite < _numStaged && _tailPointer + size + SDMAXENCODEDSIZE <= SDSEGMENTSIZE) {
+                size += encoder.encode(&_staging[_stagedFirst + numToWrite], &encoded[size]);
+                numToWrite++;
+            }
+
+            data = encoded;
+
+        } else {
+
+            numToWrite = min(_numStaged, SDSEGMENTRECORDS - _numRecordsInTail);
+            size = numToWrite * SDRECORDSIZE;
+            data = (const uint8_t*)&_staging[_stagedFirst];
+        }
+
+        File file = SD.open(_segmentName(_tailSegment), FILE_APPEND);
+
+        if (!file) {
+            _debug.setError("Failed to open file for appending");
+            return(false);
+        }
+
+        size_t bytesWritten = file.write(data, size);
+        file.close();
+
+        // A compressed block partially written can not be decoded: only complete blocks are kept
+
+        int numWritten = numToWrite;
+
+        if (bytesWritten < size) numWritten = _tailCompressed ? 0 : (int)(bytesWritten / SDRECORDSIZE);
+
+        size_t sizeWritten = (bytesWritten == size) ? size : (size_t)numWritten * SDRECORDSIZE;
+
+        if (bytesWritten == size && _tailCompressed) _encoder = encoder;
+
+        _numRecordsInTail += numWritten;
+        _tailPointer += sizeWritten;
+        _stagedFirst += numWritten;
+        _numStaged -= numWritten;
+        _stagedMillis = millis();
+
+        if (numWritten < numToWrite) {
+
+            // Bytes not valid at the end of the segment: the next records go to a new one
+
+            if (bytesWritten > sizeWritten) _tailDamaged = true;
+
+            // Card full before the quota: the quota is reduced to the current segments
+
+            _debug.setError("Failed to open or appending");
+            _maxSegments = max(numSegments(), 2);
+            return(false);
+        }
+    }
+
+    _stagedFirst = 0;
+
+    return(true);
+}
+
+
+// Segments
+
+void SDBuffer::setQuota(uint64_t maxBytes, sdEvictionPolicy_t policy) {
+
+    _quotaBytes = maxBytes;
+    _evictionPolicy = policy;
+
+    _updateMaxSegments();
+}
+
+void SDBuffer::setEvictionPolicy(sdEvictionPolicy_t policy) {
+
+    _evictionPolicy = policy;
+}
+
+// Segments allowed by the quota. By default, a percentage of the free space (plus the space already used).
+
+void SDBuffer::_updateMaxSegments() {
+
+    uint64_t quotaBytes = _quotaBytes;
+
+    if (quotaBytes == 0) {
+        uint64_t usedBytes = _size();
+        uint64_t freeBytes = SD.totalBytes() > usedBytes ? SD.totalBytes() - usedBytes : 0;
+        quotaBytes = freeBytes / 100 * SDQUOTAPERCENT + (uint64_t)numSegments() * SDSEGMENTSIZE;
+    }
+
+    _maxSegments = (int)min(quotaBytes / SDSEGMENTSIZE, (uint64_t)INT_MAX);
+    _maxSegments = max(_maxSegments, 2);
+}
+
+int SDBuffer::numSegments() {
+    return(_isFileCreated ? (int)(_tailSegment - _head.segment + 1) : 0);
+}
+
+int SDBuffer::maxSegments() {
+    return(_maxSegments);
+}
+
+unsigned long SDBuffer::getNumEvicted() {
+    return(_numEvicted);
+}
+
+void SDBuffer::setCompression(bool enable) {
+    _compression = enable;
+}
+
+bool SDBuffer::compression() {
+    return(_compression);
+}
+
+String SDBuffer::_segmentName(uint32_t segment) {
+    return(_fileName + "." + String((unsigned long)segment));
+}
+
+// New segment file with the header (magic, format and names dictionary)
+
+bool SDBuffer::_createSegment(uint32_t segment) {
+
+    uint8_t headerSector[SDHEADERSIZE];
+
+    memset(headerSector, 0, SDHEADERSIZE);
+    memcpy(headerSector, &_header, sizeof(sdFileHeader_t));
+
+    return(_writeAppendBytes(SD, _segmentName(segment).c_str(), headerSector, SDHEADERSIZE, FILE_WRITE));
+}
+
+// The tail segment is full: start a new one. If the quota is reached, apply the eviction policy.
+
+bool SDBuffer::_rollSegment() {
+
+    _advanceHeadSegment();
+
+    if (numSegments() >= _maxSegments) {
+
+        if (_evictionPolicy == SD_EVICT_OLDEST && _head.segment < _tailSegment) {
+            _evictHeadSegment();
+        } else {
+            _debug.setError("SD buffer quota reached. New records rejected.");
+            return(false);
+        }
+    }
+
+    // If it fails, the records of the old tail are counted when they are read
+    if (!_closeTailSegment()) _debug.setError("Failed to close the segment");
+
+    _header.flags = _compression ? SDFLAGCOMPRESSED : 0;
+    _header.numRecords = 0;
+
+    if (!_createSegment(_tailSegment + 1)) {
+        _header.flags = _tailCompressed ? SDFLAGCOMPRESSED : 0;
+        _debug.setError("Failed to create a new segment");
+        return(false);
+    }
+
+    if (_head.segment == _tailSegment) _head.numRecords = _numRecordsInTail;
+
+    _tailSegment++;
+    _numRecordsInTail = 0;
+    _tailPointer = SDHEADERSIZE;
+    _tailCompressed = _compression;
+    _tailDamaged = false;
+    _encoder.reset();
+
+    // The old tail can be completely popped already
+    _advanceHeadSegment();
+
+    return(true);
+}
+
+// Write the number of records in the header of the tail segment, before starting a new one
+
+bool SDBuffer::_closeTailSegment() {
+
+    uint32_t numRecords = _numRecordsInTail;
+
+    File file = SD.open(_segmentName(_tailSegment), FILE_READWRITE);
+
+    bool allOK = file && file.seek(offsetof(sdFileHeader_t, numRecords));
+    allOK = allOK && (file.write((const uint8_t*)&numRecords, sizeof(uint32_t)) == sizeof(uint32_t));
+
+    file.close();
+
+    return(allOK);
+}
+
+bool SDBuffer::_isTailFull() {
+
+    if (_tailDamaged) return(true);
+
+    if (_tailCompressed) return(_tailPointer + SDMAXENCODEDSIZE > SDSEGMENTSIZE);
+
+    return(_numRecordsInTail >= SDSEGMENTRECORDS);
+}
+
+// Delete the head segments that are completely popped
+
+void SDBuffer::_advanceHeadSegment() {
+
+    while (_head.segment < _tailSegment && _numRecordsInHead() == 0) {
+        SD.remove(_segmentName(_head.segment));
+        _openCursor(&_head, _head.segment + 1);
+    }
+}
+
+// Delete the oldest segment, with the records not yet popped
+
+void SDBuffer::_evictHeadSegment() {
+
+    int numLost = _numRecordsInHead();
+
+    SD.remove(_segmentName(_head.segment));
+    _openCursor(&_head, _head.segment + 1);
+
+    _bufferSize -= numLost;
+    _numEvicted += numLost;
+
+    _debug.setError("SD buffer quota reached. Oldest records deleted: " + String(numLost) + " Total=" + String(_numEvicted));
+}
+
+int SDBuffer::_numRecordsInHead() {
+    return(_numLeft(&_head));
+}
+
+
+// Reading: a cursor keeps the position (and the decoder state) in a segment
+
+bool SDBuffer::_openCursor(sdCursor_t* ptrCursor, uint32_t segment) {
+
+    bool allOK=true;
+
+    ptrCursor->segment = segment;
+    ptrCursor->pointer = SDHEADERSIZE;
+    ptrCursor->numRead = 0;
+    ptrCursor->numRecords = 0;
+    ptrCursor->compressed = _tailCompressed;
+    ptrCursor->codec.reset();
+    ptrCursor->mapVersion = 0;
+
+    if (segment == _tailSegment) return(true);
+
+    File file = SD.open(_segmentName(segment), FILE_READ);
+
+    if (!file) return(false);
+
+    sdFileHeader_t header;
+
+    allOK = (file.read((uint8_t*)&header, offsetof(sdFileHeader_t, names)) == offsetof(sdFileHeader_t, names));
+    allOK = allOK && header.magic == SDMAGIC;
+
+    ptrCursor->compressed = allOK && (header.flags & SDFLAGCOMPRESSED);
+    ptrCursor->numRecords = allOK ? (int)header.numRecords : 0;
+
+    // Segment not closed (power loss while starting the next one): its records are counted
+
+    if (allOK && header.numRecords == 0) {
+
+        sdRecord_t records[SDBATCHSIZE];
+
+        while (_readCursor(file, ptrCursor, records, SDBATCHSIZE) == SDBATCHSIZE);
+
+        ptrCursor->numRecords = ptrCursor->numRead;
+        ptrCursor->pointer = SDHEADERSIZE;
+        ptrCursor->numRead = 0;
+        ptrCursor->codec.reset();
+    }
+
+    file.close();
+
+    return(allOK);
+}
+
+int SDBuffer::_numLeft(sdCursor_t* ptrCursor) {
+
+    int numRecords = (ptrCursor->segment == _tailSegment) ? _numRecordsInTail : ptrCursor->numRecords;
+
+    return(numRecords - ptrCursor->numRead);
+}
+
+// Read up to maxNum records from the cursor position. Compressed records are read by sectors and decoded.
+// Returns the records read: less than maxNum at the end of the file, or if the data can not be decoded.
+
+int SDBuffer::_readCursor(File &file, sdCursor_t* ptrCursor, sdRecord_t* ptrRecords, int maxNum) {
+
+    int numRead=0;
+
+    if (!file.seek(ptrCursor->pointer)) return(0);
+
+    if (!ptrCursor->compressed) {
+
+        numRead = file.read((uint8_t*)ptrRecords, maxNum * SDRECORDSIZE) / SDRECORDSIZE;
+
+        ptrCursor->pointer += numRead * SDRECORDSIZE;
+        ptrCursor->numRead += numRead;
+
+        _mapVarIds(file, ptrCursor, ptrRecords, numRead);
+
+        return(numRead);
+    }
+
+    uint8_t buffer[SDSECTORSIZE];
+    size_t size=0;
+    size_t pos=0;
+    bool endOfFile=false;
+
+    while (numRead < maxNum) {
+
+        if (size - pos < SDMAXENCODEDSIZE && !endOfFile) {
+
+            memmove(buffer, &buffer[pos], size - pos);
+            size -= pos;
+            pos = 0;
+
+            size_t bytesRead = file.read(&buffer[size], SDSECTORSIZE - size);
+
+            endOfFile = (bytesRead < SDSECTORSIZE - size);
+            size += bytesRead;
+        }
+
+        int used = ptrCursor->codec.decode(&buffer[pos], size - pos, &ptrRecords[numRead]);
+
+        if (used == 0) break;
+
+        ptrRecords[numRead].check = _recordCheck(&ptrRecords[numRead]);
+
+        pos += used;
+        ptrCursor->pointer += used;
+        ptrCursor->numRead++;
+        numRead++;
+    }
+
+    _mapVarIds(file, ptrCursor, ptrRecords, numRead);
+
+    return(numRead);
+}
+
+// Records with the varIds registered now. The check is computed again for the records mapped,
+// only if they were valid. Records of names not registered get SDVARNOTREGISTERED.
+
+void SDBuffer::_mapVarIds(File &file, sdCursor_t* ptrCursor, sdRecord_t* ptrRecords, int num) {
+
+    if (num == 0) return;
+
+    if (ptrCursor->mapVersion != _namesVersion) _loadVarIdMap(file, ptrCursor);
+
+    if (ptrCursor->isMapIdentity) return;
+
+    for (int i=0; i<num; i++) {
+
+        sdRecord_t* ptrRecord = &ptrRecords[i];
+
+        if (ptrRecord->varId >= MAXNUMVARS || ptrRecord->check != _recordCheck(ptrRecord)) continue;
+
+        int varId = ptrCursor->varIdMap[ptrRecord->varId];
+
+        if (varId == ptrRecord->varId) continue;
+
+        ptrRecord->varId = (varId < 0) ? SDVARNOTREGISTERED : varId;
+        ptrRecord->check = _recordCheck(ptrRecord);
+    }
+}
+
+// Map from the names of the segment dictionary. A name not set in the segment, or a buffer
+// without names registered, keeps its varId.
+
+void SDBuffer::_loadVarIdMap(File &file, sdCursor_t* ptrCursor) {
+
+    bool anyRegistered=false;
+    char name[SDNAMESIZE];
+
+    for (int i=0; i<MAXNUMVARS; i++) {
+        ptrCursor->varIdMap[i] = i;
+        anyRegistered = anyRegistered || _varNames[i][0] != '\0';
+    }
+
+    ptrCursor->isMapIdentity = true;
+    ptrCursor->hasNotRegistered = false;
+
+    if (!file.seek(offsetof(sdFileHeader_t, names))) return;
+
+    for (int i=0; i<MAXNUMVARS; i++) {
+
+        if (file.read((uint8_t*)name, SDNAMESIZE) != SDNAMESIZE) return;
+
+        name[SDNAMESIZE - 1] = '\0';
+
+        if (name[0] == '\0' || strcmp(name, _varNames[i]) == 0) continue;
+
+        int varId = -1;
+
+        for (int j=0; j<MAXNUMVARS && varId < 0; j++) {
+            if (strcmp(name, _varNames[j]) == 0) varId = j;
+        }
+
+        ptrCursor->hasNotRegistered = ptrCursor->hasNotRegistered || varId < 0;
+
+        if (!anyRegistered) continue;
+
+        ptrCursor->varIdMap[i] = varId;
+        ptrCursor->isMapIdentity = false;
+
+        if (ptrCursor != &_head) continue;
+
+        if (varId < 0) _debug.setMsg("Records of " + String(name) + " in the SD buffer wait for the var to be registered (dropped after " + String(SDREGISTERMILLIS / 1000) + "s)");
+        else _debug.setMsg("Records of " + String(name) + " in the SD buffer: var " + String(i) + " -> " + String(varId));
+    }
+
+    ptrCursor->mapVersion = _namesVersion;
+}
+
+// Move the cursor forward. Raw records are skipped by their offset, compressed ones are decoded.
+
+bool SDBuffer::_skipRecords(File &file, sdCursor_t* ptrCursor, int num) {
+
+    if (!ptrCursor->compressed) {
+        ptrCursor->pointer += (size_t)num * SDRECORDSIZE;
+        ptrCursor->numRead += num;
+        return(true);
+    }
+
+    sdRecord_t records[SDBATCHSIZE];
+
+    while (num > 0) {
+
+        int numChunk = min(num, SDBATCHSIZE);
+
+        if (_readCursor(file, ptrCursor, records, numChunk) < numChunk) return(false);
+
+        num -= numChunk;
+    }
+
+    return(true);
+}
+
+// Give up the rest of the segment. In the tail, the next records are read from its end.
+
+void SDBuffer::_skipSegment(sdCursor_t* ptrCursor) {
+
+    if (ptrCursor->segment == _tailSegment) {
+        ptrCursor->numRead = _numRecordsInTail;
+        ptrCursor->pointer = _tailPointer;
+        ptrCursor->codec = _encoder;
+    } else {
+        ptrCursor->numRead = ptrCursor->numRecords;
+    }
+}
+
+
+// Checkpoint: pointers of the head and tail segments, to resume the buffer after a reboot.
+// Two slots written alternately, so a power loss while writing one keeps the other.
+
+void SDBuffer::setCheckpointInterval(unsigned long checkpointMillis) {
+    _checkpointMillis = checkpointMillis;
+}
+
+bool SDBuffer::_saveCheckpointIfDue() {
+
+    bool changed = (_checkpoint.headSegment != _head.segment || _checkpoint.numReadInHead != (uint32_t)_head.numRead);
+    changed = changed || _checkpoint.tailSegment != _tailSegment || _checkpoint.numRecordsInTail != (uint32_t)_numRecordsInTail;
+
+    if (!_isFileCreated || !changed || (millis() - _lastCheckpointMillis) < _checkpointMillis) return(true);
+
+    return(_saveCheckpoint());
+}
+
+bool SDBuffer::_saveCheckpoint(bool newFile) {
 
     bool allOK=false;
+    sdCheckpoint_t checkpoint;
+
+    checkpoint.magic = SDMAGIC;
+    checkpoint.seq = newFile ? 0 : _checkpoint.seq + 1;
+    checkpoint.headSegment = _head.segment;
+    checkpoint.readPointer = _head.pointer;
+    checkpoint.numReadInHead = _head.numRead;
+    checkpoint.tailSegment = _tailSegment;
+    checkpoint.numRecordsInTail = _numRecordsInTail;
+    checkpoint.check = _checkpointCheck(&checkpoint);
+
+    File file;
+
+    if (newFile) {
+
+        // Slot 0 with the new checkpoint, slot 1 empty
+
+        sdCheckpoint_t slots[2];
 
-    String lineStr = String(ptrVarStamp->varName) + ',' + String(ptrVarStamp->value) + ',' + String(ptrVarStamp->ts) + '\n';
+        memset(slots, 0, sizeof(slots));
+        slots[0] = checkpoint;
 
-    _debug.setMsg("Push to SD: " + lineStr);
-    
-    allOK = _writeAppendFile(SD, _fileName.c_str(), lineStr.c_str(), FILE_APPEND);
+        file = SD.open(_checkpointFileName, FILE_WRITE);
+        allOK = file && (file.write((const uint8_t*)slots, sizeof(slots)) == sizeof(slots));
 
+    } else {
 
-    if (allOK) _bufferSize ++; // Increase buffer counter if no error appending the file
+        file = SD.open(_checkpointFileName, FILE_READWRITE);
+        allOK = file && file.seek((checkpoint.seq % 2) * sizeof(sdCheckpoint_t));
+        allOK = allOK && (file.write((const uint8_t*)&checkpoint, sizeof(sdCheckpoint_t)) == sizeof(sdCheckpoint_t));
+    }
+
+    file.close();
+
+    if (allOK) _checkpoint = checkpoint;
+    else _debug.setError("Failed to save the buffer checkpoint");
+
+    _lastCheckpointMillis = millis();
 
     return(allOK);
 }
 
+// Last valid checkpoint (the valid slot with the biggest sequence)
+
+bool SDBuffer::_loadCheckpoint(sdCheckpoint_t* ptrCheckpoint) {
+
+    sdCheckpoint_t slots[2];
+    bool valid[2];
+
+    File file = SD.open(_checkpointFileName, FILE_READ);
+
+    if (!file) return(false);
+
+    memset(slots, 0, sizeof(slots));
+    file.read((uint8_t*)slots, sizeof(slots));
+    file.close();
+
+    for (int i=0; i<2; i++) valid[i] = (slots[i].magic == SDMAGIC && slots[i].check == _checkpointCheck(&slots[i]));
+
+    if (!valid[0] && !valid[1]) return(false);
+
+    if (valid[0] && valid[1]) *ptrCheckpoint = ((int32_t)(slots[1].seq - slots[0].seq) > 0) ? slots[1] : slots[0];
+    else *ptrCheckpoint = valid[0] ? slots[0] : slots[1];
+
+    return(true);
+}
+
+uint32_t SDBuffer::_checkpointCheck(sdCheckpoint_t* ptrCheckpoint) {
+
+    const uint8_t* bytes = (const uint8_t*)ptrCheckpoint;
+    uint32_t check = 2166136261UL;
+
+    for (size_t i=0; i<offsetof(sdCheckpoint_t, check); i++) {
+        check ^= bytes[i];
+        check *= 16777619UL;
+    }
+
+    return(check);
+}
+
+
+// Resume the buffer from the segments of the last checkpoint.
+// Segments created or deleted after the checkpoint are found by their name.
+// The read position comes from the checkpoint: records popped after it are popped again.
+// Only the raw records appended after the checkpoint are scanned. A compressed tail is decoded
+// from its start, to rebuild the encoder state.
+
+bool SDBuffer::_resumeFile() {
+
+    sdFileHeader_t header;
+    sdCheckpoint_t checkpoint;
+
+    if (!_loadCheckpoint(&checkpoint)) {
+        _debug.setMsg("No valid buffer checkpoint. A new buffer is created.");
+        return(false);
+    }
+
+    uint32_t headSegment = checkpoint.headSegment;
+    uint32_t tailSegment = checkpoint.tailSegment;
+    int numReadInHead = (int)min(checkpoint.numReadInHead, (uint32_t)INT_MAX);
+
+    while (SD.exists(_segmentName(tailSegment + 1))) tailSegment++;
+
+    while (headSegment < tailSegment && !SD.exists(_segmentName(headSegment))) {
+        headSegment++;
+        numReadInHead = 0;
+    }
+
+    File file = SD.open(_segmentName(tailSegment), FILE_READ);
+
+    if (!file) {
+        _debug.setMsg("Buffer segments not found. A new buffer is created.");
+        return(false);
+    }
+
+    size_t fileSize = file.size();
+
+    bool validHeader = (file.read((uint8_t*)&header, sizeof(sdFileHeader_t)) == sizeof(sdFileHeader_t));
+
+    validHeader = validHeader && header.magic == SDMAGIC && header.version == SDVERSION && header.recordSize == SDRECORDSIZE;
+    validHeader = validHeader && header.numVars == MAXNUMVARS && header.nameSize == SDNAMESIZE && fileSize >= SDHEADERSIZE;
+    validHeader = validHeader && (header.flags & ~SDFLAGCOMPRESSED) == 0;
+
+    if (!validHeader) {
+        file.close();
+        _debug.setMsg("Buffer file not valid. A new one is created.");
+        return(false);
+    }
+
+    // Recovery scan: records of the tail segment written after the checkpoint
+
+    sdCursor_t tail;
+
+    tail.segment = tailSegment;
+    tail.pointer = SDHEADERSIZE;
+    tail.numRead = 0;
+    tail.numRecords = 0;
+    tail.compressed = (header.flags & SDFLAGCOMPRESSED);
+    tail.codec.reset();
+    tail.mapVersion = 0;
+
+    if (!tail.compressed && tailSegment == checkpoint.tailSegment) {
+        int numChecked = min((int)checkpoint.numRecordsInTail, (int)((fileSize - SDHEADERSIZE) / SDRECORDSIZE));
+        _skipRecords(file, &tail, numChecked);
+    }
+
+    int numScanned = 0;
+    int numCorrupted = 0;
+    int numChunkRead = 0;
+
+    sdRecord_t records[SDBATCHSIZE];
+
+    do {
+
+        numChunkRead = _readCursor(file, &tail, records, SDBATCHSIZE);
+
+        for (int i=0; i<numChunkRead; i++) {
+            if (records[i].check != _recordCheck(&records[i])) numCorrupted++;
+        }
+
+        numScanned += numChunkRead;
+
+    } while (numChunkRead == SDBATCHSIZE);
+
+    file.close();
+
+    // Bytes after the last complete record (power loss while writing), or segment already closed:
+    // the next records are written in a new segment
+
+    _header = header;
+    _isFileCreated = true;
+    _tailSegment = tailSegment;
+    _numRecordsInTail = tail.numRead;
+    _tailPointer = tail.pointer;
+    _tailCompressed = tail.compressed;
+    _tailDamaged = (tail.pointer < fileSize || header.numRecords != 0);
+    _encoder = tail.codec;
+    _numStaged = 0;
+    _stagedFirst = 0;
+    _checkpoint = checkpoint;
+
+    // Head: skip the records popped before the checkpoint
+
+    _openCursor(&_head, headSegment);
+
+    numReadInHead = constrain(numReadInHead, 0, _numRecordsInHead());
+
+    if (numReadInHead > 0) {
+
+        file = SD.open(_segmentName(headSegment), FILE_READ);
+
+        if (!file || !_skipRecords(file, &_head, numReadInHead)) _openCursor(&_head, headSegment);
+
+        file.close();
+    }
+
+    _bufferSize = _numRecordsInHead();
+
+    for (uint32_t segment=headSegment + 1; segment<tailSegment; segment++) {
+        sdCursor_t cursor;
+        _openCursor(&cursor, segment);
+        _bufferSize += cursor.numRecords;
+    }
+
+    if (headSegment < tailSegment) _bufferSize += _numRecordsInTail;
+
+    _debug.setMsg("Buffer resumed: " + String(_bufferSize) + " records in " + String(numSegments()) + " segments. Scanned=" + String(numScanned) + " Corrupted=" + String(numCorrupted));
+
+    return(_saveCheckpoint());
+}
+
+
+// Remove records from the front of the staging block (popped without being written)
+
+void SDBuffer::_dropStaged(int num) {
+
+    _stagedFirst += num;
+    _numStaged -= num;
+    _bufferSize -= num;
+
+    if (_numStaged == 0) _stagedFirst = 0;
+}
+
 bool SDBuffer::empty(){
 
     return(_bufferSize == 0);
@@ -144,6 +1088,113 @@ bool SDBuffer::empty(){
 }
 
 
+// Write the records not yet popped as CSV text (for humans)
+
+bool SDBuffer::exportCsv(String csvFileName) {
+
+    bool allOK=false;
+
+    flush();
+
+    File csvFile = SD.open(csvFileName, FILE_WRITE);
+
+    if (csvFile) {
+
+        allOK = (csvFile.print("VarName,Value,TimeStamp\n") > 0);
+
+        sdCursor_t cursor = _head;
+        sdRecord_t records[SDBATCHSIZE];
+        varStamp_t varStamp;
+        int numPending = _bufferSize - _numStaged;
+
+        while (numPending > 0 && allOK) {
+
+            File file = SD.open(_segmentName(cursor.segment), FILE_READ);
+
+            if (!file) break;
+
+            int numChunkRead=0;
+
+            do {
+
+                numChunkRead = _readCursor(file, &cursor, records, min(min(_numLeft(&cursor), numPending), SDBATCHSIZE));
+
+                for (int i=0; i<numChunkRead && allOK; i++) {
+
+                    numPending--;
+
+                    if (!_varFromRecord(&varStamp, &records[i])) continue;
+
+                    String lineStr = String(_header.names[varStamp.varId]) + ',' + String(varStamp.value) + ',' + String(varStamp.ts) + '\n';
+                    allOK = (csvFile.print(lineStr) == lineStr.length());
+                }
+
+            } while (numChunkRead > 0 && allOK);
+
+            file.close();
+
+            if (cursor.segment >= _tailSegment || !_openCursor(&cursor, cursor.segment + 1)) break;
+        }
+
+        // Records not written (if the flush failed)
+
+        for (int i=0; i<_numStaged && allOK; i++) {
+
+            if (!_varFromRecord(&varStamp, &_staging[_stagedFirst + i])) continue;
+
+            String lineStr = String(_header.names[varStamp.varId]) + ',' + String(varStamp.value) + ',' + String(varStamp.ts) + '\n';
+            allOK = (csvFile.print(lineStr) == lineStr.length());
+        }
+    }
+
+    if (!allOK) _debug.setError("Failed to export the buffer to CSV");
+
+    csvFile.close();
+
+    return(allOK);
+}
+
+
+// Conversion between buffer variables and SD records
+
+void SDBuffer::_recordFromVar(sdRecord_t* ptrRecord, varStamp_t* ptrVarStamp) {
+
+    ptrRecord->varId = ptrVarStamp->varId;
+    ptrRecord->flags = 0;
+    ptrRecord->reserved = ptrVarStamp->tsMillis;
+    ptrRecord->value = ptrVarStamp->value;
+    ptrRecord->ts = ptrVarStamp->ts;
+    ptrRecord->check = _recordCheck(ptrRecord);
+}
+
+bool SDBuffer::_varFromRecord(varStamp_t* ptrVarStamp, sdRecord_t* ptrRecord) {
+
+    if (ptrRecord->check != _recordCheck(ptrRecord) || ptrRecord->varId >= MAXNUMVARS) return(false);
+
+    ptrVarStamp->varId = ptrRecord->varId;
+    ptrVarStamp->tsMillis = ptrRecord->reserved;
+    ptrVarStamp->value = ptrRecord->value;
+    ptrVarStamp->ts = ptrRecord->ts;
+
+    return(true);
+}
+
+// FNV-1a of the record data
+
+uint32_t SDBuffer::_recordCheck(sdRecord_t* ptrRecord) {
+
+    const uint8_t* bytes = (const uint8_t*)ptrRecord;
+    uint32_t check = 2166136261UL;
+
+    for (size_t i=0; i<offsetof(sdRecord_t, check); i++) {
+        check ^= bytes[i];
+        check *= 16777619UL;
+    }
+
+    return(check);
+}
+
+
 // Append data to the SD card (DON'T MODIFY THIS FUNCTION)
 bool SDBuffer::_writeAppendFile(fs::FS &fs, const char * path, const char * message, const char* option) {
 
@@ -164,3 +1215,22 @@ bool SDBuffer::_writeAppendFile(fs::FS &fs, const char * path, const char * mess
 
 }
 
+
+// Write binary data to the SD card
+
+bool SDBuffer::_writeAppendBytes(fs::FS &fs, const char * path, const uint8_t * buffer, size_t size, const char* option) {
+
+    bool allOK=false;
+
+    File file = fs.open(path, option);
+
+    if (!file) allOK=false;
+    else if (file.write(buffer, size) != size) { 
+        _debug.setError("Failed to open or appending");
+    } else allOK=true;
+
+    file.close();
+
+    return(allOK);
+
+}
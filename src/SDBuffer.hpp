@@ -4,8 +4,9 @@
 #include <Arduino.h>
 #include "dataStructure.h"
 #include "DebugMgr.hpp"
+#include "SDCodec.hpp"
 
-#define FILENAMESD "/sdbuffer.csv"
+#define FILENAMESD "/sdbuffer.bin"
 #define SD_GPIO 4 // Pin where the SD is attached
 
 // Libraries for SD card
@@ -14,14 +15,99 @@
 #include <SPI.h>
 #define ESP32MALOG_SD true
 
+#ifndef FILE_READWRITE
+#define FILE_READWRITE "r+"
+#endif
+
+// Binary file format
+
+#define SDMAGIC 0x4453414D // "MASD"
+#define SDVERSION 4
+#define SDSECTORSIZE 512
+#define SDNAMESIZE 16 // Bytes of each name in the header dictionary (MAXCHARVARNAME + '\0')
+#define SDBATCHSIZE 32 // Records read or written with a single file access (one sector)
+#define SDFLUSHMILLIS 1000 // Max time a record waits in the staging block before being written
+#define SDSEGMENTRECORDS 4096 // Records per segment file (64KB of records)
+#define SDQUOTAPERCENT 90 // Default quota: percentage of the free card space
+#define SDHEADERSIZE ((((20 + MAXNUMVARS * SDNAMESIZE) + SDSECTORSIZE - 1) / SDSECTORSIZE) * SDSECTORSIZE)
+
+#define SDSTAGINGRECORDS (SDSECTORSIZE / SDRECORDSIZE) // Records of the write-behind staging block (one sector)
+
+#define SDSEGMENTSIZE (SDHEADERSIZE + SDSEGMENTRECORDS * SDRECORDSIZE) // Max bytes of a segment file (also if compressed)
+
+#define SDFLAGCOMPRESSED 0x0001 // Segment records encoded with SDCodec
+#define SDVARNOTREGISTERED 0xFF // varId of the records whose name is not registered any more (dropped)
+#define SDREGISTERMILLIS 60000 // Max millis the records of a name not registered wait for its registration
+
+// Type: Header of each SD buffer segment file. Dictionary with the name of each varId.
+
+typedef struct sdFileHeader_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint16_t numVars;
+    uint16_t nameSize;
+    uint16_t flags; // SDFLAGCOMPRESSED
+    uint16_t reserved;
+    uint32_t numRecords; // Written when the segment is closed (0 while it is pushed)
+    char names[MAXNUMVARS][SDNAMESIZE];
+} sdFileHeader_t;
+
+// Type: Checkpoint of the SD buffer, to resume it after a reboot.
+
+typedef struct sdCheckpoint_t {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t headSegment; // Segment being popped
+    uint32_t readPointer; // Position of the first record not popped in the head segment
+    uint32_t numReadInHead; // Records popped in the head segment
+    uint32_t tailSegment; // Segment being pushed
+    uint32_t numRecordsInTail; // Records in the tail segment when the checkpoint was saved
+    uint32_t check;
+} sdCheckpoint_t;
+
+#define SDCHECKPOINTMILLIS 5000 // Min time between checkpoints
+
+// What to do when the buffer reaches its quota
+
+typedef enum sdEvictionPolicy_t {
+    SD_EVICT_OLDEST, // Delete the oldest segment (losing its records not popped)
+    SD_REJECT_NEWEST // Do not accept new records
+} sdEvictionPolicy_t;
+
+// Type: Read position in the segments
+
+typedef struct sdCursor_t {
+    uint32_t segment;
+    size_t pointer; // Bytes from the start of the segment file
+    int numRead; // Records read in the segment
+    int numRecords; // Records of the segment (if it is not the tail)
+    bool compressed;
+    SDCodec codec; // Decoder state (compressed segments)
+    int8_t varIdMap[MAXNUMVARS]; // Current varId of each varId of the segment (-1: not registered)
+    bool isMapIdentity;
+    bool hasNotRegistered; // Names of the segment not registered
+    uint32_t mapVersion; // Names version of the map (0: not loaded)
+} sdCursor_t;
+
 ///////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////
 
 // Class to manage SD Buffer.
-// It is a FIFO buffer written in a file. 
-// Pop is done positioning a pointer with seek, and reading 
-// Push is done appending in the file.
+// It is a FIFO buffer written in binary segment files (<fileName>.<n>): each one with a header
+// with the names of the variables, followed by fixed size records. A record is located by its
+// offset, without parsing.
+// Optionally, the records of a segment are compressed with SDCodec (flag in the segment header).
+// Compressed segments are read sequentially, decoding from the start of the segment.
+// Pop is done positioning a pointer with seek in the oldest segment, and reading.
+// Push is done appending in the newest segment. When it is full, a new one is started.
+// Segments completely popped are deleted, so the space used is bounded by the quota.
+// The pointers are saved periodically in a checkpoint file, so the buffer
+// survives a reboot (records popped after the last checkpoint are popped again).
+// The records are read with the varIds of the names registered now (setVarName): if the variables
+// are registered in another order after a reboot, the varIds are mapped by the names of the segment
+// dictionary, and the records of names not registered any more are dropped.
 
 
 class SDBuffer {
@@ -29,19 +115,51 @@ class SDBuffer {
     public:
 
         SDBuffer();
-        bool setFileName(String fileName);
+        bool setFileName(String fileName); // Resume the segments if they are valid. If not, create a new buffer.
         bool fileExist();
-        bool createFile(String fileName);
+        bool createFile(String fileName); // New empty buffer (deletes the current segments)
         int bufferSize();
 
+        // Disk usage
+
+        void setQuota(uint64_t maxBytes, sdEvictionPolicy_t policy=SD_EVICT_OLDEST);
+        void setEvictionPolicy(sdEvictionPolicy_t policy);
+        int numSegments();
+        int maxSegments();
+        unsigned long getNumEvicted(); // Records deleted by SD_EVICT_OLDEST
+
+        // Compression of the segments created from now on (the current one keeps its format)
+
+        void setCompression(bool enable);
+        bool compression();
+
         bool empty();
 
+        bool setVarName(int varId, String name); // Name of the varId in the file dictionary (a rename starts a new segment)
+        unsigned long getNumNotRegistered(); // Records dropped: their variable is not registered
+        bool isDrainHeld(); // The next records wait for the registration of their variable
+
         bool peek(varStamp_t* varStamp); // Use file.seek()
+        bool peekAt(int index, varStamp_t* varStamp); // Record at position index from the read pointer
         bool pop(varStamp_t* varStamp, bool onlyPeek=false); // Use file.seek()
         bool push(varStamp_t* varStamp); // Use file.append() if there is space in disk. If not delete X first values and retry.
+
+        int popMany(varStamp_t* ptrVarStamps, int maxNum); // Pop up to maxNum records opening the file once. Returns the records popped.
+
+        // Write-behind: pushed records are staged in RAM and written by full sectors,
+        // or when the oldest staged record is older than the flush interval.
+
+        void setFlushInterval(unsigned long flushMillis);
+        bool flushIfDue(); // To be called periodically
+        bool flush(); // Write all the staged records (ie, before shutdown)
+        int numStaged();
+
+        void setCheckpointInterval(unsigned long checkpointMillis);
         void deleteFile(); // Delete file if seekPointer is in the end (no more data to pop);
         bool init();
 
+        bool exportCsv(String csvFileName); // Human readable copy of the records not yet popped
+
     private:
 
         bool _SDinit=false;
@@ -49,12 +167,86 @@ class SDBuffer {
 
         int _bufferSize=0; // Real buffer size (in objects)
 
-        int _totalFileSize=0; // Total size of the file.
-        size_t _currentPointer=0; // Position where to start reading new data
+        bool _isFileCreated=false;
+
+        sdFileHeader_t _header;
+
+        // Names registered now (setVarName), to map the varIds of the segments
+
+        char _varNames[MAXNUMVARS][SDNAMESIZE];
+        uint32_t _namesVersion=1;
+        unsigned long _numNotRegistered=0;
+        unsigned long _namesMillis=0; // Last name registered
+        bool _isHeadHeld=false;
+        bool _holdHead(File &file);
+
+        void _loadVarIdMap(File &file, sdCursor_t* ptrCursor);
+        void _mapVarIds(File &file, sdCursor_t* ptrCursor, sdRecord_t* ptrRecords, int num);
+
+        // Segments
+
+        sdCursor_t _head; // Oldest segment, being popped
+        uint32_t _tailSegment=1; // Newest segment, being pushed
+        int _numRecordsInTail=0; // Records written to the tail segment
+        size_t _tailPointer=0; // End of the tail segment
+        bool _tailCompressed=false;
+        bool _tailDamaged=false; // Partial write in the tail: the next records go to a new segment
+        SDCodec _encoder; // Encoder state of the tail segment
+        bool _compression=false; // Format of the new segments
 
-        bool _isFileCreated;
+        uint64_t _quotaBytes=0; // 0: SDQUOTAPERCENT of the free space
+        int _maxSegments=2;
+        sdEvictionPolicy_t _evictionPolicy=SD_EVICT_OLDEST;
+        unsigned long _numEvicted=0;
+
+        String _segmentName(uint32_t segment);
+        bool _createSegment(uint32_t segment);
+        bool _rollSegment();
+        void _advanceHeadSegment();
+        void _evictHeadSegment();
+        int _numRecordsInHead(); // Records not yet popped in the head segment file
+        void _updateMaxSegments();
+        bool _isTailFull();
+        bool _closeTailSegment();
+
+        // Reading (raw or compressed segments)
+
+        bool _openCursor(sdCursor_t* ptrCursor, uint32_t segment);
+        int _numLeft(sdCursor_t* ptrCursor); // Records not yet read in the segment of the cursor
+        int _readCursor(File &file, sdCursor_t* ptrCursor, sdRecord_t* ptrRecords, int maxNum);
+        bool _skipRecords(File &file, sdCursor_t* ptrCursor, int num);
+        void _skipSegment(sdCursor_t* ptrCursor); // Records that can not be decoded
+
+        // Write-behind staging block
+
+        sdRecord_t _staging[SDSTAGINGRECORDS];
+        int _stagedFirst=0; // First staged record not popped
+        int _numStaged=0;
+        unsigned long _stagedMillis=0; // When the oldest staged record was pushed
+        unsigned long _flushMillis=SDFLUSHMILLIS;
+
+        bool _commitStaging();
+        void _dropStaged(int num);
+
+        // Checkpoint and recovery after a reboot
+
+        String _checkpointFileName;
+        sdCheckpoint_t _checkpoint; // Last checkpoint saved
+        unsigned long _lastCheckpointMillis=0;
+        unsigned long _checkpointMillis=SDCHECKPOINTMILLIS;
+
+        bool _saveCheckpointIfDue();
+        bool _saveCheckpoint(bool newFile=false);
+        bool _loadCheckpoint(sdCheckpoint_t* ptrCheckpoint);
+        uint32_t _checkpointCheck(sdCheckpoint_t* ptrCheckpoint);
+        bool _resumeFile();
 
         bool _writeAppendFile(fs::FS &fs, const char * path, const char * message, const char * option);
+        bool _writeAppendBytes(fs::FS &fs, const char * path, const uint8_t * buffer, size_t size, const char * option);
+
+        void _recordFromVar(sdRecord_t* ptrRecord, varStamp_t* ptrVarStamp);
+        bool _varFromRecord(varStamp_t* ptrVarStamp, sdRecord_t* ptrRecord);
+        uint32_t _recordCheck(sdRecord_t* ptrRecord);
 
         uint64_t _size();
 
@@ -64,4 +256,4 @@ class SDBuffer {
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,141 @@
+#include <Arduino.h>
+#include "SDCodec.hpp"
+
+SDCodec::SDCodec() {
+    reset();
+}
+
+void SDCodec::reset() {
+
+    memset(_ts, 0, sizeof(_ts));
+    memset(_tsDelta, 0, sizeof(_tsDelta));
+    memset(_value, 0, sizeof(_value));
+}
+
+// Differences are computed with unsigned arithmetic: they wrap around like millis()
+
+int SDCodec::encode(sdRecord_t* ptrRecord, uint8_t* buffer) {
+
+    int size=0;
+    int varId = ptrRecord->varId;
+    bool extra = (ptrRecord->flags != 0 || ptrRecord->reserved != 0);
+
+    uint32_t tsDelta = ptrRecord->ts - _ts[varId];
+    uint32_t value = (uint32_t)ptrRecord->value;
+
+    size += _putVarint(&buffer[size], ((uint32_t)varId << 1) | (extra ? 1 : 0));
+
+    if (extra) {
+        buffer[size++] = ptrRecord->flags;
+        size += _putVarint(&buffer[size], ptrRecord->reserved);
+    }
+
+    size += _putVarint(&buffer[size], _zigzag(tsDelta - _tsDelta[varId]));
+    size += _putVarint(&buffer[size], _zigzag(value - _value[varId]));
+    buffer[size++] = _checkByte(ptrRecord);
+
+    _ts[varId] = ptrRecord->ts;
+    _tsDelta[varId] = tsDelta;
+    _value[varId] = value;
+
+    return(size);
+}
+
+// The state is only updated if the record is complete and its check byte matches
+
+int SDCodec::decode(const uint8_t* buffer, size_t size, sdRecord_t* ptrRecord) {
+
+    int pos=0;
+    int used=0;
+    uint32_t header=0, flags=0, reserved=0, tsDod=0, valueDelta=0;
+    sdRecord_t record;
+
+    if ((used = _getVarint(&buffer[pos], size - pos, &header)) == 0) return(0);
+    pos += used;
+
+    uint32_t varId = header >> 1;
+
+    if (varId >= MAXNUMVARS) return(0);
+
+    if (header & 1) {
+        if ((size_t)pos >= size) return(0);
+        flags = buffer[pos++];
+        if ((used = _getVarint(&buffer[pos], size - pos, &reserved)) == 0 || reserved > 0xFFFF) return(0);
+        pos += used;
+    }
+
+    if ((used = _getVarint(&buffer[pos], size - pos, &tsDod)) == 0) return(0);
+    pos += used;
+
+    if ((used = _getVarint(&buffer[pos], size - pos, &valueDelta)) == 0) return(0);
+    pos += used;
+
+    if ((size_t)pos >= size) return(0);
+
+    uint32_t tsDelta = _tsDelta[varId] + _unzigzag(tsDod);
+
+    record.varId = varId;
+    record.flags = flags;
+    record.reserved = reserved;
+    record.value = (int32_t)(_value[varId] + _unzigzag(valueDelta));
+    record.ts = _ts[varId] + tsDelta;
+    record.check = 0;
+
+    if (buffer[pos++] != _checkByte(&record)) return(0);
+
+    _tsDelta[varId] = tsDelta;
+    _ts[varId] = record.ts;
+    _value[varId] = (uint32_t)record.value;
+
+    *ptrRecord = record;
+
+    return(pos);
+}
+
+// FNV-1a of the record data (without its check), folded to a byte
+
+uint8_t SDCodec::_checkByte(sdRecord_t* ptrRecord) {
+
+    const uint8_t* bytes = (const uint8_t*)ptrRecord;
+    uint32_t check = 2166136261UL;
+
+    for (size_t i=0; i<offsetof(sdRecord_t, check); i++) {
+        check ^= bytes[i];
+        check *= 16777619UL;
+    }
+
+    return((uint8_t)(check ^ (check >> 8) ^ (check >> 16) ^ (check >> 24)));
+}
+
+// LEB128: 7 bits per byte, the high bit set if more bytes follow
+
+int SDCodec::_putVarint(uint8_t* buffer, uint32_t value) {
+
+    int size=0;
+
+    while (value >= 0x80) {
+        buffer[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    buffer[size++] = (uint8_t)value;
+
+    return(size);
+}
+
+int SDCodec::_getVarint(const uint8_t* buffer, size_t size, uint32_t* ptrValue) {
+
+    uint32_t value=0;
+
+    for (size_t i=0; i<size && i<5; i++) {
+
+        value |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+
+        if ((buffer[i] & 0x80) == 0) {
+            *ptrValue = value;
+            return(i + 1);
+        }
+    }
+
+    return(0);
+}
@@ -0,0 +1,60 @@
+#ifndef SDCODEC_HPP
+#define SDCODEC_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+// Type: Record of the SD buffer. Fixed size, to be read and written without formatting.
+
+typedef struct sdRecord_t {
+    uint8_t varId;
+    uint8_t flags;
+    uint16_t reserved; // millis of the time stamp (captures in interrupts)
+    int32_t value;
+    uint32_t ts;
+    uint32_t check; // To detect records partially written
+} sdRecord_t;
+
+#define SDRECORDSIZE sizeof(sdRecord_t)
+#define SDMAXENCODEDSIZE 16 // Max bytes of a compressed record (with its check byte)
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to compress the SD buffer records (Gorilla-style, byte aligned).
+// Each record is encoded against the previous record of the same variable:
+//   varint (varId << 1 | extra), [flags, varint reserved] if extra,
+//   varint zigzag(delta of the time stamp delta), varint zigzag(delta of the value), check byte.
+// The check byte is the FNV-1a of the decoded record folded to 8 bits: as each record is decoded
+// from the previous ones, a corrupted byte is also detected in the records after it.
+// A variable sampled with a constant period and a slowly changing value takes 4 bytes, instead of 16.
+// Values are integers, so the delta gives shorter varints than the XOR of Gorilla (made for floats).
+// The state is reset at the start of each segment, so each segment can be decoded alone.
+
+class SDCodec {
+
+    public:
+
+        SDCodec();
+        void reset();
+
+        int encode(sdRecord_t* ptrRecord, uint8_t* buffer); // Returns the bytes written (max SDMAXENCODEDSIZE)
+        int decode(const uint8_t* buffer, size_t size, sdRecord_t* ptrRecord); // Returns the bytes read. 0 if incomplete or corrupted (check of the record not set).
+
+    private:
+
+        uint32_t _ts[MAXNUMVARS]; // Last time stamp of each varId
+        uint32_t _tsDelta[MAXNUMVARS]; // Last time stamp delta of each varId
+        uint32_t _value[MAXNUMVARS]; // Last value of each varId
+
+        static int _putVarint(uint8_t* buffer, uint32_t value);
+        static int _getVarint(const uint8_t* buffer, size_t size, uint32_t* ptrValue);
+        static uint8_t _checkByte(sdRecord_t* ptrRecord);
+
+        static uint32_t _zigzag(uint32_t value) {return ((value << 1) ^ (uint32_t)((int32_t)value >> 31));};
+        static uint32_t _unzigzag(uint32_t value) {return ((value >> 1) ^ (0 - (value & 1)));};
+
+};
+
+#endif
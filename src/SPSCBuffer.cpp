@@ -0,0 +1,183 @@
+#include <Arduino.h>
+#include "SPSCBuffer.hpp"
+
+SPSCBuffer::SPSCBuffer() {
+}
+
+
+// Producer
+
+int SPSCBuffer::reserve(varStamp_t** ptrSlots, int maxNum) {
+
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    uint32_t numFree = SPSCBUFFERSIZE - (tail - _headCache);
+
+    if ((int)numFree < maxNum) {
+        _headCache = _head.load(std::memory_order_acquire);
+        numFree = SPSCBUFFERSIZE - (tail - _headCache);
+    }
+
+    uint32_t pos = tail % SPSCBUFFERSIZE;
+    int num = min(min((int)numFree, maxNum), (int)(SPSCBUFFERSIZE - pos));
+
+    *ptrSlots = &_records[pos];
+
+    return(num);
+}
+
+void SPSCBuffer::commit(int num) {
+
+    _tail.store(_tail.load(std::memory_order_relaxed) + num, std::memory_order_release);
+}
+
+bool SPSCBuffer::push(varStamp_t* ptrVarStamp) {
+
+    varStamp_t* ptrSlot;
+
+    if (reserve(&ptrSlot, 1) == 0) return(false);
+
+    *ptrSlot = *ptrVarStamp;
+    commit(1);
+
+    return(true);
+}
+
+// Two blocks at most (before and after the end of the ring)
+
+int SPSCBuffer::pushMany(varStamp_t* ptrVarStamps, int num) {
+
+    varStamp_t* ptrSlots;
+    int numPushed = 0;
+
+    for (int block=0; block<2 && numPushed < num; block++) {
+
+        int numSlots = reserve(&ptrSlots, num - numPushed);
+
+        if (numSlots == 0) break;
+
+        memcpy(ptrSlots, &ptrVarStamps[numPushed], numSlots * sizeof(varStamp_t));
+        commit(numSlots);
+        numPushed += numSlots;
+    }
+
+    return(numPushed);
+}
+
+
+// The producer can not move the head: the oldest records are dropped by the consumer.
+// ptrLost: the record the request drops, unless the consumer reads it first (then the next one is dropped).
+// The slots from the head are only written by the producer, so they can be read while the consumer runs.
+
+bool SPSCBuffer::dropOldest(varStamp_t* ptrLost) {
+
+    _headCache = _head.load(std::memory_order_acquire);
+
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    int numToDrop = _numToDrop.load(std::memory_order_relaxed);
+
+    if ((int)(tail - _headCache) <= numToDrop) return(false);
+
+    *ptrLost = _records[(_headCache + numToDrop) % SPSCBUFFERSIZE];
+    _numToDrop.fetch_add(1, std::memory_order_relaxed);
+
+    return(true);
+}
+
+
+// Consumer
+
+void SPSCBuffer::_applyDrops() {
+
+    int numToDrop = _numToDrop.load(std::memory_order_relaxed);
+
+    if (numToDrop == 0) return;
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    _tailCache = _tail.load(std::memory_order_acquire);
+
+    int numDropped = min(numToDrop, (int)(_tailCache - head));
+
+    _head.store(head + numDropped, std::memory_order_release);
+    _numToDrop.fetch_sub(numToDrop, std::memory_order_relaxed);
+    _numDropped.fetch_add(numDropped, std::memory_order_relaxed);
+}
+
+int SPSCBuffer::readable(varStamp_t** ptrSlots, int maxNum) {
+
+    _applyDrops();
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    uint32_t numRecords = _tailCache - head;
+
+    if ((int)numRecords < maxNum) {
+        _tailCache = _tail.load(std::memory_order_acquire);
+        numRecords = _tailCache - head;
+    }
+
+    uint32_t pos = head % SPSCBUFFERSIZE;
+    int num = min(min((int)numRecords, maxNum), (int)(SPSCBUFFERSIZE - pos));
+
+    *ptrSlots = &_records[pos];
+
+    return(num);
+}
+
+void SPSCBuffer::release(int num) {
+
+    _head.store(_head.load(std::memory_order_relaxed) + num, std::memory_order_release);
+}
+
+bool SPSCBuffer::peek(varStamp_t* ptrVarStamp) {
+
+    varStamp_t* ptrSlot;
+
+    if (readable(&ptrSlot, 1) == 0) return(false);
+
+    *ptrVarStamp = *ptrSlot;
+
+    return(true);
+}
+
+bool SPSCBuffer::pop(varStamp_t* ptrVarStamp) {
+
+    if (!peek(ptrVarStamp)) return(false);
+
+    release(1);
+
+    return(true);
+}
+
+int SPSCBuffer::popMany(varStamp_t* ptrVarStamps, int maxNum) {
+
+    varStamp_t* ptrSlots;
+    int numPopped = 0;
+
+    for (int block=0; block<2 && numPopped < maxNum; block++) {
+
+        int numRecords = readable(&ptrSlots, maxNum - numPopped);
+
+        if (numRecords == 0) break;
+
+        memcpy(&ptrVarStamps[numPopped], ptrSlots, numRecords * sizeof(varStamp_t));
+        release(numRecords);
+        numPopped += numRecords;
+    }
+
+    return(numPopped);
+}
+
+
+// Any task. The two indexes are read at different times: the result is approximate
+// if the other task is working, but always between 0 and the capacity.
+
+int SPSCBuffer::size() {
+
+    uint32_t head = _head.load(std::memory_order_acquire);
+    uint32_t tail = _tail.load(std::memory_order_acquire);
+
+    return(constrain((int)(tail - head), 0, SPSCBUFFERSIZE));
+}
+
+int SPSCBuffer::spaces() {
+    return(SPSCBUFFERSIZE - size());
+}
@@ -0,0 +1,76 @@
+#ifndef SPSCBUFFER_HPP
+#define SPSCBUFFER_HPP
+
+#include <Arduino.h>
+#include <atomic>
+#include "dataStructure.h"
+
+#define SPSCBUFFERSIZE MAXBUFFER // Records of the ring (power of two)
+#define SPSCCACHELINE 64 // Bytes of a cache line: padding between the records and the indexes of each side
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Lock-free ring buffer with a single producer task (the log) and a single consumer task (the sender).
+// The producer only writes the tail and the consumer only writes the head, so no critical section
+// is needed: the records are written before the tail is published (release), and read after it
+// is seen (acquire). Each index is in its own cache line, with a copy of the other index,
+// so each side only reads the other one when its copy says the ring is full (or empty).
+// The lines are separated by a full line of padding (not by alignment: the object can be
+// allocated with new, which does not align to cache lines before C++17), so the records and
+// the two sides never share a line wherever the object is.
+// Records can be written and read in place by batches (reserve/commit, readable/release).
+
+class SPSCBuffer {
+
+    public:
+
+        SPSCBuffer();
+
+        // Producer
+
+        int reserve(varStamp_t** ptrSlots, int maxNum); // Contiguous free slots (up to the end of the ring). Returns how many.
+        void commit(int num); // Publish the first num reserved slots
+        bool push(varStamp_t* ptrVarStamp);
+        int pushMany(varStamp_t* ptrVarStamps, int num); // Returns the records pushed
+        bool dropOldest(varStamp_t* ptrLost); // The consumer drops the oldest record on its next read. False if all are requested.
+
+        // Consumer
+
+        int readable(varStamp_t** ptrSlots, int maxNum); // Contiguous records (up to the end of the ring). Returns how many.
+        void release(int num); // Free the first num readable records
+        bool peek(varStamp_t* ptrVarStamp);
+        bool pop(varStamp_t* ptrVarStamp);
+        int popMany(varStamp_t* ptrVarStamps, int maxNum); // Returns the records popped
+        unsigned long numDropped() {return(_numDropped.load(std::memory_order_relaxed));}; // Done (the requests are discarded if the ring empties first)
+
+        // Any task
+
+        int size();
+        int spaces();
+        int capacity() {return(SPSCBUFFERSIZE);};
+
+    private:
+
+        varStamp_t _records[SPSCBUFFERSIZE];
+        char _padRecords[SPSCCACHELINE];
+
+        // Indexes run freely (wrap around at 2^32). Position in the ring: index % SPSCBUFFERSIZE
+
+        std::atomic<uint32_t> _head{0}; // Next record to read (written by the consumer)
+        uint32_t _tailCache=0; // Consumer copy of the tail
+        char _padHead[SPSCCACHELINE];
+
+        std::atomic<uint32_t> _tail{0}; // Next slot to write (written by the producer)
+        uint32_t _headCache=0; // Producer copy of the head
+        char _padTail[SPSCCACHELINE]; // From the next members of the owner
+
+        std::atomic<int> _numToDrop{0}; // Requested by the producer (overflow policy), done by the consumer
+        std::atomic<unsigned long> _numDropped{0};
+
+        void _applyDrops();
+
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include <Arduino.h>
+#include "TokenBucket.hpp"
+
+// The bucket starts full
+
+TokenBucket::TokenBucket(float tokensPerSecond, int burst) {
+
+    setRate(tokensPerSecond, burst);
+    _microTokens = (int64_t)_burst * TOKENSCALE;
+}
+
+void TokenBucket::setRate(float tokensPerSecond, int burst) {
+
+    _milliRate = (uint32_t)max(tokensPerSecond * 1000.0f, 1.0f);
+    _burst = max(burst, 1);
+    _microTokens = min(_microTokens, (int64_t)_burst * TOKENSCALE);
+}
+
+bool TokenBucket::take(unsigned long nowMillis) {
+
+    _refill(nowMillis);
+
+    if (_microTokens < TOKENSCALE) return(false);
+
+    _microTokens -= TOKENSCALE;
+
+    return(true);
+}
+
+unsigned long TokenBucket::millisToNextToken(unsigned long nowMillis) {
+
+    _refill(nowMillis);
+
+    if (_microTokens >= TOKENSCALE) return(0);
+
+    return((unsigned long)((TOKENSCALE - _microTokens + _milliRate - 1) / _milliRate));
+}
+
+// Elapsed millis (wrap around safe) times the rate. The first call only takes the time.
+
+void TokenBucket::_refill(unsigned long nowMillis) {
+
+    if (_isStarted) {
+        unsigned long elapsed = nowMillis - _lastMillis;
+        _microTokens = min(_microTokens + (int64_t)elapsed * _milliRate, (int64_t)_burst * TOKENSCALE);
+    }
+
+    _lastMillis = nowMillis;
+    _isStarted = true;
+}
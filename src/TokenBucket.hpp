@@ -0,0 +1,40 @@
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <Arduino.h>
+
+#define TOKENSCALE 1000000 // Tokens are counted in micro tokens (integer refill, without remainders)
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to limit a rate with a token bucket: tokens are added at a sustained rate, up to the burst
+// size. Each action takes one token, so after an idle time up to burst actions can be done at once.
+
+class TokenBucket {
+
+    public:
+
+        TokenBucket(float tokensPerSecond=1, int burst=1);
+
+        void setRate(float tokensPerSecond, int burst); // The tokens available are kept (up to the new burst)
+        float rate() {return (_milliRate / 1000.0);};
+        int burst() {return (_burst);};
+
+        bool take(unsigned long nowMillis); // Takes a token, if available
+        unsigned long millisToNextToken(unsigned long nowMillis); // 0 if a token is available
+
+    private:
+
+        uint32_t _milliRate; // Milli tokens per second (micro tokens per millisecond)
+        int _burst;
+        int64_t _microTokens=0;
+        unsigned long _lastMillis=0;
+        bool _isStarted=false;
+
+        void _refill(unsigned long nowMillis);
+
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include <Arduino.h>
+#include "VarAggregator.hpp"
+
+VarAggregator::VarAggregator() {
+}
+
+int VarAggregator::add(int* ptrValue, unsigned long windowMillis, int* varIds, unsigned long nowMillis) {
+
+    if (_numAggregates >= MAXAGGREGATES) return(-1);
+
+    aggregate_t* ptrAggregate = &_aggregates[_numAggregates];
+
+    ptrAggregate->ptrValue = ptrValue;
+    ptrAggregate->windowMillis = max(windowMillis, 1UL);
+
+    for (int i=0; i<AGGNUMSTATS; i++) ptrAggregate->varIds[i] = varIds[i];
+
+    startWindow(ptrAggregate, nowMillis);
+
+    return(_numAggregates++);
+}
+
+void VarAggregator::addSample(aggregate_t* ptrAggregate, int value) {
+
+    if (ptrAggregate->count == 0 || value < ptrAggregate->minValue) ptrAggregate->minValue = value;
+    if (ptrAggregate->count == 0 || value > ptrAggregate->maxValue) ptrAggregate->maxValue = value;
+
+    ptrAggregate->lastValue = value;
+    ptrAggregate->sum += value;
+    ptrAggregate->count++;
+}
+
+bool VarAggregator::isWindowOver(aggregate_t* ptrAggregate, unsigned long nowMillis) {
+
+    return((nowMillis - ptrAggregate->windowStart) >= ptrAggregate->windowMillis);
+}
+
+// The average is rounded to the nearest integer
+
+bool VarAggregator::getStat(aggregate_t* ptrAggregate, int statIndex, int* ptrValue) {
+
+    if (ptrAggregate->count == 0) return(false);
+
+    switch (1 << statIndex) {
+
+        case AGG_MIN: *ptrValue = ptrAggregate->minValue; break;
+        case AGG_MAX: *ptrValue = ptrAggregate->maxValue; break;
+        case AGG_COUNT: *ptrValue = ptrAggregate->count; break;
+        case AGG_LAST: *ptrValue = ptrAggregate->lastValue; break;
+
+        case AGG_AVG: {
+            int64_t halfCount = ptrAggregate->count / 2;
+            int64_t sum = ptrAggregate->sum + (ptrAggregate->sum >= 0 ? halfCount : -halfCount);
+            *ptrValue = (int)(sum / ptrAggregate->count);
+            break;
+        }
+
+        default: return(false);
+    }
+
+    return(true);
+}
+
+void VarAggregator::startWindow(aggregate_t* ptrAggregate, unsigned long nowMillis) {
+
+    ptrAggregate->windowStart = nowMillis;
+    ptrAggregate->count = 0;
+    ptrAggregate->sum = 0;
+}
+
+unsigned long VarAggregator::millisToNextWindow(unsigned long nowMillis) {
+
+    unsigned long millisToNext = ULONG_MAX;
+
+    for (int i=0; i<_numAggregates; i++) {
+
+        unsigned long elapsed = nowMillis - _aggregates[i].windowStart;
+        unsigned long left = (elapsed >= _aggregates[i].windowMillis) ? 0 : _aggregates[i].windowMillis - elapsed;
+
+        millisToNext = min(millisToNext, left);
+    }
+
+    return(millisToNext);
+}
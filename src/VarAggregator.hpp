@@ -0,0 +1,70 @@
+#ifndef VARAGGREGATOR_HPP
+#define VARAGGREGATOR_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+#define MAXAGGREGATES 8 // Max num of aggregated variables
+
+// Statistics of a window (a registered variable for each one selected)
+
+typedef enum aggStat_t {
+    AGG_MIN = 0x01,
+    AGG_MAX = 0x02,
+    AGG_AVG = 0x04,
+    AGG_COUNT = 0x08, // Samples in the window
+    AGG_LAST = 0x10
+} aggStat_t;
+
+#define AGGNUMSTATS 5
+#define AGGDEFAULTSTATS (AGG_MIN | AGG_MAX | AGG_AVG)
+
+// Type: Aggregated variable, and the statistics of its current window
+
+typedef struct aggregate_t {
+    int* ptrValue;
+    unsigned long windowMillis;
+    int varIds[AGGNUMSTATS]; // varId of each statistic (-1 if not selected), in the order of aggStat_t
+
+    unsigned long windowStart; // millis
+    int count;
+    int minValue;
+    int maxValue;
+    int lastValue;
+    int64_t sum;
+} aggregate_t;
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to compute streaming statistics of fast variables by windows.
+// Every update adds a sample (a few compares and an addition). At the end of each window,
+// the log sends one value per statistic, and the window starts again.
+
+class VarAggregator {
+
+    public:
+
+        VarAggregator();
+
+        int add(int* ptrValue, unsigned long windowMillis, int* varIds, unsigned long nowMillis); // Returns the index, or -1 if full
+
+        int numAggregates() {return (_numAggregates);};
+        aggregate_t* at(int index) {return (&_aggregates[index]);};
+
+        void addSample(aggregate_t* ptrAggregate, int value);
+        bool isWindowOver(aggregate_t* ptrAggregate, unsigned long nowMillis);
+        bool getStat(aggregate_t* ptrAggregate, int statIndex, int* ptrValue); // False if the window is empty
+        void startWindow(aggregate_t* ptrAggregate, unsigned long nowMillis);
+
+        unsigned long millisToNextWindow(unsigned long nowMillis); // ULONG_MAX if there are no aggregates
+
+    private:
+
+        aggregate_t _aggregates[MAXAGGREGATES];
+        int _numAggregates=0;
+
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include <Arduino.h>
+#include "VarFilter.hpp"
+
+VarFilter::VarFilter() {
+
+    for (int i=0; i<MAXNUMVARS; i++) _filterIndex[i] = -1;
+}
+
+bool VarFilter::set(int varId, varFilterType_t type, int param) {
+
+    if (varId < 0 || varId >= MAXNUMVARS) return(false);
+
+    int index = _filterIndex[varId];
+
+    // Removed: the last filter takes its position
+
+    if (type == FILTER_NONE) {
+
+        if (index < 0) return(true);
+
+        _numFilters--;
+        _filters[index] = _filters[_numFilters];
+        _filterIndex[_filters[index].varId] = index;
+        _filterIndex[varId] = -1;
+
+        return(true);
+    }
+
+    if (type == FILTER_IIR && (param < 1 || param >= FILTERIIRBITS)) return(false);
+    if (type != FILTER_IIR && (param < 1 || param > FILTERMAXWINDOW)) return(false);
+
+    if (index < 0) {
+        if (_numFilters >= MAXFILTERS) return(false);
+        index = _numFilters++;
+        _filterIndex[varId] = index;
+    }
+
+    _filters[index].varId = varId;
+    _filters[index].type = type;
+    _filters[index].param = param;
+
+    reset(varId);
+
+    return(true);
+}
+
+void VarFilter::reset(int varId) {
+
+    varFilter_t* ptrFilter = of(varId);
+
+    if (ptrFilter == NULL) return;
+
+    ptrFilter->pos = 0;
+    ptrFilter->count = 0;
+    ptrFilter->sum = 0;
+    ptrFilter->output = 0;
+}
+
+// The outputs are rounded to the nearest integer
+
+void VarFilter::addSample(varFilter_t* ptrFilter, int value) {
+
+    switch (ptrFilter->type) {
+
+        case FILTER_MOVINGAVG: {
+
+            if (ptrFilter->count == ptrFilter->param) ptrFilter->sum -= ptrFilter->window[ptrFilter->pos];
+            else ptrFilter->count++;
+
+            ptrFilter->window[ptrFilter->pos] = value;
+            ptrFilter->pos = (ptrFilter->pos + 1) % ptrFilter->param;
+            ptrFilter->sum += value;
+
+            int64_t halfCount = ptrFilter->count / 2;
+            ptrFilter->output = (int)((ptrFilter->sum + (ptrFilter->sum >= 0 ? halfCount : -halfCount)) / ptrFilter->count);
+            break;
+        }
+
+        case FILTER_IIR: {
+
+            int64_t sample = (int64_t)value << FILTERIIRBITS;
+
+            if (ptrFilter->count == 0) ptrFilter->sum = sample;
+            else ptrFilter->sum += (sample - ptrFilter->sum) >> ptrFilter->param;
+
+            ptrFilter->count = 1;
+            ptrFilter->output = (int)((ptrFilter->sum + ((int64_t)1 << (FILTERIIRBITS - 1))) >> FILTERIIRBITS);
+            break;
+        }
+
+        case FILTER_MEDIAN: {
+
+            if (ptrFilter->count < ptrFilter->param) ptrFilter->count++;
+
+            ptrFilter->window[ptrFilter->pos] = value;
+            ptrFilter->pos = (ptrFilter->pos + 1) % ptrFilter->param;
+
+            ptrFilter->output = _median(ptrFilter);
+            break;
+        }
+
+        default:
+            ptrFilter->output = value;
+    }
+}
+
+// Insertion sort of a copy of the window (up to FILTERMAXWINDOW samples)
+
+int VarFilter::_median(varFilter_t* ptrFilter) {
+
+    int sorted[FILTERMAXWINDOW];
+
+    for (int i=0; i<ptrFilter->count; i++) {
+
+        int value = ptrFilter->window[i];
+        int j = i;
+
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+
+        sorted[j] = value;
+    }
+
+    return(sorted[ptrFilter->count / 2]);
+}
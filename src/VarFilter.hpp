@@ -0,0 +1,67 @@
+#ifndef VARFILTER_HPP
+#define VARFILTER_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+#define MAXFILTERS 8 // Max num of filtered variables
+#define FILTERMAXWINDOW 16 // Max samples of the moving average and median windows
+#define FILTERIIRBITS 16 // Fractional bits of the IIR state (Q16)
+
+// Filter applied to the samples of a variable
+
+typedef enum varFilterType_t {
+    FILTER_NONE,
+    FILTER_MOVINGAVG, // Average of the last param samples
+    FILTER_IIR, // First order low pass: y += (x - y) / 2^param. Time constant ~2^param samples.
+    FILTER_MEDIAN // Median of the last param samples (removes spikes)
+} varFilterType_t;
+
+// Type: Filter of a variable, and its state
+
+typedef struct varFilter_t {
+    int varId;
+    varFilterType_t type;
+    int param; // Window (moving average, median) or shift (IIR)
+
+    int window[FILTERMAXWINDOW]; // Last samples (moving average, median)
+    int pos; // Next position of the window
+    int count; // Samples in the window (or 1 after the first sample, IIR)
+    int64_t sum; // Sum of the window (moving average) or state in fixed point (IIR)
+    int output;
+} varFilter_t;
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to filter the samples of the variables, with integer arithmetic only.
+// Every update adds the raw sample of each filtered variable, and the log checks the output
+// (threshold, compression) instead of the raw value. The output of the first sample is the sample.
+
+class VarFilter {
+
+    public:
+
+        VarFilter();
+
+        bool set(int varId, varFilterType_t type, int param); // FILTER_NONE removes the filter. False if not valid or full.
+        void reset(int varId); // Start again from the next sample
+
+        int numFilters() {return (_numFilters);};
+        varFilter_t* at(int index) {return (&_filters[index]);};
+        varFilter_t* of(int varId) {return (_filterIndex[varId] >= 0 ? &_filters[_filterIndex[varId]] : NULL);};
+
+        void addSample(varFilter_t* ptrFilter, int value);
+
+    private:
+
+        varFilter_t _filters[MAXFILTERS];
+        int _numFilters=0;
+        int8_t _filterIndex[MAXNUMVARS]; // Filter of each varId (-1 if not filtered)
+
+        int _median(varFilter_t* ptrFilter);
+
+};
+
+#endif
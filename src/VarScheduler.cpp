@@ -0,0 +1,143 @@
+#include <Arduino.h>
+#include "VarScheduler.hpp"
+
+VarScheduler::VarScheduler() {
+    clear();
+}
+
+void VarScheduler::clear() {
+
+    for (int i=0; i<MAXNUMVARS; i++) {
+        _heapPos[i] = -1;
+        _watchedPos[i] = -1;
+    }
+
+    _numScheduled = 0;
+    _numWatched = 0;
+}
+
+
+// Heap of variables waiting for a due time
+
+void VarScheduler::schedule(int varId, unsigned long dueMillis) {
+
+    int pos = _heapPos[varId];
+
+    _due[varId] = dueMillis;
+
+    if (pos < 0) {
+        pos = _numScheduled;
+        _heap[pos] = varId;
+        _heapPos[varId] = pos;
+        _numScheduled++;
+    }
+
+    // The new due time can be before or after the old one
+    _siftUp(pos);
+    _siftDown(_heapPos[varId]);
+}
+
+void VarScheduler::remove(int varId) {
+
+    int pos = _heapPos[varId];
+
+    if (pos < 0) return;
+
+    _numScheduled--;
+
+    if (pos != _numScheduled) {
+        _swap(pos, _numScheduled);
+        _siftUp(pos);
+        _siftDown(_heapPos[_heap[pos]]);
+    }
+
+    _heapPos[varId] = -1;
+}
+
+bool VarScheduler::popDue(unsigned long nowMillis, int* ptrVarId) {
+
+    if (_numScheduled == 0) return(false);
+    if (_isBefore(nowMillis, _due[_heap[0]])) return(false);
+
+    *ptrVarId = _heap[0];
+    remove(_heap[0]);
+
+    return(true);
+}
+
+bool VarScheduler::isScheduled(int varId) {
+    return(_heapPos[varId] >= 0);
+}
+
+bool VarScheduler::empty() {
+    return(_numScheduled == 0);
+}
+
+unsigned long VarScheduler::nextDueMillis() {
+    return(_due[_heap[0]]);
+}
+
+void VarScheduler::_siftUp(int pos) {
+
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!_isBefore(_due[_heap[pos]], _due[_heap[parent]])) break;
+        _swap(pos, parent);
+        pos = parent;
+    }
+}
+
+void VarScheduler::_siftDown(int pos) {
+
+    while (true) {
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        int first = pos;
+
+        if (left < _numScheduled && _isBefore(_due[_heap[left]], _due[_heap[first]])) first = left;
+        if (right < _numScheduled && _isBefore(_due[_heap[right]], _due[_heap[first]])) first = right;
+        if (first == pos) break;
+
+        _swap(pos, first);
+        pos = first;
+    }
+}
+
+void VarScheduler::_swap(int posA, int posB) {
+
+    int varA = _heap[posA];
+    int varB = _heap[posB];
+
+    _heap[posA] = varB;
+    _heap[posB] = varA;
+    _heapPos[varB] = posA;
+    _heapPos[varA] = posB;
+}
+
+
+// Watched list (unordered, removal by swapping with the last one)
+
+void VarScheduler::watch(int varId) {
+
+    if (_watchedPos[varId] >= 0) return;
+
+    _watched[_numWatched] = varId;
+    _watchedPos[varId] = _numWatched;
+    _numWatched++;
+}
+
+void VarScheduler::unwatch(int varId) {
+
+    int pos = _watchedPos[varId];
+
+    if (pos < 0) return;
+
+    _numWatched--;
+    _watched[pos] = _watched[_numWatched];
+    _watchedPos[_watched[pos]] = pos;
+    _watchedPos[varId] = -1;
+}
+
+bool VarScheduler::isWatched(int varId) {
+    return(_watchedPos[varId] >= 0);
+}
@@ -0,0 +1,68 @@
+#ifndef VARSCHEDULER_HPP
+#define VARSCHEDULER_HPP
+
+#include <Arduino.h>
+#include "dataStructure.h"
+
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// Class to schedule the sampling of the registered variables.
+// Variables waiting for a period are kept in a min-heap ordered by the millis
+// when they are due, so only the due ones are visited by the log update.
+// Variables that are due but waiting for a change (threshold) are "watched":
+// they are checked on every update until they are sampled.
+
+class VarScheduler {
+
+    public:
+
+        VarScheduler();
+
+        void clear();
+
+        // Heap of variables waiting for a due time
+
+        void schedule(int varId, unsigned long dueMillis); // Insert or move the variable
+        void remove(int varId);
+        bool popDue(unsigned long nowMillis, int* ptrVarId); // Remove and return the first due variable
+        bool isScheduled(int varId);
+
+        bool empty();
+        unsigned long nextDueMillis(); // Due time of the first variable (only valid if not empty)
+
+        // Variables checked on every update
+
+        void watch(int varId);
+        void unwatch(int varId);
+        bool isWatched(int varId);
+
+        int numWatched() {return (_numWatched);};
+        int watchedAt(int index) {return (_watched[index]);};
+
+    private:
+
+        // Heap
+
+        int _heap[MAXNUMVARS]; // varIds ordered by due time
+        unsigned long _due[MAXNUMVARS]; // due time of each varId
+        int _heapPos[MAXNUMVARS]; // position of each varId in the heap (-1 if not scheduled)
+        int _numScheduled=0;
+
+        void _siftUp(int pos);
+        void _siftDown(int pos);
+        void _swap(int posA, int posB);
+
+        // millis() overflows every 49 days: compare the difference, not the values
+        bool _isBefore(unsigned long a, unsigned long b) {return ((long)(a - b) < 0);};
+
+        // Watched list
+
+        int _watched[MAXNUMVARS];
+        int _watchedPos[MAXNUMVARS]; // position of each varId in the watched list (-1 if not watched)
+        int _numWatched=0;
+
+};
+
+#endif
@@ -6,9 +6,20 @@
 // Library defines
 
 #define MAXNUMVARS 32 // Max num of variables to log
-#define MAXBUFFER 64 // Max size of the ram buffer
+#define MAXBUFFER 128 // Max size of the ram buffer (12 bytes per record)
 #define MAXCHARVARNAME 15 // Maximum chars of the var name
 
+#define VARPRIORITYMAX 3 // Priority of the variables whose minPeriod is never stretched by the backpressure
+#define VARPRIORITYDEFAULT 1
+
+// Type: How a variable is compressed (which samples are sent)
+
+typedef enum varCompression_t {
+    VAR_THRESHOLD, // Sent if the change is bigger than the threshold (after minPeriod), or after maxPeriod
+    VAR_DEADBAND, // Same, also sending the last value inside the band before a change, so steps are kept
+    VAR_SWINGINGDOOR // Only the points needed to rebuild the signal (linear interpolation) within +-threshold, or after maxPeriod
+} varCompression_t;
+
 // Type: Single registered variable
 
 typedef struct varRegister_t {
@@ -17,10 +28,23 @@ typedef struct varRegister_t {
     int minPeriod;  // updating minimum period
     int threshold;  // threshold in case of updating by change (optional)
     int maxPeriod;  // max time without updating (optional)
+    char shortName[MAXCHARVARNAME + 1]; // name truncated, to resolve the varId of the buffered samples (read by other tasks)
+    varCompression_t compression; // threshold is the tolerance of the dead band and the swinging door
+    int priority; // 0..VARPRIORITYMAX. The lower, the more its minPeriod is stretched when the buffer fills.
 
     int _lastValue; // last value sent
     unsigned long _lastUpdateTime; // millis when las value was sent
 
+    // Compression state (dead band and swinging door): last sample checked, and doors of the swinging door
+
+    bool _isHeldValid;
+    bool _isHeldSent;
+    int _heldValue;
+    unsigned long _heldTime; // millis
+    unsigned long _heldTs;
+    float _slopeUpper; // Max slope from the last value sent to (sample - threshold) of the samples not sent
+    float _slopeLower; // Min slope from the last value sent to (sample + threshold) of the samples not sent
+
 } varRegister_t;
 
 // Type: List of registered variables.
@@ -32,10 +56,11 @@ typedef struct varRegisterList_t {
 
 
 // Type: Variable with time stamp. (Used to push to the buffer)
+// The name is not copied: it is resolved from the varId with the list of registered variables.
 
 typedef struct varStamp_t {
-    char varName[MAXCHARVARNAME];
     uint8_t  varId;
+    uint16_t tsMillis; // millis of the time stamp (0..999). Set by the captures in interrupts, 0 if not known.
     int	value;
     unsigned long ts;
 } varStamp_t;